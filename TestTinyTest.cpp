@@ -32,6 +32,20 @@
 #include <iostream>
 #include <vector>
 #include <deque>
+#include <list>
+#include <iterator>
+#include <atomic>
+#include <thread>
+#include <numeric>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <new>
 
 using std::cerr;
 using std::endl;
@@ -64,6 +78,70 @@ exceptionAvoider(size_t x, size_t y) {
   return x * y;
 }
 
+/**
+ * \brief A fixture standing in for an expensive reference dataset; it counts
+ *        how many times it is constructed so tests can check it is shared.
+ */
+struct ReferenceData {
+  ReferenceData() : values(1000, 0.5) { ++constructions; }
+  std::vector<double> values;
+  static std::atomic<size_t> constructions;
+};
+std::atomic<size_t> ReferenceData::constructions(0);
+
+/**
+ * \brief A fixture that each worker thread gets its own copy of; it records
+ *        the thread that constructed it.
+ */
+struct PerWorkerData : public TinyTest::PerWorkerFixture {
+  PerWorkerData() : owner(std::this_thread::get_id()) {;}
+  std::thread::id owner;
+};
+
+/**
+ * \brief The number of tests using the resource "scratchDir" at the moment.
+ *        It's in memory shared with the forked workers used by --isolate,
+ *        so that it counts the tests running in them too.
+ */
+static std::atomic<int>* const scratchDirUsers =
+  new (::mmap(NULL, sizeof(std::atomic<int>), PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_ANONYMOUS, -1, 0)) std::atomic<int>(0);
+
+/**
+ * \brief Use the scratch directory for a little while; returns the number
+ *        of other tests that were using it at the time.
+ */
+static int
+useScratchDir() {
+  int others = scratchDirUsers->fetch_add(1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  scratchDirUsers->fetch_sub(1);
+  return others;
+}
+
+#ifdef TINYTEST_HAS_COROUTINES
+/**
+ * \brief Write message to fd after a short wait, as a slow peer would.
+ */
+static TinyTest::AsyncTask
+writeLater(int fd, std::string message) {
+  co_await TinyTest::sleepFor(std::chrono::milliseconds(10));
+  co_await TinyTest::writable(fd);
+  EXPECT_EQUAL(::write(fd, message.data(), message.size()),
+               ssize_t(message.size()));
+}
+
+/**
+ * \brief Check that x is 1 after a short wait; used to test that failures
+ *        in coroutines an async test awaits are attributed to it.
+ */
+static TinyTest::AsyncTask
+expectOneLater(int x) {
+  co_await TinyTest::sleepFor(std::chrono::milliseconds(5));
+  EXPECT_EQUAL(x, 1);
+}
+#endif
+
 
 /******************************************************************************
  **                                 TESTS                                    **
@@ -257,3 +335,876 @@ TEST(testThrowsExceptionFail) {
 TEST(testUnxpctdExceptionFail) {
   exceptionThrower(5, 6);
 }
+
+/**
+ * \brief Test that a failure message the reporters have to escape (quotes,
+ *        markup, a tab, a line break, a control character and bytes that
+ *        aren't UTF-8) is still written out validly by each of them.
+ */
+TEST(testAwkwardMessageFail) {
+  throw std::runtime_error("\"<a & b>\"\tline\nbreak \x01 \xff\xfe end");
+}
+
+/**
+ * \brief Test that the comparison macros evaluate each of their arguments
+ *        exactly once, even when the comparison fails.
+ */
+TEST(testSingleEvaluationPass) {
+  size_t calls = 0;
+  std::vector<int> v(3, 1);
+  EXPECT_EQUAL(++calls, 1u);
+  EXPECT_NOT_EQUAL(++calls, 5u);
+  EXPECT_NEAR(double(++calls), 3.0, 0.1);
+  EXPECT_NEAR_STL_CONTAINER((++calls, v), v, [&] { return (++calls, 0.1); }());
+  EXPECT_THROWS(SampleException, exceptionThrower(++calls, 0));
+  EXPECT_EQUAL(calls, 6u);
+  try {
+    EXPECT_EQUAL(++calls, 0u);
+  } catch (const TinyTestException& e) {}
+  EXPECT_EQUAL(calls, 7u);
+}
+
+/**
+ * \brief Test that a failed comparison of large containers reports only a
+ *        few elements around the first mismatch, and how many mismatches
+ *        there were in total.
+ */
+TEST(testContainerEqualFailLarge) {
+  std::vector<int> one(1000, 0);
+  std::vector<int> two(1000, 0);
+  for (size_t i = 0; i < one.size(); ++i) one[i] = two[i] = i;
+  two[500] = -1;
+  two[700] = -1;
+  EXPECT_EQUAL_STL_CONTAINER(one, two);
+}
+
+/**
+ * \brief Test the relative tolerance container macro passes when elements of
+ *        very different magnitudes are each within the tolerance.
+ */
+TEST(testContainerNearRelativePass) {
+  std::vector<double> one;
+  std::vector<double> two;
+  one.push_back(1000.0); two.push_back(1000.1);
+  one.push_back(1e-3);   two.push_back(1.0001e-3);
+  one.push_back(-5.0);   two.push_back(-5.0);
+  EXPECT_NEAR_RELATIVE_STL_CONTAINER(one, two, 1e-3);
+}
+
+/**
+ * \brief Test the relative tolerance container macro fails when the relative
+ *        difference exceeds the tolerance.
+ */
+TEST(testContainerNearRelativeFail) {
+  std::vector<double> one;
+  std::vector<double> two;
+  one.push_back(1000.0); two.push_back(1000.1);
+  one.push_back(1e-3);   two.push_back(1.0001e-3);
+  EXPECT_NEAR_RELATIVE_STL_CONTAINER(one, two, 1e-5);
+}
+
+/**
+ * \brief Test the ULP container macro passes on floats that are adjacent
+ *        representable values, and on positive and negative zero.
+ */
+TEST(testContainerNearUlpsPass) {
+  std::vector<float> one(100, 1.0f);
+  std::vector<float> two(100, std::nextafter(1.0f, 2.0f));
+  one[50] = 0.0f; two[50] = -0.0f;
+  EXPECT_NEAR_ULPS_STL_CONTAINER(one, two, 1);
+}
+
+/**
+ * \brief Test the ULP container macro fails when floats are further apart
+ *        than the given number of ULPs.
+ */
+TEST(testContainerNearUlpsFail) {
+  std::vector<float> one(100, 1.0f);
+  std::vector<float> two(one);
+  two[70] = std::nextafter(std::nextafter(1.0f, 2.0f), 2.0f);
+  EXPECT_NEAR_ULPS_STL_CONTAINER(one, two, 1);
+}
+
+/**
+ * \brief Test the container macros accept a span over a raw array, and find
+ *        a mismatch in the last few elements (which don't fill a whole block
+ *        for the vectorised comparison).
+ */
+TEST(testContainerSpanFail) {
+  double raw[1003];
+  for (size_t i = 0; i < 1003; ++i) raw[i] = i;
+  std::vector<double> expected(raw, raw + 1003);
+  expected[1001] = 0.5;
+  EXPECT_NEAR_STL_CONTAINER(TinyTest::span(raw, 1003), expected, 0.1);
+}
+
+/**
+ * \brief Test the range equality macro on a list and a vector, which don't
+ *        need to be the same kind of container.
+ */
+TEST(testRangeEqualPass) {
+  std::list<int> one;
+  for (int i = 0; i < 100; ++i) one.push_back(i * i);
+  std::vector<int> two(one.begin(), one.end());
+  EXPECT_EQUAL_RANGE(one, two);
+}
+
+/**
+ * \brief Test the range macros read single-pass ranges: numbers streamed
+ *        from text, compared with a tolerance.
+ */
+TEST(testRangeNearStreamPass) {
+  std::stringstream text("0.5 1.25 2.001 3.75");
+  std::vector<double> expected;
+  expected.push_back(0.5); expected.push_back(1.25);
+  expected.push_back(2.0); expected.push_back(3.75);
+  EXPECT_NEAR_RANGE(TinyTest::range(std::istream_iterator<double>(text),
+                                    std::istream_iterator<double>()),
+                    expected, 0.01);
+}
+
+/**
+ * \brief Test a failed range comparison of a long single-pass range reports
+ *        the first mismatch with the elements either side of it, and how
+ *        many mismatches there were in total.
+ */
+TEST(testRangeEqualStreamFail) {
+  std::stringstream text;
+  std::vector<int> expected;
+  for (int i = 0; i < 1000; ++i) {
+    text << (i == 500 || i == 700 ? -1 : i) << " ";
+    expected.push_back(i);
+  }
+  EXPECT_EQUAL_RANGE(TinyTest::range(std::istream_iterator<int>(text),
+                                     std::istream_iterator<int>()),
+                     expected);
+}
+
+/**
+ * \brief Test the range equality macro fails when one list ends before the
+ *        other, which it only finds out when it gets there.
+ */
+TEST(testRangeEqualLengthFail) {
+  std::list<int> one;
+  std::list<int> two;
+  for (int i = 0; i < 10; ++i) one.push_back(i);
+  for (int i = 0; i < 12; ++i) two.push_back(i);
+  EXPECT_EQUAL_RANGE(one, two);
+}
+
+/**
+ * \brief Test that a fixture is constructed lazily, once, for the first of
+ *        the tests that use it.
+ */
+TEST_F(ReferenceData, testFixtureSharedPass) {
+  EXPECT_EQUAL(fixture.values.size(), size_t(1000));
+  EXPECT_EQUAL(ReferenceData::constructions.load(), size_t(1));
+}
+
+/**
+ * \brief Test that a second test using the same fixture gets the same
+ *        instance rather than constructing another one.
+ */
+TEST_F(ReferenceData, testFixtureSharedPass2) {
+  EXPECT_NEAR(fixture.values[999], 0.5, 1e-12);
+  EXPECT_EQUAL(ReferenceData::constructions.load(), size_t(1));
+}
+
+/**
+ * \brief Test that a per-worker fixture is only used on the thread that
+ *        constructed it.
+ */
+TEST_F(PerWorkerData, testFixturePerWorkerPass) {
+  EXPECT_EQUAL(fixture.owner == std::this_thread::get_id(), true);
+}
+
+/**
+ * \brief Test that EXPECT_NO_ALLOC passes on code that only works in memory
+ *        that has already been allocated.
+ */
+TEST(testNoAllocPass) {
+  std::vector<int> v(100, 1);
+  EXPECT_NO_ALLOC(std::fill(v.begin(), v.end(), 2));
+}
+
+/**
+ * \brief Test that EXPECT_NO_ALLOC fails on code that allocates.
+ */
+TEST(testNoAllocFail) {
+  EXPECT_NO_ALLOC(std::vector<int>(10));
+}
+
+/**
+ * \brief Test that EXPECT_MAX_ALLOCS passes when the code makes no more
+ *        than the given number of allocations.
+ */
+TEST(testMaxAllocsPass) {
+  std::vector<int> v;
+  EXPECT_MAX_ALLOCS(1, v.push_back(1));
+}
+
+/**
+ * \brief Test that EXPECT_MAX_ALLOCS fails, and counts every allocation,
+ *        when the code makes more than the given number of allocations.
+ */
+TEST(testMaxAllocsFail) {
+  std::vector<std::vector<int> > v;
+  EXPECT_MAX_ALLOCS(1, v.assign(2, std::vector<int>(3)));
+}
+
+/**
+ * \brief Test that a test with a time limit passes when it finishes well
+ *        within it.
+ */
+TEST_TIMEOUT(testTimeoutPass, 10000) {
+  std::vector<int> v(1000, 1);
+  EXPECT_EQUAL(std::accumulate(v.begin(), v.end(), 0), 1000);
+}
+
+/**
+ * \brief Test that a test needing all of a resource never runs alongside
+ *        others that use it, even when run in parallel.
+ */
+TEST_RESOURCES(testResourceExclusivePass, "scratchDir") {
+  EXPECT_EQUAL(useScratchDir(), 0);
+}
+
+/**
+ * \brief Test that a test can need several resources, and still gets all of
+ *        the one it names without an amount.
+ */
+TEST_RESOURCES(testResourceExclusivePass2, "memory=1, scratchDir") {
+  EXPECT_EQUAL(useScratchDir(), 0);
+}
+
+/**
+ * \brief Test that tests needing half of a resource each can run alongside
+ *        one another, but not alongside one that needs all of it.
+ */
+TEST_RESOURCES(testResourceSharedPass, "scratchDir=0.5") {
+  EXPECT_EQUAL(useScratchDir() <= 1, true);
+}
+
+/**
+ * \brief The other half of the resource used by testResourceSharedPass.
+ */
+TEST_RESOURCES(testResourceSharedPass2, "scratchDir = 0.5") {
+  EXPECT_EQUAL(useScratchDir() <= 1, true);
+}
+
+/**
+ * \brief Test that a malformed resource in a list is found (a test needing
+ *        it would stop the run before it starts), and well formed ones
+ *        aren't.
+ */
+TEST(testMalformedResourcePass) {
+  EXPECT_EQUAL(TinyTest::malformedResource(NULL), "");
+  EXPECT_EQUAL(TinyTest::malformedResource("port8080, memory=8192"), "");
+  EXPECT_EQUAL(TinyTest::malformedResource(" a = 0.5 ,, b=0 "), "");
+  EXPECT_EQUAL(TinyTest::malformedResource("port8080, memory=8G"),
+               "memory=8G");
+  EXPECT_EQUAL(TinyTest::malformedResource("memory=-5, a=x"), "memory=-5");
+  EXPECT_EQUAL(TinyTest::malformedResource("memory="), "memory=");
+  EXPECT_EQUAL(TinyTest::malformedResource(" = 5"), "= 5");
+}
+
+/**
+ * \brief The number of copies of testRepeatCopiesApartPass running at the
+ *        moment, shared with the forked workers like scratchDirUsers.
+ */
+static std::atomic<int>* const repeatCopiesRunning =
+  new (::mmap(NULL, sizeof(std::atomic<int>), PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_ANONYMOUS, -1, 0)) std::atomic<int>(0);
+
+/**
+ * \brief Test that the copies of a test that --repeat runs from different
+ *        iterations never run alongside each other.
+ */
+TEST(testRepeatCopiesApartPass) {
+  int others = repeatCopiesRunning->fetch_add(1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  repeatCopiesRunning->fetch_sub(1);
+  EXPECT_EQUAL(others, 0);
+}
+
+/**
+ * \brief A row of a table of sums for the parameterised tests.
+ */
+struct SumRow {
+  int a, b, sum;
+};
+
+static const SumRow goodSums[] = {{1, 2, 3}, {-4, 4, 0}, {10, 20, 30}};
+static const SumRow badSums[] = {{1, 2, 3}, {2, 2, 5}, {10, 20, 30}};
+
+/**
+ * \brief Test that a parameterised test is run, and reported, once per row
+ *        of an in-code table.
+ */
+TEST_P(testParamTablePass, TinyTest::tableRows(goodSums)) {
+  EXPECT_EQUAL(row.a + row.b, row.sum);
+}
+
+/**
+ * \brief Test that only the bad row of a parameterised test fails.
+ */
+TEST_P(testParamTableFail, TinyTest::tableRows(badSums)) {
+  EXPECT_EQUAL(row.a + row.b, row.sum);
+}
+
+/**
+ * \brief Test that attributes can be given to any kind of test, and
+ *        combined: every row of this one has a time limit and needs all of
+ *        the scratch directory, so no two of them overlap.
+ */
+TEST_P_WITH(testParamAttributesPass, TinyTest::tableRows(goodSums),
+            TinyTest::withTimeout(10000).withResources("scratchDir")) {
+  EXPECT_EQUAL(useScratchDir(), 0);
+  EXPECT_EQUAL(row.a + row.b, row.sum);
+}
+
+/**
+ * \brief Test a parameterised test over the rows of a CSV file with a
+ *        header (the blank line in it is skipped).
+ */
+TEST_P(testParamCsvPass, TinyTest::csvRows("paramTestRows.csv", true)) {
+  EXPECT_EQUAL(row.size(), size_t(3));
+  EXPECT_NEAR_DEF(row[0].toDouble() + row[1].toDouble(), row[2].toDouble());
+}
+
+/**
+ * \brief Split data into the key=value pairs on its lines, for the fuzz
+ *        tests; the key runs up to the first '=', and lines without one are
+ *        skipped.
+ */
+static std::vector<std::pair<std::string, std::string> >
+parseKeyValues(const uint8_t* data, size_t size) {
+  std::vector<std::pair<std::string, std::string> > pairs;
+  const char* p = reinterpret_cast<const char*>(data);
+  const char* end = p + size;
+  while (p < end) {
+    const char* eol = std::find(p, end, '\n');
+    const char* eq = std::find(p, eol, '=');
+    if (eq != eol) pairs.push_back(std::make_pair(std::string(p, eq),
+                                                  std::string(eq + 1, eol)));
+    p = eol == end ? end : eol + 1;
+  }
+  return pairs;
+}
+
+/**
+ * \brief Test a fuzz test replays each input in its corpus: whatever the
+ *        bytes, writing the pairs back out and parsing them again gives the
+ *        same pairs.
+ */
+FUZZ_TEST(testFuzzKeyValuePass)(const uint8_t* data, size_t size) {
+  std::vector<std::pair<std::string, std::string> > pairs =
+    parseKeyValues(data, size);
+  std::string text;
+  for (size_t i = 0; i < pairs.size(); ++i)
+    text += pairs[i].first + "=" + pairs[i].second + "\n";
+  std::vector<std::pair<std::string, std::string> > again =
+    parseKeyValues(reinterpret_cast<const uint8_t*>(text.data()),
+                   text.size());
+  EXPECT_EQUAL(again.size(), pairs.size());
+  for (size_t i = 0; i < pairs.size(); ++i) {
+    EXPECT_EQUAL(again[i].first, pairs[i].first);
+    EXPECT_EQUAL(again[i].second, pairs[i].second);
+  }
+}
+
+/**
+ * \brief Test a fuzz test that fails on one input of its corpus reports the
+ *        file the input came from.
+ */
+FUZZ_TEST(testFuzzKeyValueFail)(const uint8_t* data, size_t size) {
+  std::vector<std::pair<std::string, std::string> > pairs =
+    parseKeyValues(data, size);
+  for (size_t i = 0; i < pairs.size(); ++i)
+    EXPECT_NOT_EQUAL(pairs[i].first.size(), size_t(0));
+}
+
+/**
+ * \brief Test a fuzz test without a corpus is run on the empty input, which
+ *        isn't a NULL pointer.
+ */
+FUZZ_TEST(testFuzzNoCorpusPass)(const uint8_t* data, size_t size) {
+  EXPECT_EQUAL(size, size_t(0));
+  EXPECT_NOT_EQUAL(data, (const uint8_t*) NULL);
+}
+
+/**
+ * \brief Write a small report of the squares of 1 to n, for the golden file
+ *        tests. The failing ones check the wrong report against
+ *        goldenTestOutput.txt, so they skip the check (and pass) when golden
+ *        files are being updated, rather than overwrite it.
+ */
+static void
+writeSquares(std::ostream& out, int n) {
+  for (int i = 1; i <= n; ++i) out << i << " squared is " << i * i << "\n";
+}
+
+/**
+ * \brief Test that EXPECT_OUTPUT_MATCHES_FILE passes when the output is
+ *        exactly what is in the golden file.
+ */
+TEST(testOutputMatchesFilePass) {
+  EXPECT_OUTPUT_MATCHES_FILE(writeSquares(out, 5), "goldenTestOutput.txt");
+}
+
+/**
+ * \brief Test that EXPECT_OUTPUT_MATCHES_FILE fails when the output goes on
+ *        past the end of the golden file.
+ */
+TEST(testOutputMatchesFileFail) {
+  if (TinyTest::updatingGolden()) return;
+  EXPECT_OUTPUT_MATCHES_FILE(writeSquares(out, 6), "goldenTestOutput.txt");
+}
+
+/**
+ * \brief Test that EXPECT_FILE_EQUAL passes on a file with the same contents
+ *        as the golden file.
+ */
+TEST(testFileEqualPass) {
+  char path[] = "/tmp/TestTinyTestXXXXXX";
+  int fd = mkstemp(path);
+  EXPECT_NOT_EQUAL(fd, -1);
+  close(fd);
+  {
+    std::ofstream out(path);
+    writeSquares(out, 5);
+  }
+  try {
+    EXPECT_FILE_EQUAL(path, "goldenTestOutput.txt");
+  } catch (...) {
+    std::remove(path);
+    throw;
+  }
+  std::remove(path);
+}
+
+/**
+ * \brief Test that EXPECT_FILE_EQUAL fails, and reports the first line that
+ *        differs, on files with different contents.
+ */
+TEST(testFileEqualFail) {
+  if (TinyTest::updatingGolden()) return;
+  EXPECT_FILE_EQUAL("paramTestRows.csv", "goldenTestOutput.txt");
+}
+
+#ifdef TINYTEST_HAS_COROUTINES
+/**
+ * \brief Test that an async test can wait for data on a pipe, written by a
+ *        coroutine it awaits.
+ */
+TEST_ASYNC(testAsyncPipePass) {
+  int fds[2];
+  EXPECT_EQUAL(::pipe(fds), 0);
+  co_await writeLater(fds[1], "ping");
+  co_await TinyTest::readable(fds[0]);
+  char buf[8];
+  ssize_t n = ::read(fds[0], buf, sizeof(buf));
+  ::close(fds[0]);
+  ::close(fds[1]);
+  EXPECT_EQUAL(std::string(buf, n > 0 ? n : 0), std::string("ping"));
+}
+
+/**
+ * \brief Test that sleeping in an async test waits at least as long as it
+ *        was asked to.
+ */
+TEST_ASYNC(testAsyncSleepPass) {
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  co_await TinyTest::sleepFor(std::chrono::milliseconds(20));
+  EXPECT_EQUAL(std::chrono::steady_clock::now() - start >=
+               std::chrono::milliseconds(20), true);
+}
+
+/**
+ * \brief Test that an assertion failing after an async test has waited
+ *        fails that test.
+ */
+TEST_ASYNC(testAsyncFail) {
+  co_await TinyTest::sleepFor(std::chrono::milliseconds(5));
+  EXPECT_EQUAL(2, 1);
+}
+
+/**
+ * \brief Test that an assertion failing in a coroutine an async test awaits
+ *        fails that test.
+ */
+TEST_ASYNC(testAsyncNestedFail) {
+  co_await expectOneLater(1);
+  co_await expectOneLater(3);
+}
+
+/**
+ * \brief Test that async tests needing all of a resource never run
+ *        alongside each other on the event loop.
+ */
+TEST_ASYNC_WITH(testAsyncResourcePass,
+                TinyTest::withResources("scratchDir")) {
+  int others = scratchDirUsers->fetch_add(1);
+  co_await TinyTest::sleepFor(std::chrono::milliseconds(20));
+  scratchDirUsers->fetch_sub(1);
+  EXPECT_EQUAL(others, 0);
+}
+
+/**
+ * \brief The other async test using the resource testAsyncResourcePass does.
+ */
+TEST_ASYNC_WITH(testAsyncResourcePass2,
+                TinyTest::withResources("scratchDir")) {
+  int others = scratchDirUsers->fetch_add(1);
+  co_await TinyTest::sleepFor(std::chrono::milliseconds(20));
+  scratchDirUsers->fetch_sub(1);
+  EXPECT_EQUAL(others, 0);
+}
+#endif
+
+/**
+ * \brief A cache file of a test's own, removed (with any temporary file an
+ *        update left behind) when the test is done with it. It starts out
+ *        empty, which isn't a valid cache.
+ */
+struct ScratchCache {
+  ScratchCache() {
+    char p[] = "/tmp/TestTinyTestXXXXXX";
+    int fd = mkstemp(p);
+    if (fd >= 0) close(fd);
+    path = p;
+  }
+  ~ScratchCache() {
+    std::remove(path.c_str());
+    std::remove((path + ".tmp").c_str());
+  }
+  /** \brief record fresh in the cache, keeping the tests registered says
+   *         are still registered */
+  bool update(const std::map<std::string, TinyTest::ResultCache::Entry>& fresh,
+              const std::function<bool(const std::string&)>& registered =
+                [](const std::string&) { return true; }) {
+    return TinyTest::ResultCache::update(path, registered, fresh);
+  }
+  std::string path;
+};
+
+/**
+ * \brief A cache entry for a test that failed (or not) and took wallMs.
+ */
+static TinyTest::ResultCache::Entry
+cacheEntry(bool failed, double wallMs) {
+  TinyTest::ResultCache::Entry e;
+  e.failed = failed;
+  e.wallMs = wallMs;
+  return e;
+}
+
+/**
+ * \brief Test that the result cache gives back what was recorded in it, and
+ *        that an update keeps a test's old duration if the new one isn't
+ *        known.
+ */
+TEST(testCacheUpdatePass) {
+  ScratchCache c;
+  std::map<std::string, TinyTest::ResultCache::Entry> fresh;
+  fresh["a"] = cacheEntry(true, 5);
+  fresh["b"] = cacheEntry(false, 10);
+  fresh["c"] = cacheEntry(false, 3);
+  EXPECT_EQUAL(c.update(fresh), true);
+  fresh.clear();
+  fresh["c"] = cacheEntry(true, -1);
+  EXPECT_EQUAL(c.update(fresh), true);
+
+  TinyTest::ResultCache cache(c.path);
+  TinyTest::ResultCache::Entry e;
+  EXPECT_EQUAL(cache.find("a", e), true);
+  EXPECT_EQUAL(e.failed, true);
+  EXPECT_EQUAL(e.wallMs, 5.0);
+  EXPECT_EQUAL(cache.find("b", e), true);
+  EXPECT_EQUAL(e.failed, false);
+  EXPECT_EQUAL(cache.find("c", e), true);
+  EXPECT_EQUAL(e.failed, true);
+  EXPECT_EQUAL(e.wallMs, 3.0);
+  EXPECT_EQUAL(cache.find("d", e), false);
+  EXPECT_EQUAL(cache.meanWallMs(), 6.0);
+}
+
+/**
+ * \brief Test that an update drops the tests that are no longer registered,
+ *        unless they've just been run.
+ */
+TEST(testCachePrunePass) {
+  ScratchCache c;
+  std::map<std::string, TinyTest::ResultCache::Entry> fresh;
+  fresh["kept"] = cacheEntry(true, 1);
+  fresh["gone"] = cacheEntry(true, 1);
+  fresh["gone/0-9"] = cacheEntry(false, 1);
+  EXPECT_EQUAL(c.update(fresh), true);
+  fresh.clear();
+  fresh["new"] = cacheEntry(false, 2);
+  EXPECT_EQUAL(c.update(fresh, [](const std::string& name) {
+    return name == "kept";
+  }), true);
+
+  TinyTest::ResultCache cache(c.path);
+  TinyTest::ResultCache::Entry e;
+  EXPECT_EQUAL(cache.find("kept", e), true);
+  EXPECT_EQUAL(cache.find("new", e), true);
+  EXPECT_EQUAL(cache.find("gone", e), false);
+  EXPECT_EQUAL(cache.find("gone/0-9", e), false);
+}
+
+/**
+ * \brief Test that a cache file that has been cut short, or isn't a cache
+ *        at all, is read as an empty cache and replaced by the next update.
+ */
+TEST(testCacheCorruptPass) {
+  ScratchCache c;
+  std::map<std::string, TinyTest::ResultCache::Entry> fresh;
+  fresh["a"] = cacheEntry(true, 5);
+  EXPECT_EQUAL(c.update(fresh), true);
+  struct stat st;
+  EXPECT_EQUAL(stat(c.path.c_str(), &st), 0);
+  EXPECT_EQUAL(truncate(c.path.c_str(), st.st_size - 1), 0);
+  TinyTest::ResultCache::Entry e;
+  {
+    TinyTest::ResultCache truncated(c.path);
+    EXPECT_EQUAL(truncated.find("a", e), false);
+    EXPECT_EQUAL(truncated.meanWallMs(), 0.0);
+  }
+  {
+    std::ofstream out(c.path.c_str());
+    out << "not a result cache, but long enough to have a header";
+  }
+  {
+    TinyTest::ResultCache garbage(c.path);
+    EXPECT_EQUAL(garbage.find("a", e), false);
+  }
+  fresh["b"] = cacheEntry(false, 1);
+  EXPECT_EQUAL(c.update(fresh), true);
+  TinyTest::ResultCache cache(c.path);
+  EXPECT_EQUAL(cache.find("a", e), true);
+  EXPECT_EQUAL(cache.find("b", e), true);
+}
+
+/**
+ * \brief Test the orders --failed-first and --longest-first put tests in,
+ *        on their own and together; tests whose time isn't known count as
+ *        taking the mean time.
+ */
+TEST(testCacheOrderPass) {
+  std::vector<TinyTest::ResultCache::Entry> known;
+  known.push_back(cacheEntry(false, 1));
+  known.push_back(cacheEntry(true, 2));
+  known.push_back(cacheEntry(false, 30));
+  known.push_back(cacheEntry(true, 20));
+  known.push_back(cacheEntry(false, -1));
+  const size_t none[] = {0, 1, 2, 3, 4};
+  const size_t failed[] = {1, 3, 0, 2, 4};
+  const size_t longest[] = {2, 3, 4, 1, 0};
+  const size_t both[] = {3, 1, 2, 4, 0};
+  EXPECT_EQUAL_STL_CONTAINER(TinyTest::cacheOrder(known, 10, false, false),
+                             TinyTest::span(none, 5));
+  EXPECT_EQUAL_STL_CONTAINER(TinyTest::cacheOrder(known, 10, true, false),
+                             TinyTest::span(failed, 5));
+  EXPECT_EQUAL_STL_CONTAINER(TinyTest::cacheOrder(known, 10, false, true),
+                             TinyTest::span(longest, 5));
+  EXPECT_EQUAL_STL_CONTAINER(TinyTest::cacheOrder(known, 10, true, true),
+                             TinyTest::span(both, 5));
+}
+
+/******************************************************************************
+ **                               BENCHMARKS                                 **
+ ******************************************************************************/
+
+/**
+ * \brief Time the container equality macro on a pair of equal vectors. This
+ *        is only run when TestTinyTest is given --benchmarks, so it doesn't
+ *        appear in the regression test output (other than being discovered).
+ */
+BENCHMARK(benchContainerEqual) {
+  std::vector<int> one(1000, 7);
+  std::vector<int> two(1000, 7);
+  while (bench.keepRunning()) {
+    EXPECT_EQUAL_STL_CONTAINER(one, two);
+    TinyTest::clobberMemory();
+  }
+}
+
+/**
+ * \brief Time the near-equality container macro on a million doubles; this
+ *        uses the vectorised comparison kernels.
+ */
+BENCHMARK(benchContainerNearKernel) {
+  std::vector<double> one(1 << 20, 1.0);
+  std::vector<double> two(1 << 20, 1.0 + 1e-12);
+  while (bench.keepRunning()) {
+    EXPECT_NEAR_STL_CONTAINER(one, two, 1e-9);
+  }
+}
+
+/**
+ * \brief Time the element-by-element loop the near-equality container macro
+ *        used before it had vectorised kernels, on the same data as
+ *        benchContainerNearKernel, for comparison.
+ */
+BENCHMARK(benchContainerNearScalarLoop) {
+  std::vector<double> one(1 << 20, 1.0);
+  std::vector<double> two(1 << 20, 1.0 + 1e-12);
+  while (bench.keepRunning()) {
+    size_t i = 0;
+    while (i < one.size() && std::fabs(one[i] - two[i]) <= 1e-9) ++i;
+    TinyTest::doNotOptimize(i);
+  }
+}
+
+/**
+ * \brief A test case that isn't registered, named at run time.
+ */
+class RunTimeNamedTest : public TestCase {
+public:
+  RunTimeNamedTest(const std::string& name) : TestCase(name) {;}
+  virtual void runTest() const {}
+};
+
+/**
+ * \brief Test that a test case named with a std::string keeps its own copy
+ *        of the name, so the string it was given can go away.
+ */
+TEST(testRunTimeNamePass) {
+  std::string name = "testMadeAtRunTime";
+  RunTimeNamedTest t(name + "/1");
+  name.assign(100, 'x');
+  EXPECT_EQUAL(t.getTestName(), "testMadeAtRunTime/1");
+  RunTimeNamedTest copy(t);
+  EXPECT_EQUAL(copy.getTestName(), "testMadeAtRunTime/1");
+}
+
+/**
+ * \brief A benchmark that isn't registered, whose loop counts its
+ *        iterations, so that the tests below can check what measuring it
+ *        does.
+ */
+class CountingBenchmark : public BenchmarkCase {
+public:
+  CountingBenchmark() :
+    BenchmarkCase("countingBenchmark"), runs(0), lastRun(0), total(0) {;}
+  virtual void runBenchmark(TinyTest::BenchmarkState& bench) const {
+    ++runs;
+    lastRun = 0;
+    while (bench.keepRunning()) {
+      ++lastRun;
+      TinyTest::doNotOptimize(lastRun);
+    }
+    total += lastRun;
+  }
+  /** how many times the body ran, the iterations of the last run and of
+   *  all of them */
+  mutable size_t runs, lastRun, total;
+};
+
+/**
+ * \brief Test the statistics computed from known samples.
+ */
+TEST(testBenchmarkSummaryPass) {
+  double samples[] = {4, 9, 1, 7, 3, 10, 2, 8, 6, 5};
+  TinyTest::BenchmarkStats st = TinyTest::summariseBenchmark(
+    std::vector<double>(samples, samples + 10), 250);
+  EXPECT_EQUAL(st.samples, size_t(10));
+  EXPECT_EQUAL(st.iterations, size_t(250));
+  EXPECT_EQUAL(st.min, 1.0);
+  EXPECT_EQUAL(st.median, 5.5);
+  EXPECT_EQUAL(st.mean, 5.5);
+  EXPECT_NEAR(st.stddev, std::sqrt(82.5 / 9), 1e-12);
+  for (size_t i = 0; i < st.perOp.size(); ++i)
+    EXPECT_EQUAL(st.perOp[i], double(i + 1));
+}
+
+/**
+ * \brief Test measuring a benchmark: after calibration, each of the samples
+ *        runs the loop for the reported number of iterations, and the
+ *        statistics are consistent with the samples.
+ */
+TEST(testBenchmarkMeasurePass) {
+  CountingBenchmark b;
+  TinyTest::BenchmarkStats st = TinyTest::measureBenchmark(b, 0.01, false);
+  EXPECT_EQUAL(st.samples, size_t(10));
+  EXPECT_EQUAL(st.perOp.size(), size_t(10));
+  EXPECT_EQUAL(b.lastRun, st.iterations);
+  // at least one calibration run, then the samples
+  EXPECT_EQUAL(b.runs > st.samples, true);
+  EXPECT_EQUAL(b.total >= st.samples * st.iterations, true);
+  EXPECT_EQUAL(st.iterations >= 1, true);
+  EXPECT_EQUAL(std::is_sorted(st.perOp.begin(), st.perOp.end()), true);
+  EXPECT_EQUAL(st.min, st.perOp.front());
+  EXPECT_EQUAL(st.mean >= st.min && st.mean <= st.perOp.back(), true);
+  EXPECT_EQUAL(st.median >= st.min && st.median <= st.perOp.back(), true);
+  EXPECT_EQUAL(st.stddev >= 0, true);
+  EXPECT_EQUAL(st.counted, false);
+}
+
+/**
+ * \brief Ten samples, spaced 1ns apart from first.
+ */
+static std::vector<double>
+benchmarkSamples(double first) {
+  std::vector<double> v;
+  for (size_t i = 0; i < 10; ++i) v.push_back(first + i);
+  return v;
+}
+
+/**
+ * \brief Test comparing benchmark samples with a baseline: those that are
+ *        clearly slower fail, those from the same distribution don't, and
+ *        neither do those that are significantly slower by less than
+ *        --min-effect or not significantly enough for --alpha.
+ */
+TEST(testBaselineComparisonPass) {
+  TinyTest::RunOptions opts;
+  std::string comparison;
+  const std::vector<double> base = benchmarkSamples(100);
+  EXPECT_EQUAL(TinyTest::slowerThanBaseline(benchmarkSamples(150), base,
+                                            opts, comparison), true);
+  EXPECT_EQUAL(comparison.find("median 154.5 ns/op against baseline median "
+                               "104.5 ns/op (+47.8%, p = 0.0001)"),
+               size_t(0));
+  EXPECT_EQUAL(TinyTest::slowerThanBaseline(base, base, opts, comparison),
+               false);
+  EXPECT_EQUAL(TinyTest::slowerThanBaseline(benchmarkSamples(50), base,
+                                            opts, comparison), false);
+  // every sample is slower, but the median only by 9.6%
+  EXPECT_EQUAL(TinyTest::slowerThanBaseline(benchmarkSamples(110), base,
+                                            opts, comparison), false);
+  opts.minEffect = 0.05;
+  EXPECT_EQUAL(TinyTest::slowerThanBaseline(benchmarkSamples(110), base,
+                                            opts, comparison), true);
+  opts.alpha = 1e-5;
+  EXPECT_EQUAL(TinyTest::slowerThanBaseline(benchmarkSamples(110), base,
+                                            opts, comparison), false);
+}
+
+/**
+ * \brief Test that updating a baseline file replaces the benchmarks that
+ *        were measured and keeps those that weren't run.
+ */
+TEST(testBaselineUpdatePass) {
+  char p[] = "/tmp/TestTinyTestXXXXXX";
+  int fd = mkstemp(p);
+  if (fd >= 0) close(fd);
+  const std::string path = p;
+  TinyTest::Baseline before, measured, after;
+  before["kept"] = benchmarkSamples(1);
+  before["replaced"] = benchmarkSamples(2);
+  measured["replaced"] = benchmarkSamples(3);
+  measured["new"] = benchmarkSamples(4);
+  EXPECT_EQUAL(TinyTest::saveBaseline(path, before), true);
+  EXPECT_EQUAL(TinyTest::updateBaseline(path, measured), true);
+  EXPECT_EQUAL(TinyTest::loadBaseline(path, after), true);
+  std::remove(path.c_str());
+  EXPECT_EQUAL(after.size(), size_t(3));
+  EXPECT_EQUAL_STL_CONTAINER(after["kept"], benchmarkSamples(1));
+  EXPECT_EQUAL_STL_CONTAINER(after["replaced"], benchmarkSamples(3));
+  EXPECT_EQUAL_STL_CONTAINER(after["new"], benchmarkSamples(4));
+  EXPECT_EQUAL(TinyTest::loadBaseline(path, after), false);
+}
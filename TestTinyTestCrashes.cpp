@@ -0,0 +1,107 @@
+/**
+ * \file  TestTinyTestCrashes.cpp
+ * \brief This file defines tests that crash the process running them, in
+ *        the ways a test can: a signal, abort, std::terminate and an exit
+ *        in the middle of the test. They can't be part of TestTinyTest, as
+ *        they only make sense with --isolate, where each crash must be
+ *        reported as a failure of the test that caused it and the run carry
+ *        on with the tests after it. The output is compared against
+ *        regressionCrashesExpectedOutput.txt by the included make file as
+ *        part of the target 'test'.
+ *
+ * \authors Philip J. Uren
+ *
+ * \section copyright Copyright Details
+ * Copyright (C) 2014 Philip J. Uren
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ * USA
+**/
+
+#include "TinyTest.hpp"
+#include <csignal>
+#include <cstdlib>
+#include <exception>
+#include <sys/resource.h>
+
+/******************************************************************************
+ **                                 HELPER                                   **
+ ******************************************************************************/
+
+/**
+ * \brief Stop the worker that's about to crash from leaving a core file.
+ */
+static void
+noCoreDump() {
+  rlimit none = {0, 0};
+  ::setrlimit(RLIMIT_CORE, &none);
+}
+
+/******************************************************************************
+ **                                 TESTS                                    **
+ ******************************************************************************/
+
+/**
+ * \brief Test that a test before the crashing ones is reported as usual.
+ */
+TEST(testBeforeCrashPass) {
+  EXPECT_EQUAL(1 + 1, 2);
+}
+
+/**
+ * \brief Test that a test killed by a signal fails, naming the signal.
+ */
+TEST(testSegfaultFail) {
+  noCoreDump();
+  std::raise(SIGSEGV);
+}
+
+/**
+ * \brief Test that a test that aborts fails, and the run carries on.
+ */
+TEST(testAbortFail) {
+  noCoreDump();
+  std::abort();
+}
+
+/**
+ * \brief Test that a test that calls std::terminate fails.
+ */
+TEST(testTerminateFail) {
+  noCoreDump();
+  std::terminate();
+}
+
+/**
+ * \brief Test that a test that exits, even with status 0, fails, as it never
+ *        got to report a result.
+ */
+TEST(testExitFail) {
+  std::exit(0);
+}
+
+/**
+ * \brief Test that the tests after the crashes still run and are reported.
+ */
+TEST(testAfterCrashPass) {
+  EXPECT_EQUAL(2 + 2, 4);
+}
+
+/**
+ * \brief Test that a replacement worker runs tests as the first one did.
+ */
+TEST(testAfterCrashPass2) {
+  EXPECT_EQUAL(3 + 3, 6);
+}
@@ -0,0 +1,89 @@
+/**
+ * \file  TestTinyTestTimeouts.cpp
+ * \brief This file defines tests for what happens when a test runs past its
+ *        time limit. One of them never finishes, so they can't be part of
+ *        TestTinyTest: with --isolate, the worker running it must be killed
+ *        and the run carry on (compared against
+ *        regressionTimeoutsExpectedOutput.txt); otherwise the run must give
+ *        up, reporting the tests that didn't get to run, and fail (compared
+ *        against regressionGiveUpExpectedOutput.txt). An async test that
+ *        blocks the event loop must give up the run of the async tests in
+ *        the same way (regressionAsyncGiveUpExpectedOutput.txt). All are
+ *        run by the included make file as part of the target 'test'.
+ *
+ * \authors Philip J. Uren
+ *
+ * \section copyright Copyright Details
+ * Copyright (C) 2014 Philip J. Uren
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301
+ * USA
+**/
+
+#include "TinyTest.hpp"
+#include <unistd.h>
+
+/**
+ * \brief Test that a test before the hanging one is reported as usual.
+ */
+TEST(testBeforeHangPass) {
+  EXPECT_EQUAL(1 + 1, 2);
+}
+
+/**
+ * \brief Test that a test that never finishes is stopped, or the run given
+ *        up, once its time limit has passed.
+ */
+TEST_TIMEOUT(testHangFail, 200) {
+  for (;;) ::pause();
+}
+
+/**
+ * \brief Test that the run carries on after the hanging test when it can
+ *        be killed (and that this is counted as not run when it can't).
+ */
+TEST(testAfterHangPass) {
+  EXPECT_EQUAL(2 + 2, 4);
+}
+
+#ifdef TINYTEST_HAS_COROUTINES
+/**
+ * \brief Test that an async test that finishes before another blocks the
+ *        event loop is reported as usual.
+ */
+TEST_ASYNC(testAsyncBeforeBlockPass) {
+  co_await TinyTest::sleepFor(std::chrono::milliseconds(1));
+  EXPECT_EQUAL(1 + 1, 2);
+}
+
+/**
+ * \brief Test that an async test that blocks instead of awaiting, so the
+ *        event loop never gets the thread back, is still caught once its
+ *        time limit has passed.
+ */
+TEST_ASYNC_WITH(testAsyncBlockFail, TinyTest::withTimeout(200)) {
+  co_await TinyTest::sleepFor(std::chrono::milliseconds(50));
+  for (;;) ::pause();
+}
+
+/**
+ * \brief Test that an async test still waiting when the loop is blocked is
+ *        counted as not run when the run is given up.
+ */
+TEST_ASYNC(testAsyncAfterBlockPass) {
+  co_await TinyTest::sleepFor(std::chrono::milliseconds(500));
+  EXPECT_EQUAL(2 + 2, 4);
+}
+#endif
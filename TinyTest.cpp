@@ -28,24 +28,5578 @@
 #include <string>
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <sstream>
+#include <fstream>
+#include <map>
+#include <set>
+#include <iomanip>
+#include <chrono>
+#include <deque>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <new>
+#include <random>
+
+// POSIX includes
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <linux/perf_event.h>
+#endif
 
 // TinyTest includes
 #include "TinyTest.hpp"
 
 // bring these into the global namespace
 using std::cout;
+using std::cerr;
 using std::endl;
 
+/******************************************************************************
+ **                           FAILURE MESSAGES                               **
+ ******************************************************************************/
+
+namespace TinyTest {
+  void
+  failComparison(const char* macro, const std::string& a,
+                 const std::string& b, const std::string& detail, int line,
+                 const char* file) {
+    std::stringstream ss;
+    ss << macro << " failed on comparison of " << a << " and " << b
+       << detail << " on line " << line << " of " << file;
+    throw TinyTestException(ss.str());
+  }
+
+  void
+  failThrows(const char* exception, const char* func, int line,
+             const char* file) {
+    std::stringstream ss;
+    ss << "EXPECT_THROWS failed when running " << func << " on line "
+       << line << " of " << file << "; " << exception << " was not thrown";
+    throw TinyTestException(ss.str());
+  }
+}
+
+/******************************************************************************
+ **                           GNU MAKE JOBSERVER                             **
+ ******************************************************************************/
+
+namespace TinyTest {
+  /**
+   * \brief A client for the GNU make jobserver. When make is run with -j, it
+   *        passes the programs it runs a pipe (or, from make 4.4, the path of
+   *        a fifo) in MAKEFLAGS, holding one byte for each free job slot.
+   *        Every process has one slot implicitly; each extra thread or
+   *        process it runs alongside that must take a byte first and put it
+   *        back once it's done, so that make and everything it runs share a
+   *        single pool of slots. Without a jobserver, slots are always free.
+   */
+  class JobServer {
+  public:
+    /** \brief the jobserver named in MAKEFLAGS when first called, if any */
+    static JobServer& get() {
+      static JobServer js;
+      return js;
+    }
+
+    /** \brief is there a jobserver to take slots from? */
+    bool active() const { return readFd >= 0; }
+
+    /** \brief a descriptor that becomes readable when a slot may be free */
+    int pollFd() const { return readFd; }
+
+    /** \brief take a free slot without waiting; true if we got one. The
+     *         byte taken must be handed back to release() later. */
+    bool tryAcquire(char& token) {
+      if (!active()) return true;
+      if (!nonBlocking) {
+        // another process may still beat us to it, but only briefly
+        pollfd p = {readFd, POLLIN, 0};
+        if (::poll(&p, 1, 0) <= 0) return false;
+      }
+      return ::read(readFd, &token, 1) == 1;
+    }
+
+    /** \brief wait for a free slot for as long as wanted() returns true;
+     *         true if we got one */
+    bool acquire(char& token, const std::function<bool()>& wanted) {
+      if (!active()) return true;
+      while (wanted()) {
+        if (tryAcquire(token)) return true;
+        pollfd p = {readFd, POLLIN, 0};
+        ::poll(&p, 1, 50);
+      }
+      return false;
+    }
+
+    /** \brief give back a slot taken with tryAcquire or acquire */
+    void release(char token) {
+      if (!active()) return;
+      while (::write(writeFd, &token, 1) < 0 && errno == EINTR) {;}
+    }
+
+    /**
+     * \brief if there isn't a jobserver already, create one with the given
+     *        number of slots (one of them ours) and name it in MAKEFLAGS,
+     *        so that the programs we start share the slots with us.
+     */
+    void create(size_t slots) {
+      int fds[2];
+      if (active() || slots <= 1 || ::pipe(fds) != 0) return;
+      std::string tokens(slots - 1, '+');
+      if (::write(fds[1], tokens.data(), tokens.size()) !=
+          static_cast<ssize_t>(tokens.size())) {
+        ::close(fds[0]);
+        ::close(fds[1]);
+        return;
+      }
+      // variable definitions come at the end, after a " -- "
+      const char* old = std::getenv("MAKEFLAGS");
+      std::string flags(old == NULL ? "" : old), vars;
+      size_t dashes = flags.find(" -- ");
+      if (dashes != std::string::npos) {
+        vars = flags.substr(dashes);
+        flags.erase(dashes);
+      }
+      std::stringstream ss;
+      ss << flags << " -j" << slots << " --jobserver-auth=" << fds[0] << ","
+         << fds[1] << vars;
+      ::setenv("MAKEFLAGS", ss.str().c_str(), 1);
+      connect();
+    }
+
+  private:
+    JobServer() : readFd(-1), writeFd(-1), nonBlocking(false) { connect(); }
+
+    /** \brief find the jobserver named in MAKEFLAGS (the last one, as make
+     *         appends to what it inherited) and open it */
+    void connect() {
+      const char* flags = std::getenv("MAKEFLAGS");
+      if (flags == NULL) return;
+      std::stringstream words(flags);
+      std::string word, auth;
+      while (words >> word && word != "--") {
+        if (word.compare(0, 17, "--jobserver-auth=") == 0)
+          auth = word.substr(17);
+        else if (word.compare(0, 16, "--jobserver-fds=") == 0)
+          auth = word.substr(16);
+      }
+      if (auth.compare(0, 5, "fifo:") == 0) {
+        int fd = ::open(auth.c_str() + 5, O_RDWR | O_NONBLOCK);
+        if (fd < 0) return;
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+        readFd = writeFd = fd;
+        nonBlocking = true;
+        return;
+      }
+      int r = -1, w = -1;
+      struct stat rs, ws;
+      // make closes the pipe for commands it doesn't think are recursive,
+      // so the descriptors may be gone, or have been reused for something
+      if (std::sscanf(auth.c_str(), "%d,%d", &r, &w) != 2 || r < 0 ||
+          w < 0 || ::fstat(r, &rs) != 0 || ::fstat(w, &ws) != 0 ||
+          !S_ISFIFO(rs.st_mode) || !S_ISFIFO(ws.st_mode)) return;
+      // the pipe is shared with make, so rather than making it non-blocking
+      // for everyone, open a non-blocking end of our own where we can
+      char path[64];
+      std::snprintf(path, sizeof(path), "/proc/self/fd/%d", r);
+      int own = ::open(path, O_RDONLY | O_NONBLOCK);
+      if (own >= 0) ::fcntl(own, F_SETFD, FD_CLOEXEC);
+      readFd = own >= 0 ? own : r;
+      writeFd = w;
+      nonBlocking = own >= 0;
+    }
+
+    /** where slots are taken from and given back to */
+    int readFd, writeFd;
+    /** true if reading readFd never blocks */
+    bool nonBlocking;
+  };
+}
+
+/******************************************************************************
+ **                         WORK-STEALING THREAD POOL                        **
+ ******************************************************************************/
+
+namespace TinyTest {
+  /** \brief the index of the pool worker on this thread; 0 off the pool */
+  static thread_local size_t workerIndex = 0;
+
+  size_t
+  currentWorker() {
+    return workerIndex;
+  }
+
+  /**
+   * \brief A small work-stealing pool for running a fixed set of work items.
+   *
+   *        Each worker owns a deque of item indices. Items are dealt out
+   *        round-robin so that early items tend to finish early. A worker
+   *        takes work from the front of its own deque and, once that is empty,
+   *        steals from the back of another worker's deque. The pool is torn
+   *        down when every item has been processed. Under make -j, every
+   *        worker but the first waits for a job slot before it starts.
+   */
+  class WorkStealingPool {
+  public:
+    /** \brief the work to do; called with the item index and worker index */
+    typedef std::function<void(size_t item, size_t worker)> Work;
+
+    /** \brief called on each worker once there's nothing left to take */
+    typedef std::function<void(size_t worker)> Drain;
+
+    /** \brief construct a pool that will use the given number of workers */
+    explicit WorkStealingPool(size_t nWorkers) :
+      queues(nWorkers == 0 ? 1 : nWorkers) {;}
+
+    /**
+     * \brief process items 0 .. nItems-1 by calling work on each one exactly
+     *        once, then drain (if given) on each worker; blocks until they
+     *        are all done. Must not be called concurrently on the same pool.
+     */
+    void run(size_t nItems, const Work& work, const Drain& drain = Drain()) {
+      for (size_t i = 0; i < nItems; ++i)
+        queues[i % queues.size()].items.push_back(i);
+      std::vector<std::thread> threads;
+      for (size_t w = 1; w < queues.size(); ++w)
+        threads.push_back(std::thread(&WorkStealingPool::workerLoop, this,
+                                      w, std::cref(work), std::cref(drain)));
+      workerLoop(0, work, drain);
+      workerIndex = 0;
+      for (size_t w = 0; w < threads.size(); ++w) threads[w].join();
+    }
+
+  private:
+    /** \brief a single worker's deque of pending items */
+    struct Queue {
+      std::mutex lock;
+      std::deque<size_t> items;
+    };
+
+    /** \brief take the next item from the front of our own deque */
+    bool popLocal(size_t w, size_t& item) {
+      std::lock_guard<std::mutex> guard(queues[w].lock);
+      if (queues[w].items.empty()) return false;
+      item = queues[w].items.front();
+      queues[w].items.pop_front();
+      return true;
+    }
+
+    /** \brief take an item from the back of some other worker's deque */
+    bool steal(size_t w, size_t& item) {
+      for (size_t k = 1; k < queues.size(); ++k) {
+        Queue& victim = queues[(w + k) % queues.size()];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (victim.items.empty()) continue;
+        item = victim.items.back();
+        victim.items.pop_back();
+        return true;
+      }
+      return false;
+    }
+
+    /** \brief is there anything left in any of the deques? */
+    bool anyLeft() {
+      for (size_t w = 0; w < queues.size(); ++w) {
+        std::lock_guard<std::mutex> guard(queues[w].lock);
+        if (!queues[w].items.empty()) return true;
+      }
+      return false;
+    }
+
+    /** \brief the body of each worker; runs until there is nothing left */
+    void workerLoop(size_t w, const Work& work, const Drain& drain) {
+      workerIndex = w;
+      JobServer& jobs = JobServer::get();
+      char token;
+      if (w > 0 && !jobs.acquire(token, [this]() { return anyLeft(); }))
+        return;
+      size_t item;
+      while (popLocal(w, item) || steal(w, item)) work(item, w);
+      if (drain) drain(w);
+      if (w > 0) jobs.release(token);
+    }
+
+    /** one deque per worker */
+    std::vector<Queue> queues;
+  };
+}
+
+/******************************************************************************
+ **                                WATCHDOG                                  **
+ ******************************************************************************/
+
+namespace TinyTest {
+  /**
+   * \brief A thread that watches for tests overrunning their time limits.
+   *        Each of a fixed number of slots (one per worker) can be armed with
+   *        an item and a time limit before the item is run, and disarmed
+   *        afterwards; if the limit passes first, expired is called with the
+   *        item on the watchdog's thread. The thread sleeps until the
+   *        earliest deadline and isn't started until something is armed
+   *        with a limit, so it costs next to nothing.
+   */
+  class Watchdog {
+  public:
+    /** \brief what to do when an item overruns */
+    typedef std::function<void(size_t item)> Expired;
+
+    /** \brief construct a watchdog with the given number of slots */
+    Watchdog(size_t nSlots, const Expired& expired) :
+      slots(nSlots), expired(expired), stopping(false) {;}
+
+    ~Watchdog() {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+      }
+      wake.notify_one();
+      if (thread.joinable()) thread.join();
+    }
+
+    /** \brief start timing item in slot; a limit of 0 means no limit */
+    void arm(size_t slot, size_t item, double limitMs) {
+      if (limitMs <= 0) return;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        slots[slot].armed = true;
+        slots[slot].item = item;
+        slots[slot].deadline = std::chrono::steady_clock::now() +
+          std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double, std::milli>(limitMs));
+        if (!thread.joinable())
+          thread = std::thread(&Watchdog::watch, this);
+      }
+      wake.notify_one();
+    }
+
+    /** \brief stop timing whatever is in slot */
+    void disarm(size_t slot) {
+      std::lock_guard<std::mutex> guard(lock);
+      slots[slot].armed = false;
+    }
+
+  private:
+    /** \brief an item being timed */
+    struct Slot {
+      Slot() : armed(false), item(0) {;}
+      bool armed;
+      size_t item;
+      std::chrono::steady_clock::time_point deadline;
+    };
+
+    /** \brief the body of the watchdog thread */
+    void watch() {
+      std::unique_lock<std::mutex> guard(lock);
+      while (!stopping) {
+        size_t first = slots.size();
+        for (size_t s = 0; s < slots.size(); ++s)
+          if (slots[s].armed && (first == slots.size() ||
+                                 slots[s].deadline < slots[first].deadline))
+            first = s;
+        if (first == slots.size()) {
+          wake.wait(guard);
+        } else if (std::chrono::steady_clock::now() >= slots[first].deadline) {
+          slots[first].armed = false;
+          size_t item = slots[first].item;
+          guard.unlock();
+          expired(item);
+          guard.lock();
+        } else {
+          wake.wait_until(guard, slots[first].deadline);
+        }
+      }
+    }
+
+    std::vector<Slot> slots;
+    Expired expired;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping;
+    std::thread thread;
+  };
+
+  /** \brief why a test that ran out of time failed */
+  static std::string
+  describeTimeout(double limitMs) {
+    std::stringstream ss;
+    ss << "timeout after " << limitMs << " ms";
+    return ss.str();
+  }
+}
+
+/******************************************************************************
+ **                          RESOURCE SCHEDULING                             **
+ ******************************************************************************/
+
+namespace TinyTest {
+  /** \brief what a test asked for with TEST_RESOURCES: an amount of each
+   *         resource, where a negative amount means all of it */
+  typedef std::vector<std::pair<std::string, double> > ResourceNeeds;
+
+  /** \brief s without leading and trailing white space */
+  static std::string
+  trimmed(const std::string& s) {
+    size_t from = s.find_first_not_of(" \t");
+    if (from == std::string::npos) return "";
+    return s.substr(from, s.find_last_not_of(" \t") - from + 1);
+  }
+
+  /** \brief parse a TEST_RESOURCES list, e.g. "port8080, memory=8192";
+   *         an item without an amount needs all of the resource. Returns
+   *         false, with the first malformed item in bad, if an item has no
+   *         name or an amount that isn't a non-negative number; that item
+   *         needs all of the resource. */
+  static bool
+  parseResources(const char* spec, ResourceNeeds& needs, std::string& bad) {
+    bad.clear();
+    if (spec == NULL) return true;
+    std::stringstream items(spec);
+    std::string item;
+    while (std::getline(items, item, ',')) {
+      size_t eq = item.find('=');
+      double amount = -1;
+      bool ok = true;
+      if (eq != std::string::npos) {
+        std::string val = trimmed(item.substr(eq + 1));
+        char* end = NULL;
+        double x = std::strtod(val.c_str(), &end);
+        ok = !val.empty() && *end == '\0' && x >= 0;
+        if (ok) amount = x;
+      }
+      std::string name = trimmed(item.substr(0, eq));
+      if (name.empty()) ok = trimmed(item).empty();
+      if (!ok && bad.empty()) bad = trimmed(item);
+      if (!name.empty()) needs.push_back(std::make_pair(name, amount));
+    }
+    return bad.empty();
+  }
+
+  std::string
+  malformedResource(const char* list) {
+    ResourceNeeds needs;
+    std::string bad;
+    parseResources(list, needs, bad);
+    return bad;
+  }
+
+  /** \brief what each of tests needs. A test that's in tests more than once
+   *         (as when --repeat runs several iterations at a time) also needs
+   *         the whole of a resource of its own, so that its copies never
+   *         run alongside each other. */
+  static std::vector<ResourceNeeds>
+  resourceNeeds(const std::vector<const TestCase*>& tests) {
+    std::map<const TestCase*, size_t> copies;
+    for (size_t i = 0; i < tests.size(); ++i) ++copies[tests[i]];
+    std::vector<ResourceNeeds> needs(tests.size());
+    for (size_t i = 0; i < tests.size(); ++i) {
+      std::string bad;
+      parseResources(tests[i]->getResources(), needs[i], bad);
+      if (copies[tests[i]] < 2) continue;
+      std::ostringstream own;
+      own << "copies of " << static_cast<const void*>(tests[i]);
+      needs[i].push_back(std::make_pair(own.str(), -1.0));
+    }
+    return needs;
+  }
+
+  /** \brief how many MB of memory the machine has; 0 if we can't tell */
+  static double
+  physicalMemoryMb() {
+    long pages = ::sysconf(_SC_PHYS_PAGES), size = ::sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || size <= 0) return 0;
+    return static_cast<double>(pages) * size / (1024 * 1024);
+  }
+
+  /**
+   * \brief Keeps track of the resources used by the tests that are running,
+   *        so that tests whose needs don't fit alongside them are held back.
+   *        An item whose needs can't fit even on its own is given the whole
+   *        of each resource instead, so it still runs, just alone. When
+   *        items are run by several threads, one that can't start yet is put
+   *        aside and started by whichever thread frees enough for it.
+   */
+  class ResourceScheduler {
+  public:
+    /** \brief schedule items needing needs[i], with the capacities given
+     *         (see RunOptions::resources) */
+    ResourceScheduler(const std::vector<ResourceNeeds>& needs,
+                      const std::map<std::string, double>& capacities) :
+      needs(needs), capacities(capacities) {
+      if (this->capacities.count("memory") == 0 && physicalMemoryMb() > 0)
+        this->capacities["memory"] = physicalMemoryMb();
+    }
+
+    /** \brief does item need anything? If not, it can always start */
+    bool needsAny(size_t item) const { return !needs[item].empty(); }
+
+    /** \brief take what item needs if there's enough free; true if so */
+    bool tryTake(size_t item) {
+      std::lock_guard<std::mutex> guard(lock);
+      if (!fits(item)) return false;
+      use(item, 1);
+      return true;
+    }
+
+    /** \brief give back what item took */
+    void give(size_t item) {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        use(item, -1);
+      }
+      freed.notify_all();
+    }
+
+    /** \brief take what item needs and return true if there's enough free;
+     *         otherwise put it aside until there is */
+    bool startOrPutAside(size_t item) {
+      std::lock_guard<std::mutex> guard(lock);
+      if (!fits(item)) {
+        putAside.push_back(item);
+        return false;
+      }
+      use(item, 1);
+      return true;
+    }
+
+    /** \brief give back what item took; true, with next set to it (and
+     *         what it needs taken), if an item put aside can now start */
+    bool finishAndTakeNext(size_t item, size_t& next) {
+      bool found;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        use(item, -1);
+        found = takePutAside(next);
+      }
+      freed.notify_all();
+      return found;
+    }
+
+    /** \brief wait until an item put aside can start, and take what it
+     *         needs; false once none are left */
+    bool waitForPutAside(size_t& item) {
+      std::unique_lock<std::mutex> guard(lock);
+      while (!putAside.empty()) {
+        if (takePutAside(item)) return true;
+        freed.wait(guard);
+      }
+      return false;
+    }
+
+  private:
+    /** \brief how much of a resource there is */
+    double capacity(const std::string& name) const {
+      std::map<std::string, double>::const_iterator c = capacities.find(name);
+      return c == capacities.end() ? 1 : c->second;
+    }
+
+    /** \brief how much of resource r an item will actually take */
+    double amount(const std::pair<std::string, double>& r) const {
+      double cap = capacity(r.first);
+      return r.second < 0 ? cap : std::min(r.second, cap);
+    }
+
+    /** \brief is there enough free for item? */
+    bool fits(size_t item) const {
+      const ResourceNeeds& n = needs[item];
+      for (size_t i = 0; i < n.size(); ++i) {
+        std::map<std::string, double>::const_iterator u =
+          used.find(n[i].first);
+        double inUse = u == used.end() ? 0 : u->second;
+        if (inUse > 1e-9 && inUse + amount(n[i]) > capacity(n[i].first) + 1e-9)
+          return false;
+      }
+      return true;
+    }
+
+    /** \brief add (sign 1) or remove (sign -1) item's use of resources */
+    void use(size_t item, int sign) {
+      const ResourceNeeds& n = needs[item];
+      for (size_t i = 0; i < n.size(); ++i)
+        used[n[i].first] += sign * amount(n[i]);
+    }
+
+    /** \brief start the first item put aside that now fits, if any */
+    bool takePutAside(size_t& item) {
+      for (std::deque<size_t>::iterator it = putAside.begin();
+           it != putAside.end(); ++it) {
+        if (!fits(*it)) continue;
+        item = *it;
+        putAside.erase(it);
+        use(item, 1);
+        return true;
+      }
+      return false;
+    }
+
+    std::vector<ResourceNeeds> needs;
+    std::map<std::string, double> capacities;
+    /** how much of each resource the running items are using */
+    std::map<std::string, double> used;
+    /** items waiting for resources, in the order they were put aside */
+    std::deque<size_t> putAside;
+    std::mutex lock;
+    std::condition_variable freed;
+  };
+}
+
+/******************************************************************************
+ **                          ASYNC TEST EVENT LOOP                           **
+ ******************************************************************************/
+
+#ifdef TINYTEST_HAS_COROUTINES
+namespace TinyTest {
+  /** the most async tests to have running at once, so that a large suite
+   *  of them doesn't run out of fds */
+  static const size_t MAX_ASYNC_TESTS = 256;
+
+  /**
+   * \brief A single-threaded event loop that runs async tests (TEST_ASYNC)
+   *        together: each test runs until it awaits an fd or a timer, and
+   *        the loop resumes it once that's ready, running the others in the
+   *        meantime. It waits with epoll on Linux and poll elsewhere. A test
+   *        that runs out of time is destroyed where it's waiting, and the
+   *        others carry on.
+   */
+  class EventLoop {
+  public:
+    /** \brief told which test finished (counting from 0 in the order they
+     *         were started), what it threw if anything, and whether it ran
+     *         out of time */
+    typedef std::function<void(size_t test, std::exception_ptr error,
+                               bool timedOut)> Finished;
+
+    /** \brief told when the loop hands the thread to a test (numbered as
+     *         for Finished), with the time it has left in ms (0 if it has
+     *         no limit), and when the test hands it back, with -1. A test
+     *         that blocks instead of awaiting can't be stopped by the loop,
+     *         but this lets someone else notice. */
+    typedef std::function<void(size_t test, double leftMs)> Running;
+
+    EventLoop() : running(0), currentTest(0), pollFd(-1) {
+#ifdef __linux__
+      pollFd = ::epoll_create1(EPOLL_CLOEXEC);
+      if (pollFd < 0)
+        throw TinyTestException(std::string("couldn't create an epoll "
+                                            "instance: ") +
+                                std::strerror(errno));
+#endif
+    }
+
+    ~EventLoop() { if (pollFd >= 0) ::close(pollFd); }
+
+    /** \brief the loop running on this thread; NULL if there isn't one */
+    static EventLoop* current() { return loop; }
+
+    /** \brief start task, with a time limit of limitMs (0 for none); it
+     *         runs once run is called, or straight away if it has been */
+    void start(AsyncTask task, double limitMs) {
+      tests.push_back(Test(std::move(task), limitMs));
+      ready.push_back(Waiter(tests.back().task->handle(), tests.size() - 1));
+      ++running;
+    }
+
+    /** \brief run until every test started has finished, telling finished
+     *         about each (which may start more), and watch about each
+     *         stretch of a test's own code if it's given */
+    void run(const Finished& finished, const Running& watch = Running()) {
+      runningTest = watch;
+      EventLoop* outer = loop;
+      loop = this;
+      struct Restore {
+        EventLoop* outer;
+        ~Restore() { loop = outer; }
+      } restore = { outer };
+      while (running > 0) {
+        while (!ready.empty()) {
+          Waiter w = ready.front();
+          ready.pop_front();
+          resume(w, finished);
+        }
+        if (running == 0) break;
+        if (fds.empty() && timers.empty() && !anyDeadline()) {
+          // nothing will ever wake the tests still waiting
+          for (size_t t = 0; t < tests.size(); ++t)
+            if (tests[t].task)
+              end(t, std::make_exception_ptr(TinyTestException(
+                    "TEST_ASYNC test is waiting on something other than "
+                    "an fd, a timer or another TinyTest::AsyncTask")),
+                  false, finished);
+          continue;  // finished may have started more
+        }
+        waitForEvents();
+        Clock::time_point now = Clock::now();
+        while (!timers.empty() && timers.begin()->first <= now) {
+          ready.push_back(timers.begin()->second);
+          timers.erase(timers.begin());
+        }
+        for (size_t t = 0; t < tests.size(); ++t)
+          if (tests[t].task && tests[t].limited && tests[t].deadline <= now)
+            end(t, std::exception_ptr(), true, finished);
+      }
+    }
+
+    /** \brief resume h, part of the test running now, once fd is ready */
+    void waitForFd(int fd, bool forWriting, std::coroutine_handle<> h) {
+      Waiters& w = fds[fd];
+      if ((forWriting ? w.writer : w.reader).h) {
+        std::stringstream ss;
+        ss << "fd " << fd << " is already being waited on for "
+           << (forWriting ? "writing" : "reading") << " by another test";
+        throw TinyTestException(ss.str());
+      }
+      (forWriting ? w.writer : w.reader) = Waiter(h, currentTest);
+      if (!update(fd)) {
+        // not something that can be waited on (a regular file, say), so
+        // it's as ready as it will ever be
+        (forWriting ? w.writer : w.reader) = Waiter();
+        if (!w.reader.h && !w.writer.h) fds.erase(fd);
+        ready.push_back(Waiter(h, currentTest));
+      }
+    }
+
+    /** \brief resume h, part of the test running now, after ms */
+    void waitForTime(double ms, std::coroutine_handle<> h) {
+      // cut to 1e9 ms, like the time limits, so the deadline can't overflow
+      Clock::time_point when = Clock::now() +
+        std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double, std::milli>(std::min(ms, 1e9)));
+      timers.insert(std::make_pair(when, Waiter(h, currentTest)));
+    }
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    /** \brief a suspended coroutine and the test it belongs to */
+    struct Waiter {
+      Waiter() : test(0) {;}
+      Waiter(std::coroutine_handle<> h, size_t test) : h(h), test(test) {;}
+      std::coroutine_handle<> h;
+      size_t test;
+    };
+
+    /** \brief what's waiting to read from and write to an fd */
+    struct Waiters {
+      Waiters() : registered(false) {;}
+      Waiter reader, writer;
+      /** is the fd in the epoll set? */
+      bool registered;
+    };
+
+    /** \brief a test that has been started */
+    struct Test {
+      Test(AsyncTask task, double limitMs) :
+        task(new AsyncTask(std::move(task))), limited(limitMs > 0) {
+        deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double, std::milli>(limitMs));
+      }
+      /** the test's body; NULL once the test has finished */
+      std::unique_ptr<AsyncTask> task;
+      bool limited;
+      Clock::time_point deadline;
+    };
+
+    /** \brief resume w, and finish its test if that completes it */
+    void resume(const Waiter& w, const Finished& finished) {
+      if (!tests[w.test].task) return;  // it ran out of time
+      currentTest = w.test;
+      if (runningTest) runningTest(w.test, timeLeftMs(w.test));
+      w.h.resume();
+      if (runningTest) runningTest(w.test, -1);
+      AsyncTask::Handle root = tests[w.test].task->handle();
+      if (root.done()) end(w.test, root.promise().error, false, finished);
+    }
+
+    /** \brief finish test t, forgetting anything it's waiting on and
+     *         destroying it */
+    void end(size_t t, std::exception_ptr error, bool timedOut,
+             const Finished& finished) {
+      for (std::map<int, Waiters>::iterator it = fds.begin();
+           it != fds.end(); ) {
+        // update may forget the fd, so move on first
+        const int fd = it->first;
+        Waiters& w = (it++)->second;
+        bool changed = false;
+        if (w.reader.h && w.reader.test == t) {
+          w.reader = Waiter();
+          changed = true;
+        }
+        if (w.writer.h && w.writer.test == t) {
+          w.writer = Waiter();
+          changed = true;
+        }
+        if (changed) update(fd);
+      }
+      std::multimap<Clock::time_point, Waiter>::iterator it;
+      for (it = timers.begin(); it != timers.end(); )
+        if (it->second.test == t) timers.erase(it++);
+        else ++it;
+      tests[t].task.reset();
+      --running;
+      finished(t, error, timedOut);
+    }
+
+    /** \brief how long test t has left in ms; 0 if it has no limit */
+    double timeLeftMs(size_t t) const {
+      if (!tests[t].limited) return 0;
+      double ms = std::chrono::duration<double, std::milli>(
+        tests[t].deadline - Clock::now()).count();
+      return std::max(ms, 1e-3);
+    }
+
+    /** \brief does any test still running have a time limit? */
+    bool anyDeadline() const {
+      for (size_t t = 0; t < tests.size(); ++t)
+        if (tests[t].task && tests[t].limited) return true;
+      return false;
+    }
+
+    /** \brief how long to wait for events: until the next timer or
+     *         deadline, in ms; -1 for ever */
+    int waitMs() const {
+      Clock::time_point next = Clock::time_point::max();
+      if (!timers.empty()) next = timers.begin()->first;
+      for (size_t t = 0; t < tests.size(); ++t)
+        if (tests[t].task && tests[t].limited)
+          next = std::min(next, tests[t].deadline);
+      if (next == Clock::time_point::max()) return -1;
+      double ms = std::chrono::duration<double, std::milli>(
+        next - Clock::now()).count();
+      return ms <= 0 ? 0 : int(std::min(std::ceil(ms), 1e9));
+    }
+
+    /**
+     * \brief bring what's watched for fd into line with what's waiting on
+     *        it, forgetting fd if nothing is; returns false if fd can't be
+     *        watched
+     */
+    bool update(int fd) {
+      Waiters& w = fds[fd];
+      if (!w.reader.h && !w.writer.h) {
+#ifdef __linux__
+        if (w.registered) ::epoll_ctl(pollFd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+        fds.erase(fd);
+        return true;
+      }
+#ifdef __linux__
+      epoll_event e;
+      std::memset(&e, 0, sizeof(e));
+      e.events = (w.reader.h ? EPOLLIN : 0) | (w.writer.h ? EPOLLOUT : 0);
+      e.data.fd = fd;
+      if (::epoll_ctl(pollFd, w.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                      fd, &e) != 0) {
+        if (errno == EPERM) return false;
+        throw TinyTestException(std::string("couldn't wait on fd: ") +
+                                std::strerror(errno));
+      }
+      w.registered = true;
+#endif
+      return true;
+    }
+
+    /** \brief fd has become readable (or writable); make whatever was
+     *         waiting for that ready to run */
+    void fdReady(int fd, bool readable, bool writable) {
+      std::map<int, Waiters>::iterator it = fds.find(fd);
+      if (it == fds.end()) return;
+      if (readable && it->second.reader.h) {
+        ready.push_back(it->second.reader);
+        it->second.reader = Waiter();
+      }
+      if (writable && it->second.writer.h) {
+        ready.push_back(it->second.writer);
+        it->second.writer = Waiter();
+      }
+      update(fd);
+    }
+
+    /** \brief wait until an fd is ready or the next timer or deadline */
+    void waitForEvents() {
+      const int timeout = waitMs();
+#ifdef __linux__
+      epoll_event events[64];
+      int n = ::epoll_wait(pollFd, events, 64, timeout);
+      for (int i = 0; i < n; ++i) {
+        const uint32_t e = events[i].events;
+        const bool hungUp = (e & (EPOLLHUP | EPOLLERR)) != 0;
+        fdReady(events[i].data.fd, hungUp || (e & EPOLLIN),
+                hungUp || (e & EPOLLOUT));
+      }
+#else
+      std::vector<pollfd> polled;
+      std::map<int, Waiters>::const_iterator it;
+      for (it = fds.begin(); it != fds.end(); ++it) {
+        pollfd p;
+        p.fd = it->first;
+        p.events = (it->second.reader.h ? POLLIN : 0) |
+                   (it->second.writer.h ? POLLOUT : 0);
+        p.revents = 0;
+        polled.push_back(p);
+      }
+      if (::poll(polled.empty() ? NULL : &polled[0], polled.size(),
+                 timeout) <= 0) return;
+      for (size_t i = 0; i < polled.size(); ++i) {
+        const short e = polled[i].revents;
+        const bool hungUp = (e & (POLLHUP | POLLERR | POLLNVAL)) != 0;
+        if (e != 0)
+          fdReady(polled[i].fd, hungUp || (e & POLLIN),
+                  hungUp || (e & POLLOUT));
+      }
+#endif
+    }
+
+    /** the tests started so far, finished or not */
+    std::deque<Test> tests;
+    /** how many of them are still running */
+    size_t running;
+    /** the test whose coroutine was resumed last */
+    size_t currentTest;
+    /** told when each test's code starts and stops running */
+    Running runningTest;
+    /** coroutines that can carry on now, in the order they became ready */
+    std::deque<Waiter> ready;
+    /** what's waiting on each fd */
+    std::map<int, Waiters> fds;
+    /** coroutines waiting for a time */
+    std::multimap<Clock::time_point, Waiter> timers;
+    /** the epoll instance; -1 where there's no epoll */
+    int pollFd;
+    /** the loop running on this thread, if any */
+    static thread_local EventLoop* loop;
+  };
+
+  thread_local EventLoop* EventLoop::loop = NULL;
+
+  void
+  waitForFd(int fd, bool forWriting, std::coroutine_handle<> h) {
+    if (EventLoop::current() == NULL)
+      throw TinyTestException("TinyTest::readable and writable can only be "
+                              "awaited in a TEST_ASYNC");
+    EventLoop::current()->waitForFd(fd, forWriting, h);
+  }
+
+  void
+  waitForTime(double ms, std::coroutine_handle<> h) {
+    if (EventLoop::current() == NULL)
+      throw TinyTestException("TinyTest::sleepFor can only be awaited in a "
+                              "TEST_ASYNC");
+    EventLoop::current()->waitForTime(ms, h);
+  }
+
+  void
+  runToCompletion(AsyncTask task) {
+    EventLoop loop;
+    std::exception_ptr failure;
+    loop.start(std::move(task), 0);
+    loop.run([&](size_t, std::exception_ptr error, bool) {
+      failure = error;
+    });
+    if (failure) std::rethrow_exception(failure);
+  }
+}
+#endif
+
+/******************************************************************************
+ **                     VECTORISED CONTAINER COMPARISON                      **
+ ******************************************************************************/
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__GNUC__) || defined(__clang__))
+#define TINYTEST_X86_KERNELS
+#define TINYTEST_ALWAYS_INLINE inline __attribute__((always_inline))
+#endif
+
+namespace TinyTest {
+  /** \brief the instruction sets the comparison kernels can use */
+  enum SimdLevel { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2, SIMD_AVX512 };
+
+  /** \brief names of the SimdLevels, as accepted by --simd */
+  static const char* const SIMD_NAMES[] = {"scalar", "sse2", "avx2",
+                                           "avx512"};
+
+  /** \brief the best SimdLevel this machine supports. With
+   *         preferAvx512 false this stops at AVX2: GCC currently
+   *         scalarises some of the masked compares in the AVX-512 kernel,
+   *         making it slower than the AVX2 one, so AVX-512 is opt-in. */
+  static SimdLevel
+  detectSimd(bool preferAvx512 = false) {
+#ifdef TINYTEST_X86_KERNELS
+    __builtin_cpu_init();
+    if (preferAvx512 && __builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512dq")) return SIMD_AVX512;
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+    return SIMD_SCALAR;
+  }
+
+  /** \brief the SimdLevel in use; detected on first use */
+  static SimdLevel&
+  simdLevel() {
+    static SimdLevel level = detectSimd();
+    return level;
+  }
+
+  /**
+   * \brief use the named SimdLevel rather than the best available; returns
+   *        false if the name isn't known or this machine doesn't support
+   *        it. Only call this before any tests start running.
+   */
+  static bool
+  setSimdLevel(const std::string& name) {
+    SimdLevel best = detectSimd(true);
+    for (int l = SIMD_SCALAR; l <= SIMD_AVX512; ++l) {
+      if (name != SIMD_NAMES[l]) continue;
+      if (l > best) return false;
+      simdLevel() = SimdLevel(l);
+      return true;
+    }
+    return false;
+  }
+
+  /** \brief integer types the same size as each floating point type */
+  template<typename T> struct SameSizeInts;
+  template<> struct SameSizeInts<double> {
+    typedef int64_t Int;
+    typedef uint64_t UInt;
+  };
+  template<> struct SameSizeInts<float> {
+    typedef int32_t Int;
+    typedef uint32_t UInt;
+  };
+
+  /** \brief does the pair x, y fail the comparison? This is the scalar
+   *         counterpart of blockMismatch and must agree with it exactly. */
+  template<typename T>
+  static inline bool
+  scalarMismatch(T x, T y, Comparison c, T tol, uint64_t ulps) {
+    switch (c) {
+      case COMPARE_EXACT:    return x != y;
+      case COMPARE_ABSOLUTE: return std::fabs(x - y) > tol;
+      case COMPARE_RELATIVE: {
+        T d = std::fabs(x - y);
+        return d > tol * std::fabs(x) && d > tol * std::fabs(y);
+      }
+      case COMPARE_ULPS:
+        return x != x || y != y || ulpDistance(x, y) > ulps;
+    }
+    return true;
+  }
+
+  /** \brief the first index from i onwards that fails the comparison */
+  template<typename T>
+  static size_t
+  scalarFirstMismatch(const T* a, const T* b, size_t i, size_t n,
+                      Comparison c, T tol, uint64_t ulps) {
+    for (; i < n; ++i)
+      if (scalarMismatch(a[i], b[i], c, tol, ulps)) return i;
+    return n;
+  }
+
+#ifdef TINYTEST_X86_KERNELS
+  /** \brief GCC/clang generic vectors of BYTES bytes of T; U is for
+   *         unaligned loads */
+  template<size_t BYTES, typename T>
+  struct Vec {
+    typedef T V __attribute__((vector_size(BYTES)));
+    typedef T U __attribute__((vector_size(BYTES), aligned(sizeof(T))));
+  };
+
+  /**
+   * \brief set out to a mask (all bits set) of the lanes in which x and y
+   *        fail comparison C. Written with generic vector operations, so
+   *        this becomes SSE2, AVX2 or AVX-512 code depending on the target of
+   *        the function it is inlined into. Vectors are passed by reference
+   *        so their size doesn't affect the calling convention.
+   */
+  template<size_t BYTES, typename T, Comparison C>
+  static TINYTEST_ALWAYS_INLINE void
+  blockMismatch(const typename Vec<BYTES, T>::V& x,
+                const typename Vec<BYTES, T>::V& y,
+                const typename Vec<BYTES, T>::V& tol,
+                const typename Vec<BYTES,
+                  typename SameSizeInts<T>::UInt>::V& ulps,
+                typename Vec<BYTES, typename SameSizeInts<T>::Int>::V& out) {
+    typedef typename SameSizeInts<T>::Int Int;
+    typedef typename SameSizeInts<T>::UInt UInt;
+    typedef typename Vec<BYTES, T>::V V;
+    typedef typename Vec<BYTES, Int>::V I;
+    typedef typename Vec<BYTES, UInt>::V U;
+    const Int magnitude = std::numeric_limits<Int>::max();
+    const int signShift = sizeof(Int) * 8 - 1;
+
+    if (C == COMPARE_EXACT) {
+      out = x != y;
+      return;
+    }
+    V d = (V) ((I) (x - y) & magnitude);
+    if (C == COMPARE_ABSOLUTE) {
+      out = d > tol;
+      return;
+    }
+    if (C == COMPARE_RELATIVE) {
+      V ax = (V) ((I) x & magnitude), ay = (V) ((I) y & magnitude);
+      out = (d > tol * ax) & (d > tol * ay);
+      return;
+    }
+    // COMPARE_ULPS; see orderedBits() and ulpDistance()
+    I bx = (I) x, by = (I) y;
+    I nx = bx >> signShift, ny = by >> signShift;
+    I ox = (I) ((U) ((bx & magnitude) ^ nx) - (U) nx);
+    I oy = (I) ((U) ((by & magnitude) ^ ny) - (U) ny);
+    I xBigger = ox > oy;
+    U dist = (((U) ox - (U) oy) & (U) xBigger) |
+             (((U) oy - (U) ox) & ~(U) xBigger);
+    out = (I) (dist > ulps) | (x != x) | (y != y);
+  }
+
+  /** \brief true if any lane of the mask is set */
+  template<typename I>
+  static TINYTEST_ALWAYS_INLINE bool
+  anyLane(const I& m) {
+    uint64_t words[sizeof(I) / sizeof(uint64_t)];
+    std::memcpy(words, &m, sizeof(words));
+    uint64_t any = 0;
+    for (size_t w = 0; w < sizeof(I) / sizeof(uint64_t); ++w) any |= words[w];
+    return any != 0;
+  }
+
+  /**
+   * \brief the vectorised search for the first mismatch: check four vectors
+   *        at a time, and only when one of them reports a mismatch go back
+   *        over that block one element at a time to find exactly where it
+   *        is. The tail that doesn't fill a block is done the same way.
+   */
+  template<size_t BYTES, typename T, Comparison C>
+  static TINYTEST_ALWAYS_INLINE size_t
+  vectorFirstMismatch(const T* a, const T* b, size_t n, T tol,
+                      uint64_t ulps) {
+    typedef typename SameSizeInts<T>::Int Int;
+    typedef typename SameSizeInts<T>::UInt UInt;
+    typedef typename Vec<BYTES, T>::V V;
+    typedef typename Vec<BYTES, T>::U Unaligned;
+    typedef typename Vec<BYTES, Int>::V I;
+    typedef typename Vec<BYTES, UInt>::V U;
+    const size_t lanes = BYTES / sizeof(T), block = 4 * lanes;
+    V vtol;
+    U vulps;
+    for (size_t j = 0; j < lanes; ++j) {
+      vtol[j] = tol;
+      vulps[j] = UInt(ulps > UInt(-1) ? UInt(-1) : ulps);
+    }
+
+    size_t i = 0;
+    for (; i + block <= n; i += block) {
+      const Unaligned* va = reinterpret_cast<const Unaligned*>(a + i);
+      const Unaligned* vb = reinterpret_cast<const Unaligned*>(b + i);
+      V x[4] = {va[0], va[1], va[2], va[3]};
+      V y[4] = {vb[0], vb[1], vb[2], vb[3]};
+      I m[4];
+      for (size_t k = 0; k < 4; ++k)
+        blockMismatch<BYTES, T, C>(x[k], y[k], vtol, vulps, m[k]);
+      if (anyLane(m[0] | m[1] | m[2] | m[3])) break;
+    }
+    return scalarFirstMismatch(a, b, i, n, C, tol, ulps);
+  }
+
+  /** \brief pick the kernel for comparison c, with vectors of BYTES bytes */
+  template<size_t BYTES, typename T>
+  static TINYTEST_ALWAYS_INLINE size_t
+  vectorKernel(const T* a, const T* b, size_t n, Comparison c, T tol,
+               uint64_t ulps) {
+    switch (c) {
+      case COMPARE_EXACT:
+        return vectorFirstMismatch<BYTES, T, COMPARE_EXACT>(a, b, n, tol, ulps);
+      case COMPARE_ABSOLUTE:
+        return vectorFirstMismatch<BYTES, T, COMPARE_ABSOLUTE>(a, b, n, tol,
+                                                               ulps);
+      case COMPARE_RELATIVE:
+        return vectorFirstMismatch<BYTES, T, COMPARE_RELATIVE>(a, b, n, tol,
+                                                               ulps);
+      case COMPARE_ULPS:
+        return vectorFirstMismatch<BYTES, T, COMPARE_ULPS>(a, b, n, tol, ulps);
+    }
+    return 0;
+  }
+
+  // one copy of the kernels per instruction set
+  __attribute__((target("sse2"))) static size_t
+  kernelSse2(const double* a, const double* b, size_t n, Comparison c,
+             double tol, uint64_t ulps) {
+    return vectorKernel<16>(a, b, n, c, tol, ulps);
+  }
+  __attribute__((target("sse2"))) static size_t
+  kernelSse2(const float* a, const float* b, size_t n, Comparison c,
+             float tol, uint64_t ulps) {
+    return vectorKernel<16>(a, b, n, c, tol, ulps);
+  }
+  __attribute__((target("avx2"))) static size_t
+  kernelAvx2(const double* a, const double* b, size_t n, Comparison c,
+             double tol, uint64_t ulps) {
+    return vectorKernel<32>(a, b, n, c, tol, ulps);
+  }
+  __attribute__((target("avx2"))) static size_t
+  kernelAvx2(const float* a, const float* b, size_t n, Comparison c,
+             float tol, uint64_t ulps) {
+    return vectorKernel<32>(a, b, n, c, tol, ulps);
+  }
+  __attribute__((target("avx512f,avx512dq"))) static size_t
+  kernelAvx512(const double* a, const double* b, size_t n, Comparison c,
+               double tol, uint64_t ulps) {
+    return vectorKernel<64>(a, b, n, c, tol, ulps);
+  }
+  __attribute__((target("avx512f,avx512dq"))) static size_t
+  kernelAvx512(const float* a, const float* b, size_t n, Comparison c,
+               float tol, uint64_t ulps) {
+    return vectorKernel<64>(a, b, n, c, tol, ulps);
+  }
+#endif
+
+  /** \brief run the best kernel for this machine (or the one asked for) */
+  template<typename T>
+  static size_t
+  dispatchKernel(const T* a, const T* b, size_t n, Comparison c, T tol,
+                 uint64_t ulps) {
+#ifdef TINYTEST_X86_KERNELS
+    switch (simdLevel()) {
+      case SIMD_AVX512: return kernelAvx512(a, b, n, c, tol, ulps);
+      case SIMD_AVX2:   return kernelAvx2(a, b, n, c, tol, ulps);
+      case SIMD_SSE2:   return kernelSse2(a, b, n, c, tol, ulps);
+      case SIMD_SCALAR: break;
+    }
+#endif
+    return scalarFirstMismatch(a, b, 0, n, c, tol, ulps);
+  }
+
+  /** \brief the number of ULPs a tolerance given as a double stands for */
+  static uint64_t
+  toUlps(double tol) {
+    if (!(tol > 0)) return 0;
+    if (tol >= 18446744073709551615.0) return uint64_t(-1);
+    return uint64_t(tol);
+  }
+
+  size_t
+  firstMismatch(const double* a, const double* b, size_t n, Comparison c,
+                double tol) {
+    return dispatchKernel(a, b, n, c, tol, toUlps(tol));
+  }
+
+  size_t
+  firstMismatch(const float* a, const float* b, size_t n, Comparison c,
+                double tol) {
+    float ftol = float(tol);
+    // for absolute comparisons, float differences are compared against the
+    // double tolerance (as EXPECT_NEAR_STL_CONTAINER always has); comparing
+    // against the largest float not above it gives exactly the same answer
+    if (c == COMPARE_ABSOLUTE && double(ftol) > tol)
+      ftol = std::nextafter(ftol, -HUGE_VALF);
+    return dispatchKernel(a, b, n, c, ftol, toUlps(tol));
+  }
+
+  size_t
+  firstMismatchBytes(const void* a, const void* b, size_t n, size_t size) {
+    // memcmp is already vectorised; use it to find the first block that
+    // differs, then find the element within it
+    const char* pa = static_cast<const char*>(a);
+    const char* pb = static_cast<const char*>(b);
+    const size_t bytes = n * size, blockBytes = 4096 * size;
+    for (size_t off = 0; off < bytes; off += blockBytes) {
+      size_t len = std::min(blockBytes, bytes - off);
+      if (std::memcmp(pa + off, pb + off, len) == 0) continue;
+      for (size_t i = off / size; i < n; ++i)
+        if (std::memcmp(pa + i * size, pb + i * size, size) != 0) return i;
+    }
+    return n;
+  }
+}
+
+/******************************************************************************
+ **                        PRE-FORKED WORKER PROCESSES                       **
+ ******************************************************************************/
+
+namespace TinyTest {
+  /** \brief write all of buf to fd, retrying on EINTR; false on failure */
+  static bool
+  writeAll(int fd, const void* buf, size_t len) {
+    const char* p = static_cast<const char*>(buf);
+    while (len > 0) {
+      ssize_t n = ::write(fd, p, len);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      p += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  /** \brief read exactly len bytes from fd, retrying on EINTR; false on
+   *         failure or end of file */
+  static bool
+  readAll(int fd, void* buf, size_t len) {
+    char* p = static_cast<char*>(buf);
+    while (len > 0) {
+      ssize_t n = ::read(fd, p, len);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return false;
+      p += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  /** \brief a short, readable name for a signal number, e.g. SIGSEGV */
+  static std::string
+  signalName(int sig) {
+    switch (sig) {
+      case SIGSEGV: return "SIGSEGV";
+      case SIGABRT: return "SIGABRT";
+      case SIGFPE:  return "SIGFPE";
+      case SIGILL:  return "SIGILL";
+      case SIGBUS:  return "SIGBUS";
+      case SIGKILL: return "SIGKILL";
+      case SIGTERM: return "SIGTERM";
+      case SIGPIPE: return "SIGPIPE";
+      case SIGALRM: return "SIGALRM";
+      case SIGINT:  return "SIGINT";
+      case SIGTRAP: return "SIGTRAP";
+    }
+    std::stringstream ss;
+    ss << "signal " << sig;
+    return ss.str();
+  }
+
+  /** \brief describe how a worker process ended, given its wait status */
+  static std::string
+  describeExit(int status) {
+    std::stringstream ss;
+    if (WIFSIGNALED(status)) {
+      ss << "Test process was killed by " << signalName(WTERMSIG(status));
+      const char* desc = strsignal(WTERMSIG(status));
+      if (desc != NULL) ss << " (" << desc << ")";
+    } else if (WIFEXITED(status)) {
+      ss << "Test process exited unexpectedly with status "
+         << WEXITSTATUS(status);
+    } else {
+      ss << "Test process ended unexpectedly";
+    }
+    return ss.str();
+  }
+
+  /**
+   * \brief A pool of pre-forked worker processes. Each worker is sent item
+   *        indices over a pipe, runs them one at a time and sends back a
+   *        payload over a second pipe. A worker that dies (crash, abort,
+   *        exit) is reaped, the item it was running is reported as crashed
+   *        and a replacement worker is forked, so forking costs are paid per
+   *        crash rather than per item. A worker that runs past an item's
+   *        time limit is killed and replaced in the same way. Under make -j,
+   *        every worker but the first needs a job slot to be given items.
+   *
+   *        No other thread in the parent may hold a lock while run() is
+   *        forking them, or the worker's copy of the lock is never released.
+   *        beforeFork, if given, is called before every fork to bring any
+   *        such threads to a standstill.
+   */
+  class ForkedWorkerPool {
+  public:
+    /** \brief runs in the worker; turns an item into a payload */
+    typedef std::function<std::string(size_t item)> Work;
+
+    /** \brief how an item ended */
+    enum Outcome {FINISHED, CRASHED, TIMED_OUT};
+
+    /** \brief runs in the parent once an item is finished. If the worker
+     *         died, status is its wait status. */
+    typedef std::function<void(size_t item, Outcome outcome,
+                               const std::string& payload,
+                               int status)> Done;
+
+    /** \brief the time limit for an item in ms; 0 means no limit */
+    typedef std::function<double(size_t item)> Limit;
+
+    /** \brief can item start now? If this says so, it's given to a worker
+     *         (and done is called for it) before long; if not, it's asked
+     *         again once some other item is done */
+    typedef std::function<bool(size_t item)> Ready;
+
+    /** \brief runs in the parent before each worker is forked */
+    typedef std::function<void()> BeforeFork;
+
+    /** \brief construct a pool that will use the given number of workers */
+    explicit ForkedWorkerPool(size_t nWorkers,
+                              const BeforeFork& beforeFork = BeforeFork()) :
+      workers(nWorkers == 0 ? 1 : nWorkers), beforeFork(beforeFork) {;}
+
+    /**
+     * \brief process items 0 .. nItems-1, handing each one to a worker.
+     *        done is called in the parent exactly once per item, in
+     *        completion order. Items are started in order, except that
+     *        one that isn't ready (if ready is given) waits until it is.
+     *        Blocks until everything is finished and the workers have been
+     *        shut down.
+     */
+    void run(size_t nItems, const Work& work, const Done& done,
+             const Limit& limit, const Ready& ready = Ready()) {
+      // a dead worker's command pipe must give EPIPE, not kill us
+      void (*oldPipeHandler)(int) = signal(SIGPIPE, SIG_IGN);
+      size_t next = 0, finished = 0;
+      // items that weren't ready in their turn, and items that are ready
+      // but still have to be given to a worker
+      std::deque<size_t> waiting, handOn;
+      auto takeNext = [&](size_t& item) {
+        if (!handOn.empty()) {
+          item = handOn.front();
+          handOn.pop_front();
+          return true;
+        }
+        for (std::deque<size_t>::iterator it = waiting.begin();
+             it != waiting.end(); ++it) {
+          if (ready && !ready(*it)) continue;
+          item = *it;
+          waiting.erase(it);
+          return true;
+        }
+        while (next < nItems) {
+          item = next++;
+          if (!ready || ready(item)) return true;
+          waiting.push_back(item);
+        }
+        return false;
+      };
+      if (workers.size() > nItems) workers.resize(nItems);
+      for (size_t w = 0; w < workers.size(); ++w) spawn(w, work);
+
+      while (finished < nItems) {
+        // keep every idle worker that can get a job slot busy
+        for (size_t w = 0; w < workers.size(); ++w) {
+          if (workers[w].busy) continue;
+          size_t item;
+          if (!takeNext(item)) break;
+          if (!takeSlot(w)) {
+            handOn.push_front(item);
+            continue;
+          }
+          uint64_t wire = item;
+          workers[w].busy = true;
+          workers[w].item = item;
+          workers[w].limitMs = limit(item);
+          workers[w].started = std::chrono::steady_clock::now();
+          if (writeAll(workers[w].cmdFd, &wire, sizeof(wire))) continue;
+          // the worker died while idle; give the item to a replacement
+          // straight away, as there may be no other worker to take it (and
+          // so nothing to wait for). If that one dies too, the item is
+          // reported as crashed rather than going round again.
+          workers[w].busy = false;
+          shutdown(w);
+          spawn(w, work);
+          workers[w].busy = true;
+          workers[w].started = std::chrono::steady_clock::now();
+          if (writeAll(workers[w].cmdFd, &wire, sizeof(wire))) continue;
+          reap(w, done, finished);
+          if (next < nItems || !waiting.empty() || !handOn.empty())
+            spawn(w, work);
+        }
+        // idle workers don't need their slots
+        for (size_t w = 0; w < workers.size(); ++w) giveBackSlot(w);
+
+        // the last entry watches for a job slot, if an item is waiting for
+        // one
+        std::vector<pollfd> fds(workers.size() + 1);
+        fds.back().fd = handOn.empty() ? -1 : JobServer::get().pollFd();
+        for (size_t w = 0; w < workers.size(); ++w)
+          fds[w].fd = workers[w].busy ? workers[w].resFd : -1;
+        for (size_t w = 0; w < fds.size(); ++w) {
+          fds[w].events = POLLIN;
+          fds[w].revents = 0;
+        }
+        if (::poll(&fds[0], fds.size(), pollTimeout()) < 0) {
+          if (errno == EINTR) continue;
+          break;
+        }
+        killOverrunning();
+
+        for (size_t w = 0; w < workers.size(); ++w) {
+          if (fds[w].revents == 0) continue;
+          std::string payload;
+          if (receive(w, payload)) {
+            workers[w].busy = false;
+            ++finished;
+            done(workers[w].item, FINISHED, payload, 0);
+          } else {
+            reap(w, done, finished);
+            if (next < nItems || !waiting.empty() || !handOn.empty())
+              spawn(w, work);
+          }
+        }
+      }
+
+      for (size_t w = 0; w < workers.size(); ++w) {
+        giveBackSlot(w);
+        shutdown(w);
+      }
+      signal(SIGPIPE, oldPipeHandler);
+    }
+
+  private:
+    /** \brief the parent's view of one worker process */
+    struct Worker {
+      Worker() : pid(-1), cmdFd(-1), resFd(-1), busy(false), item(0),
+                 limitMs(0), timedOut(false), hasSlot(false), token(0) {;}
+      pid_t pid;
+      int cmdFd;
+      int resFd;
+      bool busy;
+      size_t item;
+      /** the time limit for the item, and when it was started */
+      double limitMs;
+      std::chrono::steady_clock::time_point started;
+      /** true once the worker has been killed for running out of time */
+      bool timedOut;
+      /** true while the worker holds a job slot, and the byte it took */
+      bool hasSlot;
+      char token;
+    };
+
+    /** \brief make sure worker w has a job slot (the first always does);
+     *         false if there isn't one free */
+    bool takeSlot(size_t w) {
+      if (w == 0 || workers[w].hasSlot) return true;
+      workers[w].hasSlot = JobServer::get().tryAcquire(workers[w].token);
+      return workers[w].hasSlot;
+    }
+
+    /** \brief give back worker w's job slot once it's no longer needed */
+    void giveBackSlot(size_t w) {
+      if (w == 0 || !workers[w].hasSlot || workers[w].busy) return;
+      workers[w].hasSlot = false;
+      JobServer::get().release(workers[w].token);
+    }
+
+    /** \brief fork worker w; in the child this never returns */
+    void spawn(size_t w, const Work& work) {
+      int cmd[2], res[2];
+      if (::pipe(cmd) != 0 || ::pipe(res) != 0) {
+        perror("TinyTest: pipe");
+        std::exit(EXIT_FAILURE);
+      }
+      if (beforeFork) beforeFork();
+      // anything still buffered would otherwise be written twice
+      std::cout.flush();
+      std::cerr.flush();
+      pid_t pid = ::fork();
+      if (pid < 0) {
+        perror("TinyTest: fork");
+        std::exit(EXIT_FAILURE);
+      }
+      if (pid == 0) {
+        // close other workers' pipes, or their crashes would go unnoticed
+        for (size_t o = 0; o < workers.size(); ++o) {
+          if (workers[o].pid <= 0) continue;
+          ::close(workers[o].cmdFd);
+          ::close(workers[o].resFd);
+        }
+        ::close(cmd[1]);
+        ::close(res[0]);
+        serve(cmd[0], res[1], work);
+      }
+      ::close(cmd[0]);
+      ::close(res[1]);
+      workers[w].pid = pid;
+      workers[w].cmdFd = cmd[1];
+      workers[w].resFd = res[0];
+      workers[w].busy = false;
+      workers[w].timedOut = false;
+    }
+
+    /** \brief the worker's main loop: read an item, run it, reply */
+    static void serve(int cmdFd, int resFd, const Work& work) {
+      uint64_t item;
+      while (readAll(cmdFd, &item, sizeof(item))) {
+        std::string payload = work(item);
+        std::cout.flush();
+        uint64_t len = payload.size();
+        if (!writeAll(resFd, &len, sizeof(len)) ||
+            !writeAll(resFd, payload.data(), payload.size())) break;
+      }
+      std::cout.flush();
+      ::_exit(EXIT_SUCCESS);
+    }
+
+    /** \brief read one reply from worker w; false if the worker died */
+    bool receive(size_t w, std::string& payload) {
+      uint64_t len;
+      if (!readAll(workers[w].resFd, &len, sizeof(len))) return false;
+      payload.resize(len);
+      return len == 0 || readAll(workers[w].resFd, &payload[0], len);
+    }
+
+    /** \brief collect a dead worker and report the item it was running */
+    void reap(size_t w, const Done& done, size_t& finished) {
+      int status = 0;
+      shutdown(w, &status);
+      if (workers[w].busy) {
+        workers[w].busy = false;
+        ++finished;
+        done(workers[w].item, workers[w].timedOut ? TIMED_OUT : CRASHED,
+             std::string(), status);
+      }
+    }
+
+    /** \brief close our ends of worker w's pipes and wait for it to exit */
+    void shutdown(size_t w, int* status = NULL) {
+      if (workers[w].pid <= 0) return;
+      ::close(workers[w].cmdFd);
+      ::close(workers[w].resFd);
+      int st = 0;
+      while (::waitpid(workers[w].pid, &st, 0) < 0 && errno == EINTR) {;}
+      if (status != NULL) *status = st;
+      workers[w].pid = -1;
+    }
+
+    /** \brief ms since worker w started its item */
+    double elapsedMs(size_t w) const {
+      return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - workers[w].started).count();
+    }
+
+    /** \brief how long poll can wait before a time limit might be reached;
+     *         -1 if no busy worker has a limit */
+    int pollTimeout() const {
+      double wait = -1;
+      for (size_t w = 0; w < workers.size(); ++w) {
+        if (!workers[w].busy || workers[w].limitMs <= 0 ||
+            workers[w].timedOut) continue;
+        double left = std::max(0.0, workers[w].limitMs - elapsedMs(w));
+        if (wait < 0 || left < wait) wait = left;
+      }
+      return wait < 0 ? -1 : int(std::min(std::ceil(wait), 1e9));
+    }
+
+    /** \brief kill any worker that has run past its item's time limit; its
+     *         pipe closes, so it's reaped like any other dead worker */
+    void killOverrunning() {
+      for (size_t w = 0; w < workers.size(); ++w) {
+        if (!workers[w].busy || workers[w].limitMs <= 0 ||
+            workers[w].timedOut || elapsedMs(w) < workers[w].limitMs)
+          continue;
+        workers[w].timedOut = true;
+        ::kill(workers[w].pid, SIGKILL);
+      }
+    }
+
+    /** the workers; a slot is re-used when its process is replaced */
+    std::vector<Worker> workers;
+    /** called before each worker is forked */
+    BeforeFork beforeFork;
+  };
+}
+
+/******************************************************************************
+ **                         PERFORMANCE COUNTERS                             **
+ ******************************************************************************/
+
+namespace TinyTest {
+  /** \brief the names the counters are reported under */
+  static const char* const COUNTER_NAMES[N_COUNTERS] = {
+    "cycles", "instructions", "cache misses", "branch misses", "page faults"
+  };
+
+  /** \brief the counters' values at some moment, and how long they had been
+   *         enabled and actually counting (less if they were multiplexed) */
+  struct CounterSample {
+    int64_t value[N_COUNTERS] = {};
+    uint64_t enabledNs = 0, runningNs = 0;
+  };
+
+#ifdef __linux__
+  /**
+   * \brief The performance counters for one thread, opened with
+   *        perf_event_open as a single group so that they all count over the
+   *        same stretch of time. Any that can't be opened (the CPU or VM
+   *        doesn't have them, or perf_event_paranoid forbids them) are left
+   *        out, and read as -1.
+   */
+  class PerfCounters {
+  public:
+    /** \brief the counters for the calling thread, opened on first use */
+    static PerfCounters& forThread() {
+      static thread_local PerfCounters counters;
+      // a forked worker inherits its parent's, which count the parent
+      if (counters.tid != pid_t(::syscall(SYS_gettid))) counters.open();
+      return counters;
+    }
+
+    ~PerfCounters() { close(); }
+
+    /** \brief read the counters into s */
+    void read(CounterSample& s) const {
+      for (size_t k = 0; k < N_COUNTERS; ++k) s.value[k] = -1;
+      s.enabledNs = s.runningNs = 0;
+      // PERF_FORMAT_GROUP: the number of counters, the times, the values
+      uint64_t buf[3 + N_COUNTERS];
+      if (leader < 0 ||
+          ::read(leader, buf, sizeof(buf)) < ssize_t((3 + nOpen) * 8))
+        return;
+      s.enabledNs = buf[1];
+      s.runningNs = buf[2];
+      for (size_t k = 0; k < N_COUNTERS; ++k)
+        if (slot[k] >= 0) s.value[k] = buf[3 + slot[k]];
+    }
+
+    /** the errno from opening each counter; 0 for those that opened */
+    int error[N_COUNTERS];
+
+  private:
+    PerfCounters() : tid(0), leader(-1), nOpen(0) {
+      for (size_t k = 0; k < N_COUNTERS; ++k) fds[k] = -1;
+    }
+
+    void open() {
+      static const struct { uint32_t type; uint64_t config; }
+      EVENTS[N_COUNTERS] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS }
+      };
+      close();
+      tid = pid_t(::syscall(SYS_gettid));
+      const int forced = forcedError();
+      for (size_t k = 0; k < N_COUNTERS; ++k) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = EVENTS[k].type;
+        attr.config = EVENTS[k].config;
+        attr.read_format = PERF_FORMAT_GROUP |
+                           PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // user space only, which perf_event_paranoid 2 still allows
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fds[k] = forced != 0 ? -1 :
+          int(::syscall(SYS_perf_event_open, &attr, 0, -1, leader,
+                        PERF_FLAG_FD_CLOEXEC));
+        error[k] = forced != 0 ? forced : fds[k] < 0 ? errno : 0;
+        slot[k] = fds[k] < 0 ? -1 : int(nOpen++);
+        if (fds[k] >= 0 && leader < 0) leader = fds[k];
+      }
+    }
+
+    /** \brief the error TINYTEST_PERF_EVENT_ERROR (EACCES or ENOENT) says
+     *         every counter should fail to open with, as if perf_event_open
+     *         had, so that a run without counters can be tried anywhere; 0
+     *         if it isn't set */
+    static int forcedError() {
+      const char* name = std::getenv("TINYTEST_PERF_EVENT_ERROR");
+      if (name == NULL) return 0;
+      if (std::strcmp(name, "EACCES") == 0) return EACCES;
+      if (std::strcmp(name, "ENOENT") == 0) return ENOENT;
+      return 0;
+    }
+
+    void close() {
+      for (size_t k = 0; k < N_COUNTERS; ++k) {
+        if (fds[k] >= 0) ::close(fds[k]);
+        fds[k] = -1;
+      }
+      leader = -1;
+      nOpen = 0;
+    }
+
+    /** the thread the counters were opened on */
+    pid_t tid;
+    /** each counter's fd, and its place in the group; -1 if not open */
+    int fds[N_COUNTERS], slot[N_COUNTERS];
+    /** the fd of the group's leader; -1 if nothing could be opened */
+    int leader;
+    /** how many of the counters are open */
+    size_t nOpen;
+  };
+#endif
+
+  /** \brief read the calling thread's counters into s */
+  static void
+  readCounters(CounterSample& s) {
+#ifdef __linux__
+    PerfCounters::forThread().read(s);
+#else
+    for (size_t k = 0; k < N_COUNTERS; ++k) s.value[k] = -1;
+    s.enabledNs = s.runningNs = 0;
+#endif
+  }
+
+  /** \brief record in u what the counters counted between a and b, scaled
+   *         up for any time they weren't counting */
+  static void
+  countersBetween(const CounterSample& a, const CounterSample& b,
+                  ResourceUsage& u) {
+    u.counted = true;
+    const uint64_t running = b.runningNs - a.runningNs;
+    const double scale = running == 0 ? 0 :
+      double(b.enabledNs - a.enabledNs) / running;
+    for (size_t k = 0; k < N_COUNTERS; ++k) {
+      u.counters[k] = -1;
+      if (a.value[k] >= 0 && b.value[k] >= 0 && running > 0)
+        u.counters[k] = int64_t(std::llround((b.value[k] - a.value[k]) *
+                                             scale));
+    }
+  }
+
+  /**
+   * \brief why some of the counters can't be used on this machine, as a
+   *        note for the start of the run; empty if they all can.
+   */
+  static std::string
+  countersUnavailable() {
+#ifdef __linux__
+    const PerfCounters& counters = PerfCounters::forThread();
+    std::vector<std::string> missing;
+    int why = 0;
+    for (size_t k = 0; k < N_COUNTERS; ++k) {
+      if (counters.error[k] == 0) continue;
+      missing.push_back(COUNTER_NAMES[k]);
+      if (why == 0) why = counters.error[k];
+    }
+    if (missing.empty()) return "";
+    std::stringstream ss;
+    ss << "Note: ";
+    for (size_t i = 0; i < missing.size(); ++i)
+      ss << (i == 0 ? "" : i + 1 == missing.size() ? " and " : ", ")
+         << missing[i];
+    ss << (missing.size() == 1 ? " is" : " are")
+       << " unavailable (" << std::strerror(why);
+    std::ifstream paranoid("/proc/sys/kernel/perf_event_paranoid");
+    int level;
+    if ((why == EACCES || why == EPERM) && paranoid >> level)
+      ss << "; perf_event_paranoid is " << level;
+    else if (why == ENOENT || why == EOPNOTSUPP)
+      ss << "; the CPU or virtual machine doesn't provide "
+         << (missing.size() == 1 ? "it" : "them");
+    ss << ")";
+    return ss.str();
+#else
+    return "Note: performance counters are only available on Linux";
+#endif
+  }
+
+  /**
+   * \brief format counter values for a result: per is appended to each
+   *        (e.g. "/op"), and the values are shown with the given number
+   *        of decimal places; negative values are unavailable
+   */
+  static std::string
+  countersToString(const double* value, const char* per, int places) {
+    std::stringstream ss;
+    ss << std::fixed;
+    for (size_t k = 0; k < N_COUNTERS; ++k) {
+      if (k > 0) ss << ", ";
+      ss << COUNTER_NAMES[k] << " ";
+      if (value[k] < 0) ss << "unavailable";
+      else ss << std::setprecision(places) << value[k] << per;
+      if (k == INSTRUCTIONS) {
+        ss << ", IPC ";
+        if (value[CYCLES] > 0 && value[INSTRUCTIONS] >= 0)
+          ss << std::setprecision(2) << value[INSTRUCTIONS] / value[CYCLES];
+        else ss << "unavailable";
+      }
+    }
+    return ss.str();
+  }
+
+  /** \brief format the counters in u for the end of a result line */
+  static std::string
+  countersToString(const ResourceUsage& u) {
+    double value[N_COUNTERS];
+    for (size_t k = 0; k < N_COUNTERS; ++k) value[k] = double(u.counters[k]);
+    return "[" + countersToString(value, "", 0) + "]";
+  }
+}
+
+/******************************************************************************
+ **                               BENCHMARKS                                 **
+ ******************************************************************************/
+
+namespace TinyTest {
+  std::string
+  BenchmarkStats::toString() const {
+    std::stringstream ss;
+    ss << "mean " << mean << " ns/op, median " << median
+       << " ns/op, stddev " << stddev << " ns/op, min " << min
+       << " ns/op (" << samples << " samples of " << iterations
+       << " iterations)";
+    if (counted) ss << "; " << countersToString(counters, "/op", 2);
+    return ss.str();
+  }
+
+  BenchmarkStats
+  summariseBenchmark(std::vector<double> perOp, size_t iterations) {
+    BenchmarkStats st;
+    std::sort(perOp.begin(), perOp.end());
+    st.iterations = iterations;
+    st.samples = perOp.size();
+    if (perOp.empty()) return st;
+    st.min = perOp.front();
+    size_t mid = perOp.size() / 2;
+    st.median = perOp.size() % 2 ? perOp[mid]
+                                 : (perOp[mid - 1] + perOp[mid]) / 2;
+    for (size_t i = 0; i < perOp.size(); ++i) st.mean += perOp[i];
+    st.mean /= perOp.size();
+    double ss = 0;
+    for (size_t i = 0; i < perOp.size(); ++i)
+      ss += (perOp[i] - st.mean) * (perOp[i] - st.mean);
+    st.stddev = perOp.size() > 1 ? std::sqrt(ss / (perOp.size() - 1)) : 0;
+    st.perOp = perOp;
+    return st;
+  }
+
+  /** number of samples taken of each benchmark, once calibrated */
+  static const size_t BENCHMARK_SAMPLES = 10;
+
+  /** calibration gives up growing the iteration count beyond this; a loop
+   *  the compiler has optimised away entirely would otherwise never reach
+   *  the target time */
+  static const size_t BENCHMARK_MAX_ITERATIONS = 1000000000;
+
+  /** \brief run the benchmark's loop for the given iterations; returns ns */
+  static double
+  timeBenchmark(const BenchmarkCase& b, size_t iterations) {
+    BenchmarkState bench(iterations);
+    b.runBenchmark(bench);
+    if (!bench.finished())
+      throw TinyTestException("BENCHMARK " + b.getTestName() + " did not "
+                              "loop on bench.keepRunning() until it returned "
+                              "false");
+    return bench.elapsed();
+  }
+
+  BenchmarkStats
+  measureBenchmark(const BenchmarkCase& b, double totalSeconds,
+                   bool counters) {
+    const double target = totalSeconds * 1e9 / BENCHMARK_SAMPLES;
+    size_t iters = 1;
+    for (;;) {
+      double t = timeBenchmark(b, iters);
+      if (t >= target * 0.9 || iters >= BENCHMARK_MAX_ITERATIONS) break;
+      // grow towards the target, but not by more than 10x at a time since
+      // the first few (tiny) runs are dominated by noise
+      double growth = t > 0 ? (target / t) * 1.1 : 10.0;
+      if (growth > 10.0) growth = 10.0;
+      if (growth < 2.0) growth = 2.0;
+      iters = static_cast<size_t>(iters * growth);
+      if (iters > BENCHMARK_MAX_ITERATIONS) iters = BENCHMARK_MAX_ITERATIONS;
+    }
+
+    std::vector<double> perOp(BENCHMARK_SAMPLES);
+    CounterSample before, after;
+    if (counters) readCounters(before);
+    for (size_t i = 0; i < perOp.size(); ++i)
+      perOp[i] = timeBenchmark(b, iters) / iters;
+    if (counters) readCounters(after);
+
+    BenchmarkStats st = summariseBenchmark(perOp, iters);
+    if (counters) {
+      ResourceUsage counted;
+      countersBetween(before, after, counted);
+      st.counted = true;
+      for (size_t k = 0; k < N_COUNTERS; ++k)
+        st.counters[k] = counted.counters[k] < 0 ? -1 :
+          double(counted.counters[k]) / (iters * perOp.size());
+    }
+    return st;
+  }
+}
+
+/******************************************************************************
+ **                          PERFORMANCE BASELINES                           **
+ ******************************************************************************/
+
+namespace TinyTest {
+  bool
+  loadBaseline(const std::string& filename, Baseline& base) {
+    std::ifstream in(filename.c_str());
+    if (!in) return false;
+    std::string line, name;
+    while (std::getline(in, line)) {
+      std::stringstream ss(line);
+      if (!(ss >> name) || name[0] == '#') continue;
+      std::vector<double>& times = base[name];
+      times.clear();
+      double t;
+      while (ss >> t) times.push_back(t);
+    }
+    return true;
+  }
+
+  bool
+  saveBaseline(const std::string& filename, const Baseline& base) {
+    std::ofstream out(filename.c_str());
+    out << "# TinyTest benchmark baseline: each line is a benchmark's name "
+        << "then its time per\n# iteration (ns) in each sample\n";
+    for (Baseline::const_iterator it = base.begin(); it != base.end(); ++it) {
+      out << it->first;
+      for (size_t i = 0; i < it->second.size(); ++i)
+        out << " " << it->second[i];
+      out << "\n";
+    }
+    out.close();
+    return bool(out);
+  }
+
+  bool
+  updateBaseline(const std::string& filename, const Baseline& measured) {
+    Baseline updated;
+    loadBaseline(filename, updated);
+    for (Baseline::const_iterator it = measured.begin();
+         it != measured.end(); ++it)
+      updated[it->first] = it->second;
+    return saveBaseline(filename, updated);
+  }
+
+  /** \brief the median of v */
+  static double
+  median(std::vector<double> v) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    size_t mid = v.size() / 2;
+    return v.size() % 2 ? v[mid] : (v[mid - 1] + v[mid]) / 2;
+  }
+
+  /**
+   * \brief the one-sided p-value of a Mann-Whitney U test of whether values
+   *        in a tend to be larger than those in b. Uses the normal
+   *        approximation, corrected for ties and continuity, which is
+   *        adequate for the ten or so samples taken of each benchmark.
+   */
+  static double
+  mannWhitneyGreater(const std::vector<double>& a,
+                     const std::vector<double>& b) {
+    const double na = a.size(), nb = b.size(), n = na + nb;
+    if (na == 0 || nb == 0) return 1;
+    // each value, and whether it came from a
+    std::vector<std::pair<double, bool> > all;
+    for (size_t i = 0; i < a.size(); ++i)
+      all.push_back(std::make_pair(a[i], true));
+    for (size_t i = 0; i < b.size(); ++i)
+      all.push_back(std::make_pair(b[i], false));
+    std::sort(all.begin(), all.end());
+
+    // sum the ranks of a's values, giving tied values their average rank
+    double rankSum = 0, ties = 0;
+    for (size_t i = 0, j = 0; i < all.size(); i = j) {
+      while (j < all.size() && all[j].first == all[i].first) ++j;
+      double rank = (i + 1 + j) / 2.0, t = j - i;
+      for (size_t k = i; k < j; ++k) if (all[k].second) rankSum += rank;
+      ties += t * t * t - t;
+    }
+    double u = rankSum - na * (na + 1) / 2;
+    double var = na * nb / 12 * ((n + 1) - ties / (n * (n - 1)));
+    if (var <= 0) return 1;
+    double z = (u - na * nb / 2 - 0.5) / std::sqrt(var);
+    return 0.5 * std::erfc(z / std::sqrt(2.0));
+  }
+
+  bool
+  slowerThanBaseline(const std::vector<double>& now,
+                     const std::vector<double>& base,
+                     const RunOptions& opts, std::string& comparison) {
+    double mNow = median(now), mBase = median(base);
+    double change = mBase > 0 ? mNow / mBase - 1 : 0;
+    double p = mannWhitneyGreater(now, base);
+    std::stringstream ss;
+    ss << "median " << mNow << " ns/op against baseline median " << mBase
+       << " ns/op (" << (change >= 0 ? "+" : "") << std::fixed
+       << std::setprecision(1) << change * 100 << "%, p = "
+       << std::setprecision(4) << p << ")";
+    comparison = ss.str();
+    return p < opts.alpha && change >= opts.minEffect;
+  }
+}
+
+/******************************************************************************
+ **                        RESOURCE INSTRUMENTATION                          **
+ ******************************************************************************/
+
+namespace TinyTest {
+  /** \brief a snapshot of the clock and resource counters */
+  struct UsageSample {
+    std::chrono::steady_clock::time_point when;
+    rusage ru;
+  };
+
+  /** \brief take a snapshot, for the calling thread where supported */
+  static void
+  sampleUsage(UsageSample& s) {
+#ifdef RUSAGE_THREAD
+    getrusage(RUSAGE_THREAD, &s.ru);
+#else
+    getrusage(RUSAGE_SELF, &s.ru);
+#endif
+    s.when = std::chrono::steady_clock::now();
+  }
+
+  /** \brief milliseconds in a timeval */
+  static double
+  toMs(const timeval& tv) {
+    return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+  }
+
+  /** \brief ru_maxrss in kilobytes; macOS reports it in bytes */
+  static long
+  maxRssKb(const rusage& ru) {
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;
+#else
+    return ru.ru_maxrss;
+#endif
+  }
+
+  /** \brief the resources used between two snapshots */
+  static ResourceUsage
+  usageBetween(const UsageSample& a, const UsageSample& b) {
+    ResourceUsage u;
+    u.wallMs = std::chrono::duration<double, std::milli>(b.when -
+                                                         a.when).count();
+    u.userMs = toMs(b.ru.ru_utime) - toMs(a.ru.ru_utime);
+    u.sysMs = toMs(b.ru.ru_stime) - toMs(a.ru.ru_stime);
+    u.maxRssKb = maxRssKb(b.ru);
+    u.rssGrowthKb = maxRssKb(b.ru) - maxRssKb(a.ru);
+    u.voluntarySwitches = b.ru.ru_nvcsw - a.ru.ru_nvcsw;
+    u.involuntarySwitches = b.ru.ru_nivcsw - a.ru.ru_nivcsw;
+    return u;
+  }
+
+  /** \brief do the options call for the resources used by tests to be
+   *         measured? */
+  static bool
+  measuring(const RunOptions& opts) {
+    if (opts.timing || opts.counters || !opts.saveTimingsFile.empty() ||
+        !opts.cacheFile.empty()) return true;
+    // these report the time each test took
+    for (size_t i = 0; i < opts.reporters.size(); ++i) {
+      std::string name = opts.reporters[i].substr(0,
+                                                  opts.reporters[i].find(':'));
+      if (name == "junit" || name == "json") return true;
+    }
+    return false;
+  }
+
+  /** \brief format usage for the end of a result line */
+  static std::string
+  usageToString(const ResourceUsage& u) {
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(3)
+       << "[wall " << u.wallMs << " ms, user " << u.userMs << " ms, sys "
+       << u.sysMs << " ms, max RSS " << u.maxRssKb << " kB (+"
+       << u.rssGrowthKb << " kB), context switches "
+       << u.voluntarySwitches << " voluntary/" << u.involuntarySwitches
+       << " involuntary]";
+    return ss.str();
+  }
+
+  /** \brief what's sampled as a test starts, to be set against what's
+   *         sampled once it has finished (see TestSet::startMeasuring) */
+  struct TestSample {
+    UsageSample usage;
+    CounterSample counters;
+    AllocCounts allocs;
+  };
+}
+
+/******************************************************************************
+ **                          ALLOCATION COUNTING                             **
+ ******************************************************************************/
+
+// allocations are only counted if asked for: replacing operator new and
+// delete (or malloc) for the whole program isn't something to do behind the
+// back of code that has its own. With the malloc hook, malloc counts them all
+#if defined(TINYTEST_ALLOC_HOOKS) && !defined(TINYTEST_HOOK_MALLOC)
+#define TINYTEST_NEW_HOOKS
+#endif
+
+#if defined(TINYTEST_HOOK_MALLOC) && !defined(__GLIBC__)
+#error "TINYTEST_HOOK_MALLOC is only supported with glibc"
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+// so that reaching the counters from inside malloc never calls malloc, even
+// when this is built into a shared library
+#define TINYTEST_TLS_MODEL __attribute__((tls_model("initial-exec")))
+#else
+#define TINYTEST_TLS_MODEL
+#endif
+
+namespace TinyTest {
+  /** the calling thread's counts; plain integers, so that they need no
+   *  initialisation before the first allocation */
+  static thread_local uint64_t allocCount TINYTEST_TLS_MODEL;
+  static thread_local uint64_t allocBytes TINYTEST_TLS_MODEL;
+  static thread_local uint64_t freeCount TINYTEST_TLS_MODEL;
+  /** how many UncountedAllocs are alive on the calling thread */
+  static thread_local unsigned uncountedDepth TINYTEST_TLS_MODEL;
+
+  static inline void
+  countAlloc(size_t n) {
+    if (uncountedDepth != 0) return;
+    ++allocCount;
+    allocBytes += n;
+  }
+
+  static inline void
+  countFree() {
+    if (uncountedDepth == 0) ++freeCount;
+  }
+
+  bool
+  countingAllocs() {
+#if defined(TINYTEST_NEW_HOOKS) || defined(TINYTEST_HOOK_MALLOC)
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  AllocCounts
+  threadAllocCounts() {
+    AllocCounts c;
+    c.allocs = allocCount;
+    c.bytes = allocBytes;
+    c.frees = freeCount;
+    return c;
+  }
+
+  UncountedAllocs::UncountedAllocs() {
+    ++uncountedDepth;
+  }
+
+  UncountedAllocs::~UncountedAllocs() {
+    --uncountedDepth;
+  }
+
+  /** \brief a description of the allocations the test made between before
+   *         and after and didn't free; empty if there weren't any */
+  static std::string
+  describeLeaks(const AllocCounts& before, const AllocCounts& after) {
+    uint64_t allocs = after.allocs - before.allocs;
+    uint64_t frees = after.frees - before.frees;
+    if (allocs <= frees) return "";
+    std::stringstream ss;
+    ss << "Leak check failed; the test made " << allocs
+       << " heap allocations and only " << frees << " deallocations";
+    return ss.str();
+  }
+
+  void
+  failAllocs(const char* macro, const char* expr, const AllocCounts* made,
+             uint64_t most, int line, const char* file) {
+    std::stringstream ss;
+    if (made == NULL) {
+      ss << macro << " can't check " << expr << " on line " << line << " of "
+         << file << "; allocations are only counted when TinyTest.cpp is "
+         << "compiled with -DTINYTEST_ALLOC_HOOKS or -DTINYTEST_HOOK_MALLOC";
+      throw TinyTestException(ss.str());
+    }
+    ss << macro << " failed on " << expr << " on line " << line << " of "
+       << file << "; it made " << made->allocs
+       << (made->allocs == 1 ? " allocation (" : " allocations (")
+       << made->bytes << " bytes)";
+    if (most > 0) ss << " but at most " << most << " were allowed";
+    throw TinyTestException(ss.str());
+  }
+
+#ifdef TINYTEST_NEW_HOOKS
+  /** \brief allocate n bytes, aligned to align if it's not 0, for operator
+   *         new; on failure, call the new handler and retry as the standard
+   *         requires, returning NULL in the end if nothrow is set */
+  static void*
+  countedNew(size_t n, size_t align, bool nothrow) {
+    if (n == 0) n = 1;
+    for (;;) {
+      void* p = NULL;
+      if (align == 0) p = std::malloc(n);
+      else if (::posix_memalign(&p, std::max(align, sizeof(void*)), n) != 0)
+        p = NULL;
+      if (p != NULL) {
+        countAlloc(n);
+        return p;
+      }
+      std::new_handler handler = std::get_new_handler();
+      if (handler == NULL) {
+        if (nothrow) return NULL;
+        throw std::bad_alloc();
+      }
+      if (!nothrow) {
+        handler();
+        continue;
+      }
+      try {
+        handler();
+      } catch (const std::bad_alloc&) {
+        return NULL;
+      }
+    }
+  }
+
+  /** \brief free p for operator delete */
+  static void
+  countedDelete(void* p) {
+    if (p == NULL) return;
+    countFree();
+    std::free(p);
+  }
+#endif
+}
+
+#ifdef TINYTEST_NEW_HOOKS
+void* operator new(size_t n) {
+  return TinyTest::countedNew(n, 0, false);
+}
+void* operator new[](size_t n) {
+  return TinyTest::countedNew(n, 0, false);
+}
+void* operator new(size_t n, const std::nothrow_t&) noexcept {
+  return TinyTest::countedNew(n, 0, true);
+}
+void* operator new[](size_t n, const std::nothrow_t&) noexcept {
+  return TinyTest::countedNew(n, 0, true);
+}
+void operator delete(void* p) noexcept {
+  TinyTest::countedDelete(p);
+}
+void operator delete[](void* p) noexcept {
+  TinyTest::countedDelete(p);
+}
+void operator delete(void* p, size_t) noexcept {
+  TinyTest::countedDelete(p);
+}
+void operator delete[](void* p, size_t) noexcept {
+  TinyTest::countedDelete(p);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept {
+  TinyTest::countedDelete(p);
+}
+void operator delete[](void* p, const std::nothrow_t&) noexcept {
+  TinyTest::countedDelete(p);
+}
+#ifdef __cpp_aligned_new
+void* operator new(size_t n, std::align_val_t a) {
+  return TinyTest::countedNew(n, size_t(a), false);
+}
+void* operator new[](size_t n, std::align_val_t a) {
+  return TinyTest::countedNew(n, size_t(a), false);
+}
+void* operator new(size_t n, std::align_val_t a,
+                   const std::nothrow_t&) noexcept {
+  return TinyTest::countedNew(n, size_t(a), true);
+}
+void* operator new[](size_t n, std::align_val_t a,
+                     const std::nothrow_t&) noexcept {
+  return TinyTest::countedNew(n, size_t(a), true);
+}
+void operator delete(void* p, std::align_val_t) noexcept {
+  TinyTest::countedDelete(p);
+}
+void operator delete[](void* p, std::align_val_t) noexcept {
+  TinyTest::countedDelete(p);
+}
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+  TinyTest::countedDelete(p);
+}
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+  TinyTest::countedDelete(p);
+}
+void operator delete(void* p, std::align_val_t,
+                     const std::nothrow_t&) noexcept {
+  TinyTest::countedDelete(p);
+}
+void operator delete[](void* p, std::align_val_t,
+                       const std::nothrow_t&) noexcept {
+  TinyTest::countedDelete(p);
+}
+#endif
+#endif
+
+#ifdef TINYTEST_HOOK_MALLOC
+// glibc's own implementations, which ours forward to
+extern "C" void* __libc_malloc(size_t n);
+extern "C" void* __libc_calloc(size_t n, size_t size);
+extern "C" void* __libc_realloc(void* p, size_t n);
+extern "C" void* __libc_memalign(size_t align, size_t n);
+extern "C" void __libc_free(void* p);
+
+extern "C" void*
+malloc(size_t n) noexcept {
+  void* p = __libc_malloc(n);
+  if (p != NULL) TinyTest::countAlloc(n);
+  return p;
+}
+
+extern "C" void*
+calloc(size_t n, size_t size) noexcept {
+  void* p = __libc_calloc(n, size);
+  if (p != NULL) TinyTest::countAlloc(n * size);
+  return p;
+}
+
+extern "C" void*
+realloc(void* p, size_t n) noexcept {
+  void* q = __libc_realloc(p, n);
+  if (q != NULL) TinyTest::countAlloc(n);
+  if (p != NULL && (q != NULL || n == 0)) TinyTest::countFree();
+  return q;
+}
+
+extern "C" void*
+memalign(size_t align, size_t n) noexcept {
+  void* p = __libc_memalign(align, n);
+  if (p != NULL) TinyTest::countAlloc(n);
+  return p;
+}
+
+extern "C" void*
+aligned_alloc(size_t align, size_t n) noexcept {
+  // as glibc's own: the alignment must be a power of two
+  if (align == 0 || (align & (align - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return memalign(align, n);
+}
+
+extern "C" int
+posix_memalign(void** p, size_t align, size_t n) noexcept {
+  if (align == 0 || (align & (align - 1)) != 0 || align % sizeof(void*) != 0)
+    return EINVAL;
+  // __libc_memalign sets errno, which posix_memalign mustn't change
+  const int saved = errno;
+  void* q = __libc_memalign(align, n);
+  errno = saved;
+  if (q == NULL) return ENOMEM;
+  TinyTest::countAlloc(n);
+  *p = q;
+  return 0;
+}
+
+extern "C" void
+free(void* p) noexcept {
+  if (p != NULL) TinyTest::countFree();
+  __libc_free(p);
+}
+#endif
+
+/******************************************************************************
+ **                         FILTERING AND SHARDING                           **
+ ******************************************************************************/
+
+namespace TinyTest {
+  /**
+   * \brief match s against a glob pattern, where * matches any run of
+   *        characters and ? matches any single character.
+   */
+  static bool
+  globMatch(const char* pat, const char* s) {
+    const char* starPat = NULL;
+    const char* starS = NULL;
+    while (*s != '\0') {
+      if (*pat == '*') {
+        starPat = ++pat;
+        starS = s;
+      } else if (*pat == '?' || *pat == *s) {
+        ++pat;
+        ++s;
+      } else if (starPat != NULL) {
+        pat = starPat;
+        s = ++starS;
+      } else {
+        return false;
+      }
+    }
+    while (*pat == '*') ++pat;
+    return *pat == '\0';
+  }
+
+  /** \brief does the test name pass the filters in opts? A case of a
+   *         parameterised test passes if either its own name or that of
+   *         the test it belongs to, family, does. */
+  static bool
+  passesFilters(const std::string& name, const RunOptions& opts,
+                const std::string& family = std::string()) {
+    bool anyPositive = false, matched = false;
+    for (size_t i = 0; i < opts.filters.size(); ++i) {
+      const std::string& f = opts.filters[i];
+      if (!f.empty() && f[0] == '-') {
+        if (globMatch(f.c_str() + 1, name.c_str()) ||
+            (!family.empty() && globMatch(f.c_str() + 1, family.c_str())))
+          return false;
+      } else {
+        anyPositive = true;
+        matched = matched || globMatch(f.c_str(), name.c_str()) ||
+                  (!family.empty() && globMatch(f.c_str(), family.c_str()));
+      }
+    }
+    return matched || !anyPositive;
+  }
+
+  /** \brief could any case of the parameterised test called name pass the
+   *         filters in opts? If not, its rows needn't be opened. */
+  static bool
+  rowsMayPassFilters(const std::string& name, const RunOptions& opts) {
+    if (passesFilters(name, opts)) return true;
+    for (size_t i = 0; i < opts.filters.size(); ++i) {
+      const std::string& f = opts.filters[i];
+      if (!f.empty() && f[0] == '-' && globMatch(f.c_str() + 1, name.c_str()))
+        return false;
+    }
+    for (size_t i = 0; i < opts.filters.size(); ++i)
+      if (opts.filters[i].find('/') != std::string::npos) return true;
+    return false;
+  }
+
+  /**
+   * \brief read test durations (one "name milliseconds" pair per line), as
+   *        written by --save-timings; returns false if the file couldn't be
+   *        opened.
+   */
+  static bool
+  loadTimings(const std::string& fn, std::map<std::string, double>& times) {
+    std::ifstream in(fn.c_str());
+    if (!in) return false;
+    std::string name;
+    double ms;
+    while (in >> name >> ms) times[name] = ms;
+    return true;
+  }
+
+  /**
+   * \brief assign each of n items with the given costs to one of k shards
+   *        by greedy longest-processing-time packing: take the items from
+   *        most to least expensive and give each to the least loaded shard.
+   *        Ties are broken by position, so every node computes the same
+   *        assignment.
+   */
+  static std::vector<size_t>
+  packShards(const std::vector<double>& cost, size_t k) {
+    std::vector<size_t> order(cost.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return cost[a] > cost[b];
+    });
+    std::vector<double> load(k, 0.0);
+    std::vector<size_t> shard(cost.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+      size_t best = 0;
+      for (size_t j = 1; j < k; ++j) if (load[j] < load[best]) best = j;
+      shard[order[i]] = best;
+      load[best] += cost[order[i]];
+    }
+    return shard;
+  }
+
+  /**
+   * \brief put items in a random order that depends only on seed, so the
+   *        same seed gives the same order with any compiler
+   */
+  template <typename T>
+  static void
+  shuffleWithSeed(std::vector<T>& items, uint64_t seed) {
+    // std::shuffle's algorithm is up to the library; mt19937_64's isn't
+    std::mt19937_64 rng(seed);
+    for (size_t i = items.size(); i > 1; --i)
+      std::swap(items[i - 1], items[rng() % i]);
+  }
+}
+
+/******************************************************************************
+ **                              RESULT CACHE                                **
+ ******************************************************************************/
+
+namespace TinyTest {
+  /** \brief the start of the file */
+  struct ResultCache::Header {
+    char magic[8];
+    uint32_t count;
+    uint32_t namesLength;
+  };
+
+  /** \brief one test; the name is at nameOffset in the names block */
+  struct ResultCache::Record {
+    uint32_t nameOffset;
+    uint32_t nameLength;
+    uint32_t failed;
+    uint32_t reserved;
+    double wallMs;
+  };
+
+  const char ResultCache::MAGIC[8] = {'T', 'T', 'C', 'A', 'C', 'H', 'E', '1'};
+
+  ResultCache::ResultCache(const std::string& fn) :
+    fd(-1), base(NULL), len(0) {
+    fd = open(fn.c_str(), O_RDONLY);
+    if (fd < 0) return;
+    flock(fd, LOCK_SH);
+    map();
+  }
+
+  ResultCache::ResultCache(int lockedFd) : fd(-1), base(NULL), len(0) {
+    map(lockedFd);
+  }
+
+  ResultCache::~ResultCache() {
+    if (base != NULL) munmap(const_cast<char*>(base), len);
+    if (fd >= 0) close(fd);  // releases the lock
+  }
+
+  bool
+  ResultCache::find(const std::string& name, Entry& e) const {
+    return findIn(base, count(), name, e);
+  }
+
+  double
+  ResultCache::meanWallMs() const {
+    double total = 0;
+    size_t n = 0;
+    for (size_t i = 0; i < count(); ++i) {
+      const Record& r = record(base, i);
+      if (r.wallMs >= 0) { total += r.wallMs; ++n; }
+    }
+    return n == 0 ? 0 : total / n;
+  }
+
+  /**
+   * \brief open fn, creating it if need be, and take the exclusive lock on
+   *        it. Someone else may have replaced the file while we waited for
+   *        the lock, leaving us holding the lock on a file that's gone, so
+   *        in that case try again on the new one. Returns -1 on failure.
+   */
+  static int
+  lockCurrentFile(const std::string& fn) {
+    for (;;) {
+      int fd = open(fn.c_str(), O_RDWR | O_CREAT, 0644);
+      if (fd < 0) return -1;
+      struct stat locked, current;
+      if (flock(fd, LOCK_EX) != 0 || fstat(fd, &locked) != 0) {
+        close(fd);
+        return -1;
+      }
+      if (stat(fn.c_str(), &current) == 0 && current.st_dev == locked.st_dev &&
+          current.st_ino == locked.st_ino) return fd;
+      close(fd);
+    }
+  }
+
+  bool
+  ResultCache::update(const std::string& fn,
+                      const std::function<bool(const std::string&)>&
+                        registered,
+                      const std::map<std::string, Entry>& fresh) {
+    int lockFd = lockCurrentFile(fn);
+    if (lockFd < 0) return false;
+    std::map<std::string, Entry> merged(fresh);
+    {
+      ResultCache old(lockFd);
+      for (size_t i = 0; i < old.count(); ++i) {
+        std::pair<const char*, size_t> nm = name(old.base, old.count(), i);
+        std::string n(nm.first, nm.second);
+        const Record& r = record(old.base, i);
+        std::map<std::string, Entry>::iterator it = merged.find(n);
+        if (it != merged.end()) {
+          if (it->second.wallMs < 0) it->second.wallMs = r.wallMs;
+        } else if (registered(n)) {
+          Entry& e = merged[n];
+          e.failed = r.failed != 0;
+          e.wallMs = r.wallMs;
+        }
+      }
+    }
+
+    // std::map is already sorted by name, which is the order find needs
+    std::string buf(sizeof(Header) + merged.size() * sizeof(Record), '\0');
+    Header h;
+    memcpy(h.magic, MAGIC, sizeof(h.magic));
+    h.count = merged.size();
+    size_t i = 0;
+    std::map<std::string, Entry>::const_iterator it;
+    for (it = merged.begin(); it != merged.end(); ++it, ++i) {
+      Record r;
+      r.nameOffset = buf.size() - sizeof(Header) -
+                     merged.size() * sizeof(Record);
+      r.nameLength = it->first.size();
+      r.failed = it->second.failed;
+      r.reserved = 0;
+      r.wallMs = it->second.wallMs;
+      memcpy(&buf[sizeof(Header) + i * sizeof(Record)], &r, sizeof(r));
+      buf += it->first;
+    }
+    h.namesLength = buf.size() - sizeof(Header) -
+                    merged.size() * sizeof(Record);
+    memcpy(&buf[0], &h, sizeof(h));
+
+    // the new file replaces the old one whole, so a run that dies part-way
+    // through leaves the old one, and readers never see a partial one.
+    // Only the holder of the lock writes the temporary file.
+    std::string tmp = fn + ".tmp";
+    int wfd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = wfd >= 0 && writeAll(wfd, buf.data(), buf.size());
+    if (wfd >= 0 && close(wfd) != 0) ok = false;
+    if (ok) ok = std::rename(tmp.c_str(), fn.c_str()) == 0;
+    if (!ok) std::remove(tmp.c_str());
+    close(lockFd);
+    return ok;
+  }
+
+  void
+  ResultCache::map(int from) {
+    if (from < 0) from = fd;
+    struct stat st;
+    if (fstat(from, &st) != 0 || size_t(st.st_size) < sizeof(Header))
+      return;
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, from, 0);
+    if (p == MAP_FAILED) return;
+    base = static_cast<const char*>(p);
+    len = st.st_size;
+    if (!valid()) {
+      munmap(p, len);
+      base = NULL;
+      len = 0;
+    }
+  }
+
+  bool
+  ResultCache::valid() const {
+    Header h;
+    memcpy(&h, base, sizeof(h));
+    if (memcmp(h.magic, MAGIC, sizeof(h.magic)) != 0 ||
+        len != sizeof(Header) + size_t(h.count) * sizeof(Record) +
+               h.namesLength)
+      return false;
+    for (size_t i = 0; i < h.count; ++i) {
+      const Record& r = record(base, i);
+      if (size_t(r.nameOffset) + r.nameLength > h.namesLength) return false;
+    }
+    return true;
+  }
+
+  size_t
+  ResultCache::count() const {
+    return base == NULL ? 0 : reinterpret_cast<const Header*>(base)->count;
+  }
+
+  const ResultCache::Record&
+  ResultCache::record(const char* b, size_t i) {
+    return reinterpret_cast<const Record*>(b + sizeof(Header))[i];
+  }
+
+  std::pair<const char*, size_t>
+  ResultCache::name(const char* b, size_t n, size_t i) {
+    const Record& r = record(b, i);
+    return std::make_pair(b + sizeof(Header) + n * sizeof(Record) +
+                          r.nameOffset, size_t(r.nameLength));
+  }
+
+  bool
+  ResultCache::findIn(const char* b, size_t n, const std::string& s,
+                      Entry& e) {
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      std::pair<const char*, size_t> nm = name(b, n, mid);
+      int c = memcmp(nm.first, s.data(), std::min(nm.second, s.size()));
+      if (c == 0) c = nm.second < s.size() ? -1 : nm.second > s.size();
+      if (c == 0) {
+        e.failed = record(b, mid).failed != 0;
+        e.wallMs = record(b, mid).wallMs;
+        return true;
+      }
+      if (c < 0) lo = mid + 1;
+      else hi = mid;
+    }
+    return false;
+  }
+
+  std::vector<size_t>
+  cacheOrder(const std::vector<ResultCache::Entry>& known, double meanWallMs,
+             bool failedFirst, bool longestFirst) {
+    std::vector<size_t> order(known.size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      if (failedFirst && known[a].failed != known[b].failed)
+        return known[a].failed;
+      if (!longestFirst) return false;
+      double ta = known[a].wallMs < 0 ? meanWallMs : known[a].wallMs;
+      double tb = known[b].wallMs < 0 ? meanWallMs : known[b].wallMs;
+      return ta > tb;
+    });
+    return order;
+  }
+}
+
+/******************************************************************************
+ **                          PARAMETERISED TESTS                             **
+ ******************************************************************************/
+
+namespace TinyTest {
+  /** \brief tables with more rows than this are reported in this many
+   *         contiguous groups of rows rather than row by row */
+  static const size_t MAX_ROW_CASES = 64;
+
+  /** \brief the reason for a failure, given the exception that caused it */
+  static std::string
+  describeException(std::exception_ptr failure) {
+    try {
+      std::rethrow_exception(failure);
+    } catch (const TinyTestException &e) {
+      if (std::string(e.what()).empty()) return "UNKNOWN";
+      return e.what();
+    } catch (const std::exception& ex) {
+      if (std::string(ex.what()).empty())
+        return "An unexpected exception was thrown -- no further details";
+      return std::string("An unexpected exception was thrown details: ")
+             + ex.what();
+    } catch (...) {
+      return "An unexpected exception was thrown -- no further details";
+    }
+  }
+
+  MappedFile::~MappedFile() {
+    if (base != NULL) munmap(const_cast<char*>(base), len);
+  }
+
+  void
+  MappedFile::release(size_t offset, size_t n) {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    size_t from = (offset + page - 1) / page * page;
+    size_t to = (offset + n) / page * page;
+    if (base != NULL && from < to)
+      madvise(const_cast<char*>(base) + from, to - from, MADV_DONTNEED);
+  }
+
+  bool
+  MappedFile::open(const std::string& fn, std::string& error) {
+    if (base != NULL) munmap(const_cast<char*>(base), len);
+    base = NULL;
+    len = 0;
+    int fd = ::open(fn.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+      error = "couldn't read " + fn + ": " + strerror(errno);
+      if (fd >= 0) close(fd);
+      return false;
+    }
+    if (st.st_size > 0) {
+      void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        error = "couldn't map " + fn + ": " + strerror(errno);
+        close(fd);
+        return false;
+      }
+      // the rows are read front to back, so ask for aggressive read-ahead
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      base = static_cast<const char*>(p);
+      len = st.st_size;
+    }
+    close(fd);
+    return true;
+  }
+
+  /**
+   * \brief copy the field f, less surrounding spaces, into buf (of size
+   *        n) as a C string for strtod and friends, which need one; false
+   *        if it's empty or too long to be a number.
+   */
+  static bool
+  fieldToCString(const CsvField& f, char* buf, size_t n) {
+    const char* p = f.data();
+    const char* end = p + f.size();
+    while (p < end && *p == ' ') ++p;
+    while (end > p && end[-1] == ' ') --end;
+    if (p == end || size_t(end - p) >= n) return false;
+    memcpy(buf, p, end - p);
+    buf[end - p] = '\0';
+    return true;
+  }
+
+  /** \brief the error for a field that should have been a number */
+  static TinyTestException
+  notANumber(const CsvField& f) {
+    std::stringstream ss;
+    ss << "CSV field \"" << f << "\" isn't a number";
+    return TinyTestException(ss.str());
+  }
+
+  double
+  CsvField::toDouble() const {
+    char buf[64], *end = NULL;
+    double x = 0;
+    if (fieldToCString(*this, buf, sizeof(buf))) x = std::strtod(buf, &end);
+    if (end == NULL || *end != '\0') throw notANumber(*this);
+    return x;
+  }
+
+  long long
+  CsvField::toLong() const {
+    char buf[64], *end = NULL;
+    long long x = 0;
+    if (fieldToCString(*this, buf, sizeof(buf)))
+      x = std::strtoll(buf, &end, 10);
+    if (end == NULL || *end != '\0') throw notANumber(*this);
+    return x;
+  }
+
+  bool
+  CsvRows::open(std::string& error) {
+    file.reset(new MappedFile());
+    if (!file->open(path, error)) return false;
+    const char* p = file->data();
+    const char* end = p + file->size();
+    size_t n = 0;
+    if (header) p = nextRow(p, end, n) + n;
+    rows = 0;
+    checkpoints.clear();
+    for (p = nextRow(p, end, n); n > 0; p = nextRow(p + n, end, n)) {
+      if (rows % CHECKPOINT == 0) checkpoints.push_back(p - file->data());
+      ++rows;
+    }
+    return true;
+  }
+
+  void
+  RowFailures::add(size_t index) {
+    if (failed++ == 0) first = std::current_exception();
+    if (kept.size() == KEPT) return;
+    std::stringstream ss;
+    ss << "row " << index << ": "
+       << describeException(std::current_exception());
+    kept.push_back(ss.str());
+  }
+
+  void
+  RowFailures::check(size_t n) const {
+    if (failed == 0) return;
+    if (n == 1) std::rethrow_exception(first);
+    std::stringstream ss;
+    ss << failed << " of " << n << " rows failed";
+    for (size_t i = 0; i < kept.size(); ++i)
+      ss << (i == 0 ? ": " : "; ") << kept[i];
+    if (failed > kept.size()) ss << "; and " << failed - kept.size() << " more";
+    throw TinyTestException(ss.str());
+  }
+
+  /** \brief holds the name of a RowRangeCase; it's a base class so that the
+   *         name is built before the TestCase that points to it */
+  struct OwnedName {
+    explicit OwnedName(const std::string& name) : name(name) {;}
+    std::string name;
+  };
+
+  /**
+   * \brief Rows first to last - 1 of a parameterised test, run and reported
+   *        as a test of their own, named after the test and the rows:
+   *        "test/7" or "test/100-199".
+   */
+  class RowRangeCase : private OwnedName, public TestCase {
+  public:
+    RowRangeCase(const ParamTestCaseBase* test, size_t first, size_t last) :
+      OwnedName(rangeName(test->getTestName(), first, last)),
+      TestCase(OwnedName::name.c_str()), test(test), first(first),
+      last(last) {;}
+
+    virtual void runTest() const { test->runRows(first, last); }
+    virtual double getTimeoutMs() const { return test->getTimeoutMs(); }
+    virtual const char* getResources() const { return test->getResources(); }
+
+  private:
+    static std::string
+    rangeName(const std::string& test, size_t first, size_t last) {
+      std::stringstream ss;
+      ss << test << '/' << first;
+      if (last - first > 1) ss << '-' << last - 1;
+      return ss.str();
+    }
+
+    const ParamTestCaseBase* test;
+    size_t first, last;
+  };
+}
+
+void
+ParamTestCaseBase::runRows(size_t first, size_t last) const {
+  TinyTest::RowFailures failures;
+  runRowRange(first, last, failures);
+  failures.check(last - first);
+}
+
+/******************************************************************************
+ **                               FUZZ TESTS                                 **
+ ******************************************************************************/
+
+namespace TinyTest {
+  /** \brief set by --corpus before any test runs */
+  static std::string corpusDir = "corpus";
+  /** \brief is it an error for corpusDir not to exist? */
+  static bool corpusDirMustExist = false;
+
+  void
+  setCorpusDir(const std::string& dir, bool mustExist) {
+    corpusDir = dir;
+    corpusDirMustExist = mustExist;
+  }
+
+  /** \brief the directory holding the corpus of the fuzz test target */
+  static std::string
+  corpusFor(const std::string& target) { return corpusDir + '/' + target; }
+
+  bool
+  CorpusFiles::open(std::string& error) {
+    const std::string dir = corpusFor(target);
+    files.clear();
+    DIR* d = opendir(dir.c_str());
+    // a test whose corpus hasn't been started yet just gets the empty
+    // input, but a directory of corpora named with --corpus must be there
+    struct stat top;
+    if (d == NULL && errno == ENOENT && corpusDirMustExist &&
+        stat(corpusDir.c_str(), &top) != 0) {
+      error = "couldn't read " + corpusDir + ": " + strerror(errno);
+      return false;
+    }
+    if (d == NULL && errno != ENOENT) {
+      error = "couldn't read " + dir + ": " + strerror(errno);
+      return false;
+    }
+    if (d != NULL) {
+      for (dirent* e = readdir(d); e != NULL; e = readdir(d)) {
+        if (e->d_name[0] == '.') continue;
+        std::string fn = dir + '/' + e->d_name;
+        struct stat st;
+        if (stat(fn.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+          files.push_back(fn);
+      }
+      closedir(d);
+    }
+    if (files.empty()) files.push_back("");
+    std::sort(files.begin(), files.end());
+    return true;
+  }
+
+  void
+  failFuzzInput(const char* path) {
+    std::string input = *path == '\0' ? std::string("the empty input")
+                                      : std::string(path);
+    throw TinyTestException("on " + input + ": " +
+                            describeException(std::current_exception()));
+  }
+
+#ifdef TINYTEST_FUZZER
+  /** \brief the fuzz test libFuzzer is running */
+  static const FuzzTestCase* fuzzing = NULL;
+
+  /** \brief choose the fuzz test libFuzzer is to run; false if there's
+   *         no such test */
+  static bool
+  startFuzzing(const std::string& target) {
+    fuzzing = TestSet::getTestSet().fuzzTest(target);
+    if (fuzzing == NULL) {
+      cerr << "There's no FUZZ_TEST called " << target << endl;
+      return false;
+    }
+    // libFuzzer runs copies of this program for -fork, -jobs and -merge,
+    // without our options, so they find the target here
+    setenv("TINYTEST_FUZZ_TARGET", target.c_str(), 1);
+    return true;
+  }
+#endif
+}
+
+#ifdef TINYTEST_FUZZER
+/**
+ * \brief libFuzzer's entry point: run the chosen fuzz test on one input. A
+ *        failed assertion is reported and turned into an abort, which
+ *        libFuzzer treats as a crash and saves the input for.
+ */
+extern "C" int
+LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  try {
+    TinyTest::fuzzing->fuzz(data, size);
+  } catch (...) {
+    cerr << TinyTest::fuzzing->getTestName() << " failed: "
+         << TinyTest::describeException(std::current_exception()) << endl;
+    std::abort();
+  }
+  return 0;
+}
+#endif
+
+/******************************************************************************
+ **                              GOLDEN FILES                                **
+ ******************************************************************************/
+
+namespace TinyTest {
+  /** \brief set by --update-golden before any test runs */
+  static bool updateGolden = false;
+
+  void
+  setUpdateGolden(bool update) { updateGolden = update; }
+
+  bool
+  updatingGolden() { return updateGolden; }
+
+  /** \brief s (a line from a golden file or output) quoted for a failure
+   *         message, with unprintable characters escaped and long lines cut
+   *         down to the part around column col */
+  static std::string
+  quoteLine(const char* s, size_t n, size_t col) {
+    const size_t WIDTH = 100;
+    size_t from = 0;
+    if (n > WIDTH && col > WIDTH / 2) from = std::min(col - WIDTH / 2,
+                                                      n - WIDTH);
+    size_t to = std::min(n, from + WIDTH);
+    std::stringstream ss;
+    ss << '"' << (from > 0 ? "..." : "");
+    for (size_t i = from; i < to; ++i) {
+      unsigned char c = s[i];
+      if (c == '"' || c == '\\') ss << '\\' << c;
+      else if (c == '\t') ss << "\\t";
+      else if (c == '\r') ss << "\\r";
+      else if (c < 0x20 || c == 0x7f)
+        ss << "\\x" << std::hex << std::setw(2) << std::setfill('0')
+           << int(c) << std::dec;
+      else ss << c;
+    }
+    ss << (to < n ? "..." : "") << '"';
+    return ss.str();
+  }
+
+  /**
+   * \brief Compares output, fed to it a chunk at a time, with a golden file,
+   *        keeping track of the line it's on so the first difference can be
+   *        reported with its context. The golden file is mapped, and the
+   *        pages already compared are released as it goes, so neither side
+   *        is ever held in memory whole.
+   */
+  class GoldenComparison {
+  public:
+    explicit GoldenComparison(const std::string& goldenPath) :
+      path(goldenPath), pos(0), line(0), lineStart(0), prevLineStart(0),
+      released(0), differs(false) {
+      golden.open(path, openError);
+    }
+
+    /** \brief why the golden file couldn't be read; empty if it could */
+    const std::string& error() const { return openError; }
+
+    /** \brief compare the next n bytes of output */
+    void feed(const char* p, size_t n) {
+      if (differs) {
+        keepTail(p, n);
+        return;
+      }
+      const size_t have = std::min(n, golden.size() - pos);
+      size_t same = have;
+      if (have > 0 && memcmp(p, golden.data() + pos, have) != 0) {
+        same = 0;
+        while (p[same] == golden.data()[pos + same]) ++same;
+      }
+      countLines(p, same);
+      pos += same;
+      if (same < n) {
+        differs = true;
+        keepTail(p + same, n - same);
+      }
+      // keep the current and previous lines for the report
+      if (prevLineStart - released >= RELEASE_CHUNK) {
+        golden.release(released, prevLineStart - released);
+        released = prevLineStart;
+      }
+    }
+
+    /** \brief the first difference between the output so far and the
+     *         golden file, or an empty string if they're the same */
+    std::string finish() const {
+      if (!differs && pos == golden.size()) return "";
+      const char* g = golden.data();
+      const char* eol = static_cast<const char*>(
+        memchr(g + pos, '\n', golden.size() - pos));
+      size_t goldenLineEnd = eol == NULL ? golden.size() : eol - g;
+      const size_t col = pos - lineStart;
+      // only the end of a very long line can be quoted, so don't copy it all
+      const size_t skip = col > 1000 ? col - 1000 : 0;
+      std::string actualLine(g + lineStart + skip, col - skip);
+      actualLine += tail.substr(0, tail.find('\n'));
+
+      std::stringstream ss;
+      ss << "first difference at line " << line + 1 << ", column "
+         << col + 1 << " (byte offset " << pos << ")";
+      if (pos == golden.size())
+        ss << ", where " << path << " ends but the output goes on: "
+           << quoteLine(actualLine.data(), actualLine.size(), col - skip);
+      else if (!differs)
+        ss << ", where the output ends but " << path << " goes on: "
+           << quoteLine(g + lineStart, goldenLineEnd - lineStart, col);
+      else
+        ss << "; expected "
+           << quoteLine(g + lineStart, goldenLineEnd - lineStart, col)
+           << " but got "
+           << quoteLine(actualLine.data(), actualLine.size(), col - skip);
+      if (line > 0)
+        ss << "; the line before was "
+           << quoteLine(g + prevLineStart, lineStart - 1 - prevLineStart, 0);
+      return ss.str();
+    }
+
+  private:
+    /** \brief how much of the golden file to let go of at once */
+    static const size_t RELEASE_CHUNK = 1 << 24;
+    /** \brief how much output to keep after the first difference */
+    static const size_t TAIL = 256;
+
+    /** \brief note the line breaks in the n bytes of output at p, which
+     *         match the golden file at pos */
+    void countLines(const char* p, size_t n) {
+      const char* end = p + n;
+      for (const char* nl = static_cast<const char*>(memchr(p, '\n', n));
+           nl != NULL;
+           nl = static_cast<const char*>(memchr(nl + 1, '\n', end - nl - 1))) {
+        ++line;
+        prevLineStart = lineStart;
+        lineStart = pos + (nl - p) + 1;
+      }
+    }
+
+    /** \brief keep the start of the output after the first difference */
+    void keepTail(const char* p, size_t n) {
+      if (tail.size() < TAIL)
+        tail.append(p, std::min(n, TAIL - tail.size()));
+    }
+
+    std::string path;
+    MappedFile golden;
+    std::string openError;
+    /** how much output has matched */
+    size_t pos;
+    /** the number of line breaks before pos, and where the line pos is on,
+     *  and the line before it, start */
+    size_t line, lineStart, prevLineStart;
+    /** how much of the golden file has been released */
+    size_t released;
+    /** true once the output has gone past the golden file or differed */
+    bool differs;
+    /** the output after the first difference, up to TAIL bytes */
+    std::string tail;
+  };
+
+  /** \brief A stream buffer that passes what's written to it on to a
+   *         GoldenComparison a buffer at a time */
+  class GoldenBuf : public std::streambuf {
+  public:
+    explicit GoldenBuf(GoldenComparison& cmp) :
+      cmp(cmp), buf(1 << 16) {
+      setp(&buf[0], &buf[0] + buf.size());
+    }
+
+  protected:
+    virtual int_type overflow(int_type c) {
+      sync();
+      if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+      }
+      return traits_type::not_eof(c);
+    }
+
+    virtual int sync() {
+      cmp.feed(pbase(), pptr() - pbase());
+      setp(&buf[0], &buf[0] + buf.size());
+      return 0;
+    }
+
+  private:
+    GoldenComparison& cmp;
+    std::vector<char> buf;
+  };
+
+  /** \brief the start of the failure message for macro on line of file */
+  static std::string
+  goldenFailure(const std::string& macro, int line, const char* file) {
+    std::stringstream ss;
+    ss << macro << " on line " << line << " of " << file << "; ";
+    return ss.str();
+  }
+
+  /** \brief replace the file path, once write has written its new contents
+   *         to the stream it's given; false if it couldn't be */
+  static bool
+  replaceFile(const std::string& path,
+              const std::function<void(std::ostream&)>& write) {
+    // the new contents go alongside and are renamed into place, so a run
+    // that fails part-way through doesn't leave a truncated golden file.
+    // Tests run in parallel may be rewriting the same one, so each write
+    // has a name of its own.
+    static std::atomic<unsigned> writes(0);
+    std::stringstream tmpName;
+    tmpName << path << ".tmp." << getpid() << '.' << writes++;
+    std::string tmp = tmpName.str();
+    std::ofstream out(tmp.c_str(), std::ios::binary);
+    write(out);
+    out.close();
+    if (!out || std::rename(tmp.c_str(), path.c_str()) != 0) {
+      std::remove(tmp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  void
+  expectFileEqual(const std::string& actual, const std::string& golden,
+                  int line, const char* file) {
+    const std::string macro = "EXPECT_FILE_EQUAL failed on comparison of " +
+                              actual + " and " + golden;
+    if (updateGolden) {
+      std::ifstream in(actual.c_str(), std::ios::binary);
+      if (in && replaceFile(golden, [&](std::ostream& out) {
+            if (in.peek() != EOF) out << in.rdbuf();
+          })) return;
+      throw TinyTestException(goldenFailure(macro, line, file) +
+                              "couldn't copy it over the golden file");
+    }
+    GoldenComparison cmp(golden);
+    MappedFile a;
+    std::string error = cmp.error();
+    if (error.empty()) a.open(actual, error);
+    if (!error.empty())
+      throw TinyTestException(goldenFailure(macro, line, file) + error);
+    const size_t CHUNK = 1 << 20;
+    for (size_t done = 0; done < a.size(); done += CHUNK) {
+      size_t n = std::min(CHUNK, a.size() - done);
+      cmp.feed(a.data() + done, n);
+      a.release(done, n);
+    }
+    std::string diff = cmp.finish();
+    if (!diff.empty())
+      throw TinyTestException(goldenFailure(macro, line, file) + diff);
+  }
+
+  void
+  expectOutputMatchesFile(const std::function<void(std::ostream&)>& write,
+                          const char* expr, const std::string& golden,
+                          int line, const char* file) {
+    const std::string macro = std::string("EXPECT_OUTPUT_MATCHES_FILE failed "
+                                          "on comparison of the output of ") +
+                              expr + " and " + golden;
+    if (updateGolden) {
+      if (replaceFile(golden, write)) return;
+      throw TinyTestException(goldenFailure(macro, line, file) +
+                              "couldn't write the golden file");
+    }
+    GoldenComparison cmp(golden);
+    if (!cmp.error().empty())
+      throw TinyTestException(goldenFailure(macro, line, file) + cmp.error());
+    GoldenBuf buf(cmp);
+    std::ostream out(&buf);
+    write(out);
+    out.flush();
+    std::string diff = cmp.finish();
+    if (!diff.empty())
+      throw TinyTestException(goldenFailure(macro, line, file) + diff);
+  }
+}
+
+/******************************************************************************
+ **                                REPORTERS                                 **
+ ******************************************************************************/
+
+namespace TinyTest {
+  /** \brief the reporters that can be named in RunOptions::reporters */
+  static const char* const REPORTER_NAMES[] = {"console", "tap", "junit",
+                                               "json"};
+
+  /** \brief the NAME part of a "NAME" or "NAME:FILE" reporter spec */
+  static std::string
+  reporterName(const std::string& spec) {
+    return spec.substr(0, spec.find(':'));
+  }
+
+  /** \brief is name one of REPORTER_NAMES? */
+  static bool
+  knownReporter(const std::string& name) {
+    for (size_t i = 0; i < sizeof(REPORTER_NAMES) / sizeof(*REPORTER_NAMES);
+         ++i)
+      if (name == REPORTER_NAMES[i]) return true;
+    return false;
+  }
+
+  /** \brief format v with the given number of decimal places */
+  static std::string
+  fixedPoint(double v, int places) {
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(places) << v;
+    return ss.str();
+  }
+
+  /** \brief the length of the valid UTF-8 sequence starting at s[i]; 0 if
+   *         there isn't one there (a stray or missing continuation byte, an
+   *         overlong form, a surrogate or a code point past U+10FFFF) */
+  static size_t
+  utf8Length(const std::string& s, size_t i) {
+    const unsigned char c = s[i];
+    if (c < 0x80) return 1;
+    size_t n;
+    uint32_t cp;
+    if (c >= 0xc2 && c <= 0xdf) { n = 2; cp = c & 0x1f; }
+    else if (c >= 0xe0 && c <= 0xef) { n = 3; cp = c & 0x0f; }
+    else if (c >= 0xf0 && c <= 0xf4) { n = 4; cp = c & 0x07; }
+    else return 0;
+    if (i + n > s.size()) return 0;
+    for (size_t k = 1; k < n; ++k) {
+      const unsigned char d = s[i + k];
+      if ((d & 0xc0) != 0x80) return 0;
+      cp = cp << 6 | (d & 0x3f);
+    }
+    if ((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) ||
+        (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff) return 0;
+    return n;
+  }
+
+  /** \brief s with each byte that isn't part of valid UTF-8 replaced by
+   *         U+FFFD, as the XML and JSON reporters must write UTF-8 */
+  static std::string
+  validUtf8(const std::string& s) {
+    std::string r;
+    for (size_t i = 0; i < s.size(); ) {
+      const size_t n = utf8Length(s, i);
+      if (n == 0) {
+        r += "\xef\xbf\xbd";
+        ++i;
+      } else {
+        r.append(s, i, n);
+        i += n;
+      }
+    }
+    return r;
+  }
+
+  /** \brief s, escaped for use in XML text or a quoted attribute; line
+   *         breaks and tabs are written as character references, as a
+   *         parser turns them into spaces in an attribute otherwise */
+  static std::string
+  xmlEscape(const std::string& text) {
+    const std::string s = validUtf8(text);
+    std::string r;
+    for (size_t i = 0; i < s.size(); ++i) {
+      switch (s[i]) {
+        case '&':  r += "&amp;"; break;
+        case '<':  r += "&lt;"; break;
+        case '>':  r += "&gt;"; break;
+        case '"':  r += "&quot;"; break;
+        case '\'': r += "&apos;"; break;
+        case '\n': r += "&#10;"; break;
+        case '\r': r += "&#13;"; break;
+        case '\t': r += "&#9;"; break;
+        default:
+          // XML 1.0 can't represent the other control characters at all
+          r += static_cast<unsigned char>(s[i]) < 0x20 ? '?' : s[i];
+      }
+    }
+    return r;
+  }
+
+  /** \brief s as a quoted JSON string, with invalid UTF-8 replaced */
+  static std::string
+  jsonString(const std::string& text) {
+    const std::string s = validUtf8(text);
+    std::string r("\"");
+    for (size_t i = 0; i < s.size(); ++i) {
+      unsigned char c = s[i];
+      if (c == '"' || c == '\\') {
+        r += '\\';
+        r += c;
+      } else if (c == '\n') {
+        r += "\\n";
+      } else if (c == '\t') {
+        r += "\\t";
+      } else if (c < 0x20) {
+        char buf[8];
+        std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+        r += buf;
+      } else {
+        r += c;
+      }
+    }
+    return r + "\"";
+  }
+
+  /** \brief the names the counters are given in JSON and XML */
+  static const char* const COUNTER_KEYS[N_COUNTERS] = {
+    "cycles", "instructions", "cacheMisses", "branchMisses", "pageFaults"
+  };
+
+  /** \brief the counters in u as a JSON object; null for those that
+   *         couldn't be counted */
+  static std::string
+  countersToJson(const ResourceUsage& u) {
+    std::stringstream ss;
+    ss << "{";
+    for (size_t k = 0; k < N_COUNTERS; ++k) {
+      ss << (k == 0 ? "" : ", ") << "\"" << COUNTER_KEYS[k] << "\": ";
+      if (u.counters[k] < 0) ss << "null";
+      else ss << u.counters[k];
+    }
+    ss << "}";
+    return ss.str();
+  }
+
+  /**
+   * \brief The default reporter: a "name ... [PASSED]" line for each test,
+   *        in the format TinyTest has always used, with the resources used
+   *        and a list of the slowest tests if asked for.
+   */
+  class ConsoleReporter : public Reporter {
+  public:
+    /** \brief report usage on each line if withUsage; list the slowest
+     *         tests (none if it's 0) after the tests */
+    ConsoleReporter(bool withUsage, size_t slowest) :
+      withUsage(withUsage), slowest(slowest), maxPad(0),
+      slowestShown(false) {;}
+
+    virtual void runStarted(const std::vector<std::string>& names,
+                            std::string& out) {
+      for (size_t i = 0; i < names.size(); ++i)
+        maxPad = std::max(maxPad, names[i].size());
+      out += "RUNNING UNIT TESTS\n";
+    }
+
+    virtual void testStarted(const TestEvent& test, std::string& out) {
+      // the benchmarks come after all of the tests
+      if (test.benchmark) showSlowest(out);
+      out += test.name + " ... " + std::string(maxPad - test.name.size(), ' ');
+    }
+
+    virtual void testFinished(const TestEvent& test, std::string& out) {
+      if (test.passed && test.benchmark)
+        out += "[BENCHMARK] " + test.benchmarkStats;
+      else if (test.passed) out += "[PASSED]";
+      else out += "[FAILED] [Reason: " + test.reason + "]";
+      if (withUsage && test.measured) out += " " + usageToString(test.usage);
+      if (test.measured && test.usage.counted)
+        out += " " + countersToString(test.usage);
+      out += '\n';
+      if (test.measured)
+        times.push_back(std::make_pair(test.name, test.usage.wallMs));
+    }
+
+    virtual void runFinished(const RunSummary& summary, std::string& out) {
+      showSlowest(out);
+      if (summary.notRun > 0) {
+        std::stringstream ss;
+        ss << "RUN ABANDONED: " << summary.notRun << " TESTS NOT RUN\n";
+        out += ss.str();
+      }
+    }
+
+  private:
+    /** \brief list the slowest tests, if we haven't already */
+    void showSlowest(std::string& out) {
+      if (slowestShown) return;
+      slowestShown = true;
+      std::vector<size_t> order(times.size());
+      for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+      size_t n = std::min(slowest, order.size());
+      if (n == 0) return;
+      std::partial_sort(order.begin(), order.begin() + n, order.end(),
+                        [&](size_t a, size_t b) {
+                          return times[a].second > times[b].second;
+                        });
+      size_t pad = 0;
+      for (size_t i = 0; i < n; ++i)
+        pad = std::max(pad, times[order[i]].first.size());
+      std::stringstream ss;
+      ss << "SLOWEST " << n << " TESTS\n";
+      for (size_t i = 0; i < n; ++i) {
+        const std::string& name = times[order[i]].first;
+        ss << "  " << name << std::string(pad - name.size(), ' ') << "  "
+           << fixedPoint(times[order[i]].second, 3) << " ms\n";
+      }
+      out += ss.str();
+    }
+
+    bool withUsage;
+    size_t slowest, maxPad;
+    bool slowestShown;
+    /** the name and wall time of each measured test so far */
+    std::vector<std::pair<std::string, double> > times;
+  };
+
+  /** \brief Reports in the Test Anything Protocol (version 13) */
+  class TapReporter : public Reporter {
+  public:
+    virtual void runStarted(const std::vector<std::string>& names,
+                            std::string& out) {
+      std::stringstream ss;
+      ss << "TAP version 13\n1.." << names.size() << "\n";
+      out += ss.str();
+    }
+
+    virtual void assertionFailed(const TestEvent& test,
+                                 const std::string& message,
+                                 std::string& out) {
+      messages.push_back(message);
+    }
+
+    virtual void testFinished(const TestEvent& test, std::string& out) {
+      std::stringstream ss;
+      ss << (test.passed ? "ok " : "not ok ") << test.index + 1 << " - "
+         << test.name << "\n";
+      const bool counted = test.measured && test.usage.counted;
+      if (!messages.empty() || counted) {
+        ss << "  ---\n";
+        for (size_t i = 0; i < messages.size(); ++i)
+          ss << "  message: " << jsonString(messages[i]) << "\n";
+        if (counted) ss << "  counters: " << countersToJson(test.usage) << "\n";
+        ss << "  ...\n";
+      }
+      if (test.passed && test.benchmark)
+        ss << "# " << test.benchmarkStats << "\n";
+      messages.clear();
+      out += ss.str();
+    }
+
+    virtual void runFinished(const RunSummary& summary, std::string& out) {
+      if (summary.notRun == 0) return;
+      std::stringstream ss;
+      ss << "Bail out! " << summary.notRun << " tests not run\n";
+      out += ss.str();
+    }
+
+  private:
+    /** the failure messages for the test being reported */
+    std::vector<std::string> messages;
+  };
+
+  /**
+   * \brief Reports in the JUnit XML format understood by most CI systems.
+   *        The counts go at the top of the document, so nothing is written
+   *        until the run has finished.
+   */
+  class JUnitReporter : public Reporter {
+  public:
+    virtual void assertionFailed(const TestEvent& test,
+                                 const std::string& message,
+                                 std::string& out) {
+      failures += "      <failure message=\"" + xmlEscape(message) + "\"/>\n";
+    }
+
+    virtual void testFinished(const TestEvent& test, std::string& out) {
+      cases += "    <testcase name=\"" + xmlEscape(test.name) +
+               "\" classname=\"TinyTest\" time=\"" +
+               fixedPoint(test.measured ? test.usage.wallMs / 1000 : 0, 6) +
+               "\"";
+      std::string body = failures;
+      if (test.measured && test.usage.counted) {
+        body += "      <properties>\n";
+        for (size_t k = 0; k < N_COUNTERS; ++k) {
+          if (test.usage.counters[k] < 0) continue;
+          std::stringstream value;
+          value << test.usage.counters[k];
+          body += "        <property name=\"" + std::string(COUNTER_KEYS[k]) +
+                  "\" value=\"" + value.str() + "\"/>\n";
+        }
+        body += "      </properties>\n";
+      }
+      if (test.passed && test.benchmark)
+        body += "      <system-out>" + xmlEscape(test.benchmarkStats) +
+                "</system-out>\n";
+      cases += body.empty() ? "/>\n" : ">\n" + body + "    </testcase>\n";
+      failures.clear();
+    }
+
+    virtual void runFinished(const RunSummary& summary, std::string& out) {
+      std::stringstream counts;
+      counts << "tests=\"" << summary.tests << "\" failures=\""
+             << summary.failures << "\" skipped=\"" << summary.notRun
+             << "\" time=\""
+             << fixedPoint(summary.wallMs / 1000, 6) << "\"";
+      out += "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+             "<testsuites " + counts.str() + ">\n"
+             "  <testsuite name=\"TinyTest\" errors=\"0\" " + counts.str() +
+             ">\n" + cases + "  </testsuite>\n</testsuites>\n";
+    }
+
+  private:
+    /** the <testcase> elements so far */
+    std::string cases;
+    /** the <failure> elements for the test being reported */
+    std::string failures;
+  };
+
+  /**
+   * \brief Reports as a single JSON document: an array of tests, written
+   *        out as they finish, followed by a summary of the run.
+   */
+  class JsonReporter : public Reporter {
+  public:
+    JsonReporter() : first(true) {;}
+
+    virtual void runStarted(const std::vector<std::string>& names,
+                            std::string& out) {
+      out += "{\"tests\": [";
+    }
+
+    virtual void testFinished(const TestEvent& test, std::string& out) {
+      std::stringstream ss;
+      ss << (first ? "\n" : ",\n") << "  {\"name\": " << jsonString(test.name)
+         << ", \"benchmark\": " << (test.benchmark ? "true" : "false")
+         << ", \"passed\": " << (test.passed ? "true" : "false");
+      if (!test.passed) ss << ", \"reason\": " << jsonString(test.reason);
+      if (test.passed && test.benchmark)
+        ss << ", \"stats\": " << jsonString(test.benchmarkStats);
+      if (test.measured) {
+        const ResourceUsage& u = test.usage;
+        ss << ", \"usage\": {\"wallMs\": " << fixedPoint(u.wallMs, 3)
+           << ", \"userMs\": " << fixedPoint(u.userMs, 3)
+           << ", \"sysMs\": " << fixedPoint(u.sysMs, 3)
+           << ", \"maxRssKb\": " << u.maxRssKb
+           << ", \"rssGrowthKb\": " << u.rssGrowthKb
+           << ", \"voluntarySwitches\": " << u.voluntarySwitches
+           << ", \"involuntarySwitches\": " << u.involuntarySwitches;
+        if (u.counted) ss << ", \"counters\": " << countersToJson(u);
+        ss << "}";
+      }
+      ss << "}";
+      first = false;
+      out += ss.str();
+    }
+
+    virtual void runFinished(const RunSummary& summary, std::string& out) {
+      std::stringstream ss;
+      ss << "\n], \"summary\": {\"tests\": " << summary.tests
+         << ", \"failures\": " << summary.failures
+         << ", \"notRun\": " << summary.notRun
+         << ", \"wallMs\": " << fixedPoint(summary.wallMs, 3) << "}}\n";
+      out += ss.str();
+    }
+
+  private:
+    /** true until the first test has been written */
+    bool first;
+  };
+
+  /** \brief a new reporter of the named kind, configured by opts */
+  static Reporter*
+  makeReporter(const std::string& name, const RunOptions& opts) {
+    if (name == "console")
+      return new ConsoleReporter(opts.timing, opts.timing ? opts.slowest : 0);
+    if (name == "tap") return new TapReporter();
+    if (name == "junit") return new JUnitReporter();
+    if (name == "json") return new JsonReporter();
+    return NULL;
+  }
+
+  /**
+   * \brief Passes the events of a run to the reporters on a background
+   *        writer thread. The threads running the tests only queue events.
+   *        Each time the writer wakes, it takes everything queued so far,
+   *        has every reporter format it, then writes each reporter's output
+   *        with a single write. So when results arrive faster than they can
+   *        be written (stdout is a slow pipe, say) they go out in large
+   *        blocks, and when they don't, each appears as soon as it's known.
+   */
+  class ReportPipeline {
+  public:
+    /** \brief set up the reporters asked for in opts and start the writer */
+    explicit ReportPipeline(const RunOptions& opts) :
+      goldenFile(opts.goldenFile), goldenFd(-1), matched(true), expected(0),
+      reported(0), failed(0), stopping(false), writing(false) {
+      std::vector<std::string> specs(opts.reporters);
+      if (specs.empty()) specs.push_back("console");
+      for (size_t i = 0; i < specs.size(); ++i) {
+        Sink sink;
+        size_t colon = specs[i].find(':');
+        if (colon != std::string::npos) {
+          std::string path = specs[i].substr(colon + 1);
+          sink.fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+          if (sink.fd < 0) {
+            cerr << "Warning: couldn't open " << path << " for the "
+                 << reporterName(specs[i]) << " reporter" << endl;
+            continue;
+          }
+        }
+        sink.reporter.reset(makeReporter(reporterName(specs[i]), opts));
+        sinks.push_back(std::move(sink));
+      }
+      // with --golden, stdout is checked against (or, when updating, is
+      // written to) the golden file instead
+      if (!goldenFile.empty() && opts.updateGolden) {
+        goldenFd = ::open((goldenFile + ".tmp").c_str(),
+                          O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (goldenFd < 0) matched = false;
+      } else if (!goldenFile.empty()) {
+        golden.reset(new GoldenComparison(goldenFile));
+      }
+      // anything already in cout's buffer belongs before our output
+      cout.flush();
+      writer = std::thread(&ReportPipeline::writerLoop, this);
+    }
+
+    ~ReportPipeline() { finish(); }
+
+    void runStarted(const std::vector<std::string>& names) {
+      Event e(RUN_STARTED);
+      e.names = names;
+      started = std::chrono::steady_clock::now();
+      expected = names.size();
+      post(e);
+    }
+
+    void testStarted(const TestEvent& test) {
+      Event e(TEST_STARTED);
+      e.test = test;
+      post(e);
+    }
+
+    /** \brief report that test has finished (and why it failed, if it did) */
+    void testFinished(const TestEvent& test) {
+      Event e(ASSERTION_FAILED);
+      e.test = test;
+      if (!test.passed) post(e);
+      e.kind = TEST_FINISHED;
+      post(e);
+    }
+
+    /**
+     * \brief finish the report of a run that has to be cut short, writing
+     *        out everything queued so far; the summary covers the tests
+     *        reported so far and counts the rest as not run. The caller must
+     *        make sure nothing else is reported meanwhile.
+     */
+    void abandonRun() {
+      Event e(RUN_FINISHED);
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        e.summary.tests = reported;
+        e.summary.failures = failed;
+        e.summary.notRun = expected - reported;
+      }
+      e.summary.wallMs = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - started).count();
+      post(e);
+      finish();
+    }
+
+    void runFinished(const RunSummary& summary) {
+      Event e(RUN_FINISHED);
+      e.summary = summary;
+      post(e);
+    }
+
+    /**
+     * \brief wait until everything posted so far has been written out and
+     *        the writer is waiting for more, holding no locks. Until
+     *        something else is posted, it's safe to fork, and the output is
+     *        out if the process then dies.
+     */
+    void flush() {
+      std::unique_lock<std::mutex> guard(lock);
+      idle.wait(guard, [this]() { return queue.empty() && !writing; });
+    }
+
+    /** \brief write out everything queued so far and stop the writer */
+    void finish() {
+      if (!writer.joinable()) return;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+      }
+      wake.notify_one();
+      writer.join();
+      for (size_t i = 0; i < sinks.size(); ++i)
+        if (sinks[i].fd != STDOUT_FILENO) ::close(sinks[i].fd);
+      if (golden) {
+        std::string diff = golden->error().empty() ? golden->finish()
+                                                   : golden->error();
+        if (!diff.empty()) {
+          cerr << "The output doesn't match " << goldenFile << ": " << diff
+               << endl;
+          matched = false;
+        }
+      } else if (!goldenFile.empty()) {
+        std::string tmp = goldenFile + ".tmp";
+        if (goldenFd < 0 || ::close(goldenFd) != 0 ||
+            std::rename(tmp.c_str(), goldenFile.c_str()) != 0) {
+          cerr << "Couldn't write the output to " << goldenFile << endl;
+          matched = false;
+        }
+      }
+    }
+
+    /** \brief did the output match the golden file (or, when updating it,
+     *         get written to it)? Only meaningful after finish(). */
+    bool outputMatched() const { return matched; }
+
+  private:
+    enum Kind {RUN_STARTED, TEST_STARTED, ASSERTION_FAILED, TEST_FINISHED,
+               RUN_FINISHED};
+
+    /** \brief one call to make on every reporter */
+    struct Event {
+      explicit Event(Kind kind) : kind(kind) {;}
+      Kind kind;
+      std::vector<std::string> names;
+      TestEvent test;
+      RunSummary summary;
+    };
+
+    /** \brief a reporter, where its output goes and what it has produced
+     *         since its output was last written */
+    struct Sink {
+      Sink() : fd(STDOUT_FILENO) {;}
+      std::unique_ptr<Reporter> reporter;
+      int fd;
+      std::string buffer;
+    };
+
+    /** \brief queue an event for the writer */
+    void post(const Event& e) {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.push_back(e);
+        if (e.kind == TEST_FINISHED) {
+          ++reported;
+          if (!e.test.passed) ++failed;
+        }
+      }
+      wake.notify_one();
+    }
+
+    /** \brief have the reporter in sink format e */
+    static void dispatch(const Event& e, Sink& sink) {
+      Reporter& r = *sink.reporter;
+      switch (e.kind) {
+        case RUN_STARTED:      r.runStarted(e.names, sink.buffer); break;
+        case TEST_STARTED:     r.testStarted(e.test, sink.buffer); break;
+        case ASSERTION_FAILED:
+          r.assertionFailed(e.test, e.test.reason, sink.buffer);
+          break;
+        case TEST_FINISHED:    r.testFinished(e.test, sink.buffer); break;
+        case RUN_FINISHED:     r.runFinished(e.summary, sink.buffer); break;
+      }
+    }
+
+    /** \brief write out what the reporter in sink has produced */
+    void emit(const Sink& sink) {
+      const std::string& out = sink.buffer;
+      if (sink.fd != STDOUT_FILENO || goldenFile.empty())
+        writeAll(sink.fd, out.data(), out.size());
+      else if (golden)
+        golden->feed(out.data(), out.size());
+      else if (goldenFd >= 0)
+        writeAll(goldenFd, out.data(), out.size());
+    }
+
+    /** \brief the body of the writer thread */
+    void writerLoop() {
+      std::vector<Event> batch;
+      std::unique_lock<std::mutex> guard(lock);
+      for (;;) {
+        writing = false;
+        idle.notify_all();
+        wake.wait(guard, [this]() { return stopping || !queue.empty(); });
+        if (queue.empty()) return;
+        batch.swap(queue);
+        writing = true;
+        guard.unlock();
+        for (size_t i = 0; i < batch.size(); ++i)
+          for (size_t j = 0; j < sinks.size(); ++j)
+            dispatch(batch[i], sinks[j]);
+        batch.clear();
+        for (size_t j = 0; j < sinks.size(); ++j) {
+          emit(sinks[j]);
+          sinks[j].buffer.clear();
+        }
+        guard.lock();
+      }
+    }
+
+    std::vector<Sink> sinks;
+    /** the file given with --golden, what's checking stdout against it (or
+     *  where it's being rewritten), and whether stdout has matched it */
+    std::string goldenFile;
+    std::unique_ptr<GoldenComparison> golden;
+    int goldenFd;
+    bool matched;
+    /** when the run started, how many tests are in it, and how many have
+     *  been reported, and failed, so far */
+    std::chrono::steady_clock::time_point started;
+    size_t expected, reported, failed;
+    std::mutex lock;
+    /** signalled when events are posted, and when the writer goes idle */
+    std::condition_variable wake, idle;
+    /** events posted but not yet taken by the writer */
+    std::vector<Event> queue;
+    /** set once no more events will be posted */
+    bool stopping;
+    /** is the writer formatting or writing a batch? */
+    bool writing;
+    std::thread writer;
+  };
+}
+
+/******************************************************************************
+ **                          TestSet implementation                          **
+ ******************************************************************************/
+
+void
+TestSet::runTestCase(const TestCase* t, TestResult& res,
+                     const TinyTest::RunOptions& opts) {
+  TinyTest::TestSample sample;
+  startMeasuring(opts, sample);
+  runGuarded([&]() { t->runTest(); }, res);
+  finishMeasuring(t, opts, sample, res);
+}
+
+void
+TestSet::startMeasuring(const TinyTest::RunOptions& opts,
+                        TinyTest::TestSample& sample) {
+  if (TinyTest::measuring(opts)) TinyTest::sampleUsage(sample.usage);
+  if (opts.counters) TinyTest::readCounters(sample.counters);
+  sample.allocs = TinyTest::threadAllocCounts();
+}
+
+void
+TestSet::finishMeasuring(const TestCase* t, const TinyTest::RunOptions& opts,
+                         const TinyTest::TestSample& sample,
+                         TestResult& res) {
+  const TinyTest::AllocCounts allocs = TinyTest::threadAllocCounts();
+  TinyTest::CounterSample counters;
+  if (opts.counters) TinyTest::readCounters(counters);
+  res.measured = TinyTest::measuring(opts);
+  if (res.measured) {
+    TinyTest::UsageSample after;
+    TinyTest::sampleUsage(after);
+    res.usage = TinyTest::usageBetween(sample.usage, after);
+  }
+  if (opts.counters)
+    TinyTest::countersBetween(sample.counters, counters, res.usage);
+  if (opts.leakCheck && res.passed) {
+    res.reason = TinyTest::describeLeaks(sample.allocs, allocs);
+    res.passed = res.reason.empty();
+  }
+  TinyTest::SharedFixture* fixture = t->sharedFixture();
+  if (fixture != NULL) fixture->testFinished();
+}
+
+void
+TestSet::runGuarded(const std::function<void()>& body, TestResult& res) {
+  res.passed = false;
+  res.reason.clear();
+  try {
+    body();
+    res.passed = true;
+  } catch (...) {
+    res.reason = TinyTest::describeException(std::current_exception());
+  }
+}
+
+TinyTest::TestEvent
+TestSet::makeEvent(const TestCase* t, size_t index, const TestResult& res) {
+  TinyTest::TestEvent e;
+  e.name = t->getTestName();
+  e.index = index;
+  e.benchmark = t->isBenchmark();
+  e.passed = res.passed;
+  e.reason = res.reason;
+  e.measured = res.measured;
+  e.usage = res.usage;
+  return e;
+}
+
+TestSet::TestList
+TestSet::select(const TinyTest::RunOptions& opts) {
+  TestList sel;
+  rowCases.clear();
+  for (const TestCase* t = firstTest; t != NULL; t = t->nextTest) {
+    if (t->isBenchmark() && !opts.benchmarks) continue;
+    // parameterised tests are split into cases, unless their rows can't be
+    // opened, in which case they're run whole to report why
+    const ParamTestCaseBase* param = t->paramTest();
+    if (param != NULL &&
+        TinyTest::rowsMayPassFilters(t->getTestName(), opts) &&
+        param->rowCount() > 0) {
+      addRowCases(param, opts, sel);
+      continue;
+    }
+    if (!opts.filters.empty() &&
+        !TinyTest::passesFilters(t->getTestName(), opts)) continue;
+    sel.push_back(t);
+  }
+  if (opts.shardCount <= 1) {
+    reorder(sel, opts);
+    if (opts.shuffle) TinyTest::shuffleWithSeed(sel, opts.seed);
+    return sel;
+  }
+
+  // unknown tests are assumed to take as long as the average known one
+  std::map<std::string, double> times;
+  if (!opts.shardTimingsFile.empty() &&
+      !TinyTest::loadTimings(opts.shardTimingsFile, times))
+    cerr << "Warning: couldn't read timings from " << opts.shardTimingsFile
+         << "; sharding round-robin instead" << endl;
+  std::vector<size_t> shard(sel.size());
+  if (times.empty()) {
+    for (size_t i = 0; i < sel.size(); ++i) shard[i] = i % opts.shardCount;
+  } else {
+    double mean = 0;
+    std::map<std::string, double>::const_iterator it;
+    for (it = times.begin(); it != times.end(); ++it) mean += it->second;
+    mean /= times.size();
+    std::vector<double> cost(sel.size(), mean);
+    for (size_t i = 0; i < sel.size(); ++i) {
+      it = times.find(sel[i]->getTestName());
+      if (it != times.end()) cost[i] = it->second;
+    }
+    shard = TinyTest::packShards(cost, opts.shardCount);
+  }
+
+  TestList mine;
+  for (size_t i = 0; i < sel.size(); ++i)
+    if (shard[i] == opts.shardIndex) mine.push_back(sel[i]);
+  reorder(mine, opts);
+  if (opts.shuffle) TinyTest::shuffleWithSeed(mine, opts.seed);
+  return mine;
+}
+
+void
+TestSet::addRowCases(const ParamTestCaseBase* t,
+                     const TinyTest::RunOptions& opts, TestList& sel) {
+  const size_t n = t->rowCount();
+  const size_t k = std::min(n, TinyTest::MAX_ROW_CASES);
+  for (size_t c = 0; c < k; ++c) {
+    std::unique_ptr<TestCase> rows(
+      new TinyTest::RowRangeCase(t, n * c / k, n * (c + 1) / k));
+    if (!opts.filters.empty() &&
+        !TinyTest::passesFilters(rows->getTestName(), opts,
+                                 t->getTestName())) continue;
+    sel.push_back(rows.get());
+    rowCases.push_back(std::move(rows));
+  }
+}
+
+void
+TestSet::reorder(TestList& sel, const TinyTest::RunOptions& opts) {
+  if (opts.cacheFile.empty() ||
+      !(opts.onlyFailed || opts.failedFirst || opts.longestFirst)) return;
+  TinyTest::ResultCache cache(opts.cacheFile);
+  std::vector<TinyTest::ResultCache::Entry> known(sel.size());
+  bool anyFailed = false;
+  for (size_t i = 0; i < sel.size(); ++i) {
+    cache.find(sel[i]->getTestName(), known[i]);
+    anyFailed = anyFailed || known[i].failed;
+  }
+
+  if (opts.onlyFailed && anyFailed) {
+    // benchmarks aren't cached, so they're left alone
+    size_t kept = 0;
+    for (size_t i = 0; i < sel.size(); ++i) {
+      if (!known[i].failed && !sel[i]->isBenchmark()) continue;
+      sel[kept] = sel[i];
+      known[kept++] = known[i];
+    }
+    sel.resize(kept);
+    known.resize(kept);
+  }
+
+  std::vector<size_t> order = TinyTest::cacheOrder(
+    known, cache.meanWallMs(), opts.failedFirst, opts.longestFirst);
+  TestList sorted(sel.size());
+  for (size_t i = 0; i < order.size(); ++i) sorted[i] = sel[order[i]];
+  sel.swap(sorted);
+}
+
+bool
+TestSet::updateCache(const TestList& sel, const ResultList& results,
+                     const TinyTest::RunOptions& opts) const {
+  // the cases of a parameterised test are named "test/rows"
+  std::set<std::string> tests;
+  for (const TestCase* t = firstTest; t != NULL; t = t->nextTest)
+    if (!t->isBenchmark()) tests.insert(t->getTestName());
+  std::function<bool(const std::string&)> registered =
+    [&](const std::string& name) {
+      return tests.count(name.substr(0, name.find('/'))) != 0;
+    };
+  std::map<std::string, TinyTest::ResultCache::Entry> fresh;
+  for (size_t i = 0; i < sel.size(); ++i) {
+    TinyTest::ResultCache::Entry& e = fresh[sel[i]->getTestName()];
+    e.failed = !results[i].passed;
+    if (results[i].measured) e.wallMs = results[i].usage.wallMs;
+  }
+  if (!TinyTest::ResultCache::update(opts.cacheFile, registered, fresh)) {
+    cerr << "Warning: couldn't write results to " << opts.cacheFile << endl;
+    return false;
+  }
+  return true;
+}
+
+bool
+TestSet::saveTimings(const TestList& sel, const ResultList& results,
+                     const TinyTest::RunOptions& opts) {
+  std::ofstream out(opts.saveTimingsFile.c_str());
+  for (size_t i = 0; i < sel.size(); ++i)
+    if (results[i].measured)
+      out << sel[i]->getTestName() << " " << results[i].usage.wallMs << "\n";
+  out.close();
+  if (!out) {
+    cerr << "Warning: couldn't write timings to " << opts.saveTimingsFile
+         << endl;
+    return false;
+  }
+  return true;
+}
+
+void
+TestSet::giveUp(const TestList& ran, const ResultList& results,
+                const TinyTest::RunOptions& opts,
+                TinyTest::ReportPipeline& report) const {
+  if (!opts.saveTimingsFile.empty()) saveTimings(ran, results, opts);
+  if (!opts.cacheFile.empty()) updateCache(ran, results, opts);
+  report.abandonRun();
+  std::_Exit(EXIT_FAILURE);
+}
+
+const FuzzTestCase*
+TestSet::fuzzTest(const std::string& name) const {
+  for (const TestCase* t = firstTest; t != NULL; t = t->nextTest)
+    if (t->fuzzTest() != NULL && t->getTestName() == name)
+      return t->fuzzTest();
+  return NULL;
+}
+
+bool
+TestSet::run(const TinyTest::RunOptions& opts) {
+  TinyTest::setUpdateGolden(opts.updateGolden);
+  TinyTest::setCorpusDir(opts.corpusDir, opts.corpusDirGiven);
+  // when the tests are repeated, each iteration is shuffled separately
+  const bool repeating = opts.repeat != 1 || opts.untilFail;
+  TinyTest::RunOptions selOpts(opts);
+  selOpts.shuffle = opts.shuffle && !repeating;
+  TestList selected = select(selOpts), sel, benches;
+  bool malformed = false;
+  for (size_t i = 0; i < selected.size(); ++i) {
+    const std::string bad =
+      TinyTest::malformedResource(selected[i]->getResources());
+    if (bad.empty()) continue;
+    cerr << "Invalid resource \"" << bad << "\" needed by "
+         << selected[i]->getTestName() << endl;
+    malformed = true;
+  }
+  if (malformed) return false;
+  if (opts.list) {
+    for (size_t i = 0; i < selected.size(); ++i)
+      cout << selected[i]->getTestName() << '\n';
+    cout << std::flush;
+    return true;
+  }
+  // the async tests go after the others, to be run together
+  std::vector<std::string> names;
+  TestList asyncs;
+  for (size_t i = 0; i < selected.size(); ++i) {
+    if (selected[i]->isBenchmark()) benches.push_back(selected[i]);
+    else if (selected[i]->isAsync()) asyncs.push_back(selected[i]);
+    else sel.push_back(selected[i]);
+  }
+  sel.insert(sel.end(), asyncs.begin(), asyncs.end());
+  for (size_t i = 0; i < sel.size(); ++i)
+    names.push_back(sel[i]->getTestName());
+  for (size_t i = 0; i < benches.size(); ++i)
+    names.push_back(benches[i]->getTestName());
+
+  if (opts.shuffle)
+    cerr << "Shuffling the tests with seed " << opts.seed << endl;
+  const std::string unavailable =
+    opts.counters ? TinyTest::countersUnavailable() : "";
+  if (!unavailable.empty()) cerr << unavailable << endl;
+
+  // count the users of each shared fixture so that the last one can tear it
+  // down; forked workers don't share fixtures with us, so they just keep
+  // theirs until they exit. Repeated runs count them a batch at a time.
+  if (!opts.isolate && !repeating) {
+    for (size_t i = 0; i < sel.size(); ++i) {
+      TinyTest::SharedFixture* fixture = sel[i]->sharedFixture();
+      if (fixture != NULL) fixture->expectTest();
+    }
+  }
+
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  TinyTest::ReportPipeline report(opts);
+  report.runStarted(names);
+
+  ResultList results(sel.size());
+  Finished reportIt = [&](size_t i, const TestResult& res) {
+    TinyTest::TestEvent e = makeEvent(sel[i], i, res);
+    report.testStarted(e);
+    report.testFinished(e);
+  };
+  if (repeating && !sel.empty()) {
+    runRepeated(sel, opts, results, report);
+  } else if (opts.isolate && !sel.empty()) {
+    runIsolated(sel, opts, results, report, reportIt);
+  } else {
+    // tests sharing the event loop's thread can't have their allocations
+    // or counters told apart, so for those the async tests run like the
+    // others, each on a loop of its own
+    const size_t together =
+      opts.leakCheck || opts.counters ? 0 : asyncs.size();
+    TestList plain(sel.begin(), sel.end() - together);
+    ResultList plainResults(plain.size());
+    if (opts.jobs > 1 && plain.size() > 1)
+      runParallel(plain, opts, plainResults, report, reportIt);
+    else runSerial(plain, opts, plainResults, report);
+    std::copy(plainResults.begin(), plainResults.end(), results.begin());
+    if (together > 0)
+      runAsyncTests(sel, plain.size(), opts, results, report, reportIt);
+  }
+
+  TinyTest::RunSummary summary;
+  summary.tests = names.size();
+  for (size_t i = 0; i < results.size(); ++i)
+    if (!results[i].passed) ++summary.failures;
+  if (!opts.saveTimingsFile.empty()) saveTimings(sel, results, opts);
+  if (!opts.cacheFile.empty()) updateCache(sel, results, opts);
+  // benchmarks always run alone, so the tests can't disturb the timings
+  summary.failures += runBenchmarks(benches, sel.size(), opts, report);
+
+  summary.wallMs = std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - start).count();
+  report.runFinished(summary);
+  report.finish();
+  // with --golden, the output says which tests should fail
+  if (!opts.goldenFile.empty()) return report.outputMatched();
+  return summary.failures == 0;
+}
+
+void
+TestSet::runSerial(const TestList& sel, const TinyTest::RunOptions& opts,
+                   ResultList& results, TinyTest::ReportPipeline& report) {
+  std::mutex reportLock;
+  size_t current = sel.size();
+  // a test that overruns can't be stopped, so report it and give up
+  TinyTest::Watchdog watchdog(1, [&](size_t i) {
+    std::lock_guard<std::mutex> guard(reportLock);
+    if (i != current) return;  // it finished just in time
+    results[i].passed = false;
+    results[i].timedOut = true;
+    results[i].reason = TinyTest::describeTimeout(timeLimitMs(sel[i], opts));
+    report.testFinished(makeEvent(sel[i], i, results[i]));
+    giveUp(TestList(sel.begin(), sel.begin() + i + 1),
+           ResultList(results.begin(), results.begin() + i + 1), opts,
+           report);
+  });
+
+  for (size_t i = 0; i < sel.size(); ++i) {
+    // the start is written out before the test runs, so it's clear which
+    // test was running if the process dies part-way through.
+    report.testStarted(makeEvent(sel[i], i, results[i]));
+    report.flush();
+    {
+      std::lock_guard<std::mutex> guard(reportLock);
+      current = i;
+    }
+    watchdog.arm(0, i, timeLimitMs(sel[i], opts));
+    runTestCase(sel[i], results[i], opts);
+    std::lock_guard<std::mutex> guard(reportLock);
+    watchdog.disarm(0);
+    current = sel.size();
+    report.testFinished(makeEvent(sel[i], i, results[i]));
+  }
+}
+
+void
+TestSet::runParallel(const TestList& sel, const TinyTest::RunOptions& opts,
+                     ResultList& results, TinyTest::ReportPipeline& report,
+                     const Finished& finished) {
+  std::vector<bool> done(sel.size(), false);
+  size_t nextOut = 0;
+  std::mutex doneLock;
+  std::condition_variable doneCond;
+
+  // there's no point in more workers than tests
+  const size_t workers = std::max<size_t>(1, std::min(opts.jobs, sel.size()));
+  // a test that overruns can't be stopped, so report everything that has
+  // finished (in order), then the overrunning test, and give up
+  TinyTest::Watchdog watchdog(workers, [&](size_t i) {
+    std::lock_guard<std::mutex> guard(doneLock);
+    if (done[i]) return;  // it finished just in time
+    TestList ran;
+    ResultList ranResults;
+    for (size_t k = 0; k < sel.size(); ++k) {
+      if (k == i) {
+        TestResult res;
+        res.timedOut = true;
+        res.reason = TinyTest::describeTimeout(timeLimitMs(sel[i], opts));
+        if (k >= nextOut) finished(i, res);
+        ran.push_back(sel[i]);
+        ranResults.push_back(res);
+      } else if (done[k]) {
+        if (k >= nextOut) finished(k, results[k]);
+        ran.push_back(sel[k]);
+        ranResults.push_back(results[k]);
+      }
+    }
+    giveUp(ran, ranResults, opts, report);
+  });
+
+  // workers fill in results; this thread reports them in registration
+  // order as soon as each one (and everything before it) is available.
+  TinyTest::WorkStealingPool pool(workers);
+  auto runOne = [&](size_t i, size_t w) {
+    watchdog.arm(w, i, timeLimitMs(sel[i], opts));
+    runTestCase(sel[i], results[i], opts);
+    watchdog.disarm(w);
+    std::lock_guard<std::mutex> guard(doneLock);
+    done[i] = true;
+    doneCond.notify_one();
+  };
+  // a test that needs resources others are using is put aside, and run by
+  // the worker that frees them, or by any worker once the queues are empty
+  TinyTest::ResourceScheduler resources(TinyTest::resourceNeeds(sel),
+                                       opts.resources);
+  auto runNeeding = [&](size_t i, size_t w) {
+    do runOne(i, w); while (resources.finishAndTakeNext(i, i));
+  };
+  std::thread runner([&]() {
+    pool.run(sel.size(), [&](size_t i, size_t w) {
+      if (!resources.needsAny(i)) runOne(i, w);
+      else if (resources.startOrPutAside(i)) runNeeding(i, w);
+    }, [&](size_t w) {
+      size_t i;
+      while (resources.waitForPutAside(i)) runNeeding(i, w);
+    });
+  });
+
+  for (std::unique_lock<std::mutex> guard(doneLock); nextOut < sel.size();
+       ++nextOut) {
+    doneCond.wait(guard, [&]() { return bool(done[nextOut]); });
+    finished(nextOut, results[nextOut]);
+  }
+  runner.join();
+}
+
+void
+TestSet::runIsolated(const TestList& sel, const TinyTest::RunOptions& opts,
+                     ResultList& results, TinyTest::ReportPipeline& report,
+                     const Finished& finished) {
+  std::vector<bool> done(sel.size(), false);
+  size_t nextOut = 0;
+
+  // the workers send back "P" or "F", then the raw ResourceUsage if it was
+  // measured (worker and parent are the same binary), then the reason
+  const size_t usageLen =
+    TinyTest::measuring(opts) ? sizeof(TinyTest::ResourceUsage) : 0;
+  TinyTest::ResourceScheduler resources(TinyTest::resourceNeeds(sel),
+                                       opts.resources);
+  // the workers must not inherit a writer thread stuck holding a lock, and
+  // there's no point in more of them than tests
+  TinyTest::ForkedWorkerPool pool(
+    std::max<size_t>(1, std::min(opts.jobs, sel.size())),
+    [&]() { report.flush(); });
+  pool.run(sel.size(),
+    [&](size_t i) {
+      TestResult res;
+      runTestCase(sel[i], res, opts);
+      std::string payload(res.passed ? "P" : "F");
+      payload.append(reinterpret_cast<const char*>(&res.usage), usageLen);
+      return payload + res.reason;
+    },
+    [&](size_t i, TinyTest::ForkedWorkerPool::Outcome outcome,
+        const std::string& payload, int status) {
+      if (outcome == TinyTest::ForkedWorkerPool::TIMED_OUT) {
+        results[i].passed = false;
+        results[i].timedOut = true;
+        results[i].reason =
+          TinyTest::describeTimeout(timeLimitMs(sel[i], opts));
+      } else if (outcome == TinyTest::ForkedWorkerPool::CRASHED ||
+                 payload.size() < 1 + usageLen) {
+        results[i].passed = false;
+        results[i].reason = TinyTest::describeExit(status);
+      } else {
+        results[i].passed = payload[0] == 'P';
+        results[i].measured = TinyTest::measuring(opts);
+        std::memcpy(&results[i].usage, payload.data() + 1, usageLen);
+        results[i].reason = payload.substr(1 + usageLen);
+      }
+      if (resources.needsAny(i)) resources.give(i);
+      done[i] = true;
+      for (; nextOut < sel.size() && done[nextOut]; ++nextOut)
+        finished(nextOut, results[nextOut]);
+    },
+    [&](size_t i) { return timeLimitMs(sel[i], opts); },
+    [&](size_t i) {
+      return !resources.needsAny(i) || resources.tryTake(i);
+    });
+}
+
+void
+TestSet::runAsyncTests(const TestList& sel, size_t first,
+                       const TinyTest::RunOptions& opts, ResultList& results,
+                       TinyTest::ReportPipeline& report,
+                       const Finished& finished) {
+#ifdef TINYTEST_HAS_COROUTINES
+  std::vector<bool> done(sel.size(), false);
+  size_t next = first, nextOut = first, inFlight = 0;
+  // the loop numbers the tests in the order they're started
+  std::vector<size_t> started;
+  std::vector<TinyTest::TestSample> samples(sel.size());
+  TinyTest::EventLoop loop;
+
+  // a test that blocks the loop can't be stopped, so report it and give up
+  std::mutex reportLock;
+  size_t current = sel.size();
+  TinyTest::Watchdog watchdog(1, [&](size_t i) {
+    std::lock_guard<std::mutex> guard(reportLock);
+    if (i != current) return;  // it handed the loop back just in time
+    TestList ran;
+    ResultList ranResults;
+    for (size_t k = 0; k < sel.size(); ++k) {
+      if (k == i) {
+        TestResult res;
+        res.timedOut = true;
+        res.reason = TinyTest::describeTimeout(timeLimitMs(sel[i], opts));
+        if (k >= nextOut) finished(i, res);
+        ran.push_back(sel[i]);
+        ranResults.push_back(res);
+      } else if (done[k] || k < first) {
+        if (k >= nextOut) finished(k, results[k]);
+        ran.push_back(sel[k]);
+        ranResults.push_back(results[k]);
+      }
+    }
+    giveUp(ran, ranResults, opts, report);
+  });
+
+  // a test that needs resources others are using is held back until one
+  // of them finishes; on its own, a test always gets what it needs
+  TinyTest::ResourceScheduler resources(TinyTest::resourceNeeds(sel),
+                                       opts.resources);
+  std::deque<size_t> heldBack;
+  auto startOne = [&](size_t i) {
+    const AsyncTestCase* t = static_cast<const AsyncTestCase*>(sel[i]);
+    started.push_back(i);
+    ++inFlight;
+    startMeasuring(opts, samples[i]);
+    loop.start(t->runAsync(), timeLimitMs(t, opts));
+  };
+  auto startMore = [&]() {
+    for (std::deque<size_t>::iterator it = heldBack.begin();
+         it != heldBack.end() && inFlight < TinyTest::MAX_ASYNC_TESTS; ) {
+      if (!resources.tryTake(*it)) {
+        ++it;
+        continue;
+      }
+      startOne(*it);
+      it = heldBack.erase(it);
+    }
+    for (; next < sel.size() && inFlight < TinyTest::MAX_ASYNC_TESTS; ++next) {
+      if (!resources.needsAny(next) || resources.tryTake(next))
+        startOne(next);
+      else heldBack.push_back(next);
+    }
+  };
+  startMore();
+  // the tests share the thread, so the CPU time and the like of each one
+  // include those of whatever ran alongside it
+  loop.run([&](size_t n, std::exception_ptr error, bool timedOut) {
+    const size_t i = started[n];
+    TestResult& res = results[i];
+    res.passed = !error && !timedOut;
+    res.timedOut = timedOut;
+    if (timedOut) res.reason = TinyTest::describeTimeout(timeLimitMs(sel[i],
+                                                                     opts));
+    else if (error) res.reason = TinyTest::describeException(error);
+    finishMeasuring(sel[i], opts, samples[i], res);
+    if (resources.needsAny(i)) resources.give(i);
+    --inFlight;
+    {
+      std::lock_guard<std::mutex> guard(reportLock);
+      done[i] = true;
+    }
+    startMore();
+    for (; nextOut < sel.size() && done[nextOut]; ++nextOut)
+      finished(nextOut, results[nextOut]);
+  }, [&](size_t n, double leftMs) {
+    std::lock_guard<std::mutex> guard(reportLock);
+    if (leftMs < 0) {
+      watchdog.disarm(0);
+      current = sel.size();
+    } else {
+      current = started[n];
+      watchdog.arm(0, current, leftMs);
+    }
+  });
+#else
+  for (size_t i = first; i < sel.size(); ++i) {
+    runTestCase(sel[i], results[i], opts);
+    finished(i, results[i]);
+  }
+#endif
+}
+
+void
+TestSet::runRepeated(const TestList& sel, const TinyTest::RunOptions& opts,
+                     ResultList& results, TinyTest::ReportPipeline& report) {
+  const size_t n = sel.size();
+  const size_t NONE = std::numeric_limits<size_t>::max();
+  std::vector<size_t> runs(n, 0), failures(n, 0), firstFailed(n, NONE);
+  // each test's result, once it has run, with the counts in the reason
+  auto summarise = [&](size_t i) {
+    TestResult res;
+    res.passed = failures[i] == 0;
+    if (res.passed) return res;
+    std::ostringstream reason;
+    reason << "failed " << failures[i] << " of " << runs[i] << " runs; "
+           << "the first in iteration " << firstFailed[i] + 1;
+    if (opts.shuffle) reason << " (seed " << opts.seed + firstFailed[i] << ")";
+    res.reason = reason.str() + ": " + results[i].reason;
+    res.timedOut = results[i].timedOut;
+    return res;
+  };
+
+  // the shared fixtures are held for the whole run, so that they're set up
+  // once rather than once per batch (per-worker ones can't be, though)
+  std::set<TinyTest::SharedFixture*> fixtures;
+  if (!opts.isolate) {
+    for (size_t i = 0; i < n; ++i)
+      if (sel[i]->sharedFixture() != NULL)
+        fixtures.insert(sel[i]->sharedFixture());
+  }
+  std::set<TinyTest::SharedFixture*>::const_iterator f;
+  for (f = fixtures.begin(); f != fixtures.end(); ++f) (*f)->expectTest();
+
+  // a few iterations go to the workers at once, so that they're kept busy
+  // even if there are only a few tests
+  const size_t perBatch = std::max<size_t>(1, (4 * opts.jobs + n - 1) / n);
+  size_t iteration = 0, firstFailure = NONE;
+  while ((opts.repeat == 0 || iteration < opts.repeat) &&
+         !(opts.untilFail && firstFailure != NONE)) {
+    size_t k = perBatch;
+    if (opts.repeat != 0) k = std::min(k, opts.repeat - iteration);
+    std::vector<size_t> test;
+    TestList batch;
+    for (size_t j = 0; j < k; ++j) {
+      std::vector<size_t> order(n);
+      for (size_t p = 0; p < n; ++p) order[p] = p;
+      if (opts.shuffle)
+        TinyTest::shuffleWithSeed(order, opts.seed + iteration + j);
+      for (size_t p = 0; p < n; ++p) {
+        test.push_back(order[p]);
+        batch.push_back(sel[order[p]]);
+      }
+    }
+    if (!opts.isolate) {
+      for (size_t b = 0; b < batch.size(); ++b) {
+        TinyTest::SharedFixture* fixture = batch[b]->sharedFixture();
+        if (fixture != NULL) fixture->expectTest();
+      }
+    }
+
+    // results arrive in order, so the first failure seen is the earliest
+    Finished record = [&](size_t b, const TestResult& res) {
+      const size_t i = test[b], it = iteration + b / n;
+      ++runs[i];
+      if (res.passed) return;
+      if (failures[i]++ == 0) {
+        firstFailed[i] = it;
+        results[i] = res;
+      }
+      firstFailure = std::min(firstFailure, it);
+      // an overrunning test in this process ends the run (see runParallel)
+      if (res.timedOut && !opts.isolate) {
+        TinyTest::TestEvent e = makeEvent(sel[i], i, summarise(i));
+        report.testStarted(e);
+        report.testFinished(e);
+      }
+    };
+    ResultList batchResults(batch.size());
+    if (opts.isolate) runIsolated(batch, opts, batchResults, report, record);
+    else runParallel(batch, opts, batchResults, report, record);
+    // the next batch gets new worker threads
+    for (f = fixtures.begin(); f != fixtures.end(); ++f)
+      (*f)->workersFinished();
+    iteration += k;
+  }
+  for (f = fixtures.begin(); f != fixtures.end(); ++f) (*f)->testFinished();
+
+  cerr << "Ran the tests " << iteration
+       << (iteration == 1 ? " time" : " times");
+  if (firstFailure == NONE) cerr << "; none of them failed" << endl;
+  else {
+    cerr << "; the first failure was in iteration " << firstFailure + 1;
+    if (opts.shuffle)
+      cerr << " (rerun it with --shuffle --seed "
+           << opts.seed + firstFailure << ")";
+    cerr << endl;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    results[i] = summarise(i);
+    TinyTest::TestEvent e = makeEvent(sel[i], i, results[i]);
+    report.testStarted(e);
+    report.testFinished(e);
+  }
+}
+
+size_t
+TestSet::runBenchmarks(const TestList& sel, size_t firstIndex,
+                       const TinyTest::RunOptions& opts,
+                       TinyTest::ReportPipeline& report) {
+  TinyTest::Baseline baseline, measured;
+  if (!opts.baselineFile.empty() &&
+      !TinyTest::loadBaseline(opts.baselineFile, baseline))
+    cerr << "Warning: couldn't read the baseline " << opts.baselineFile
+         << endl;
+
+  size_t failed = 0;
+  for (size_t i = 0; i < sel.size(); ++i) {
+    const BenchmarkCase* b = static_cast<const BenchmarkCase*>(sel[i]);
+    const std::string name = b->getTestName();
+    TestResult res;
+    report.testStarted(makeEvent(b, firstIndex + i, res));
+    TinyTest::BenchmarkStats stats;
+    runGuarded([&]() {
+      stats = TinyTest::measureBenchmark(*b, opts.benchmarkTime,
+                                         opts.counters);
+    }, res);
+    std::string comparison;
+    if (res.passed) {
+      measured[name] = stats.perOp;
+      TinyTest::Baseline::const_iterator base = baseline.find(name);
+      if (base != baseline.end() &&
+          TinyTest::slowerThanBaseline(stats.perOp, base->second, opts,
+                                       comparison)) {
+        res.passed = false;
+        res.reason = "BENCHMARK " + name + " is slower than its baseline; " +
+                     comparison;
+      }
+    }
+    TinyTest::TestEvent e = makeEvent(b, firstIndex + i, res);
+    if (res.passed) {
+      e.benchmarkStats = stats.toString();
+      if (!comparison.empty()) e.benchmarkStats += "; " + comparison;
+    } else {
+      ++failed;
+    }
+    report.testFinished(e);
+  }
+
+  if (!opts.updateBaselineFile.empty()) {
+    // keep the baselines of any benchmarks that weren't run this time
+    if (!TinyTest::updateBaseline(opts.updateBaselineFile, measured))
+      cerr << "Warning: couldn't write the baseline "
+           << opts.updateBaselineFile << endl;
+  }
+  return failed;
+}
+
+/******************************************************************************
+ **                         RUNNING OTHER PROGRAMS                           **
+ ******************************************************************************/
+
+namespace TinyTest {
+  /** \brief a string found in every program linked with this file, which
+   *         tells the TinyTest programs in a directory from the rest */
+  static const char PROGRAM_MARKER[] = "TinyTest program; run with --programs";
+
+  /** \brief does the file at path contain PROGRAM_MARKER? */
+  static bool
+  isTinyTestProgram(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    bool found = false;
+    if (::fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void* p = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        found = ::memmem(p, st.st_size, PROGRAM_MARKER,
+                         sizeof(PROGRAM_MARKER) - 1) != NULL;
+        ::munmap(p, st.st_size);
+      }
+    }
+    ::close(fd);
+    return found;
+  }
+
+  /** \brief add the programs named by specs to paths, in order; a directory
+   *         stands for the TinyTest programs in it, in name order. Returns
+   *         false (after saying why) if one of them can't be found */
+  static bool
+  findPrograms(const std::vector<std::string>& specs,
+               std::vector<std::string>& paths) {
+    for (size_t i = 0; i < specs.size(); ++i) {
+      struct stat st;
+      if (::stat(specs[i].c_str(), &st) != 0) {
+        cerr << "Couldn't find the test program " << specs[i] << endl;
+        return false;
+      }
+      if (!S_ISDIR(st.st_mode)) {
+        paths.push_back(specs[i]);
+        continue;
+      }
+      DIR* dir = ::opendir(specs[i].c_str());
+      if (dir == NULL) {
+        cerr << "Couldn't read the directory " << specs[i] << endl;
+        return false;
+      }
+      std::string prefix(specs[i]);
+      if (prefix[prefix.size() - 1] != '/') prefix += '/';
+      std::vector<std::string> found;
+      for (dirent* e = ::readdir(dir); e != NULL; e = ::readdir(dir)) {
+        std::string path = prefix + e->d_name;
+        if (e->d_name[0] != '.' && ::access(path.c_str(), X_OK) == 0 &&
+            isTinyTestProgram(path))
+          found.push_back(path);
+      }
+      ::closedir(dir);
+      std::sort(found.begin(), found.end());
+      paths.insert(paths.end(), found.begin(), found.end());
+    }
+    return true;
+  }
+
+  /** \brief one of the programs being run, and what it has reported */
+  struct ProgramRun {
+    ProgramRun() : listed(false), pid(-1), fd(-1), usesSlot(false),
+                   token(0), status(0), finished(false) {;}
+    /** the program, and the name its tests are reported under */
+    std::string path, label;
+    /** the tests it will run, and whether it managed to list them */
+    std::vector<std::string> tests;
+    bool listed;
+    /** the running program, and the pipe its report comes back through */
+    pid_t pid;
+    int fd;
+    /** true if it took a job slot rather than using ours, and the byte */
+    bool usesSlot;
+    char token;
+    /** its report (in TAP) so far, and its wait status once it's done */
+    std::string output;
+    int status;
+    bool finished;
+  };
+
+  /**
+   * \brief start the program at path with args, returning its pid and,
+   *        in fd, the read end of a pipe. If reportToPipe, the program
+   *        reports in TAP to the pipe and its stdout goes to our stderr (so
+   *        it can't get mixed up with our report); otherwise its stdout
+   *        goes to the pipe.
+   */
+  static pid_t
+  startProgram(const std::string& path, std::vector<std::string> args,
+               bool reportToPipe, int& fd) {
+    int p[2];
+    if (::pipe(p) != 0) {
+      perror("TinyTest: pipe");
+      std::exit(EXIT_FAILURE);
+    }
+    // no other program may inherit the pipe, or we'd never see it close
+    ::fcntl(p[0], F_SETFD, FD_CLOEXEC);
+    ::fcntl(p[1], F_SETFD, FD_CLOEXEC);
+    if (reportToPipe) {
+      std::stringstream ss;
+      ss << "tap:/dev/fd/" << p[1];
+      args.push_back("--reporter");
+      args.push_back(ss.str());
+    }
+    // the reporters' thread may be allocating, so the child mustn't
+    std::vector<char*> argv(1, const_cast<char*>(path.c_str()));
+    for (size_t i = 0; i < args.size(); ++i)
+      argv.push_back(const_cast<char*>(args[i].c_str()));
+    argv.push_back(NULL);
+    pid_t pid = ::fork();
+    if (pid < 0) {
+      perror("TinyTest: fork");
+      std::exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+      if (reportToPipe) {
+        ::fcntl(p[1], F_SETFD, 0);
+        ::dup2(STDERR_FILENO, STDOUT_FILENO);
+      } else {
+        ::dup2(p[1], STDOUT_FILENO);
+      }
+      ::execv(path.c_str(), &argv[0]);
+      ::_exit(127);
+    }
+    ::close(p[1]);
+    fd = p[0];
+    return pid;
+  }
+
+  /** \brief wait for the process pid to exit and return its wait status */
+  static int
+  waitFor(pid_t pid) {
+    int status = 0;
+    while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {;}
+    return status;
+  }
+
+  /** \brief ask the program in p which tests it would run given args */
+  static void
+  listTests(ProgramRun& p, const std::vector<std::string>& args) {
+    std::vector<std::string> listArgs(1, "--list");
+    listArgs.insert(listArgs.end(), args.begin(), args.end());
+    int fd;
+    pid_t pid = startProgram(p.path, listArgs, false, fd);
+    std::string out;
+    char buf[4096];
+    for (;;) {
+      ssize_t n = ::read(fd, buf, sizeof(buf));
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) break;
+      out.append(buf, n);
+    }
+    ::close(fd);
+    p.status = waitFor(pid);
+    p.listed = WIFEXITED(p.status) && WEXITSTATUS(p.status) == 0;
+    std::stringstream names(out);
+    std::string name;
+    while (std::getline(names, name))
+      if (!name.empty()) p.tests.push_back(name);
+  }
+
+  /** \brief the contents of the quoted JSON string s (as written by
+   *         jsonString) */
+  static std::string
+  jsonUnescape(const std::string& s) {
+    std::string r;
+    for (size_t i = 1; i < s.size() && s[i] != '"'; ++i) {
+      if (s[i] != '\\' || i + 1 == s.size()) {
+        r += s[i];
+        continue;
+      }
+      char c = s[++i];
+      if (c == 'n') r += '\n';
+      else if (c == 't') r += '\t';
+      else if (c == 'u' && i + 4 < s.size()) {
+        r += static_cast<char>(std::strtol(s.substr(i + 1, 4).c_str(),
+                                           NULL, 16));
+        i += 4;
+      } else r += c;
+    }
+    return r;
+  }
+
+  /** \brief the tests in a report written by TapReporter */
+  static std::vector<TestEvent>
+  parseTap(const std::string& tap) {
+    std::vector<TestEvent> events;
+    std::stringstream in(tap);
+    std::string line;
+    while (std::getline(in, line)) {
+      bool ok = line.compare(0, 3, "ok ") == 0;
+      size_t dash = line.find(" - ");
+      if ((ok || line.compare(0, 7, "not ok ") == 0) &&
+          dash != std::string::npos) {
+        TestEvent e;
+        e.name = line.substr(dash + 3);
+        e.passed = ok;
+        events.push_back(e);
+      } else if (events.empty()) {
+        continue;
+      } else if (line.compare(0, 11, "  message: ") == 0) {
+        std::string& reason = events.back().reason;
+        if (!reason.empty()) reason += "; ";
+        reason += jsonUnescape(line.substr(11));
+      } else if (line.compare(0, 2, "# ") == 0 && events.back().passed) {
+        events.back().benchmark = true;
+        events.back().benchmarkStats = line.substr(2);
+      }
+    }
+    return events;
+  }
+
+  /** \brief report the tests in program p, which has finished, numbering
+   *         them from index on; tests it listed but didn't report, and the
+   *         program itself if it failed some other way, are failures */
+  static void
+  reportProgram(const ProgramRun& p, size_t& index, RunSummary& summary,
+                ReportPipeline& report) {
+    std::vector<TestEvent> events = parseTap(p.output);
+    std::set<std::string> reported;
+    bool anyFailed = false;
+    for (size_t i = 0; i < events.size(); ++i) {
+      reported.insert(events[i].name);
+      if (!events[i].passed) anyFailed = true;
+    }
+    for (size_t i = 0; i < p.tests.size(); ++i) {
+      if (reported.count(p.tests[i]) > 0) continue;
+      TestEvent e;
+      e.name = p.tests[i];
+      e.reason = p.status != 0 ? describeExit(p.status)
+                               : "Test was listed but never reported";
+      events.push_back(e);
+      anyFailed = true;
+    }
+    if (!anyFailed && p.status != 0) {
+      TestEvent e;
+      e.reason = (p.listed ? "" : "Couldn't list the tests; ") +
+                 describeExit(p.status);
+      events.push_back(e);
+    }
+    for (size_t i = 0; i < events.size(); ++i) {
+      TestEvent& e = events[i];
+      e.name = e.name.empty() ? p.label : p.label + ":" + e.name;
+      e.index = index++;
+      report.testStarted(e);
+      report.testFinished(e);
+      ++summary.tests;
+      if (!e.passed) ++summary.failures;
+    }
+  }
+
+  /**
+   * \brief run the programs in opts.programs, up to opts.jobs at once, each
+   *        with opts.programArgs, and report their tests as one run, in the
+   *        order the programs were given, as "PROGRAM:TEST". Every program
+   *        but one needs a job slot to start; the slots come from make's
+   *        jobserver if there is one, and otherwise from one of our own, so
+   *        that the programs' own -j share the slots too. Returns true if
+   *        every test passed.
+   */
+  static bool
+  runPrograms(const RunOptions& opts) {
+    std::vector<std::string> paths;
+    if (!findPrograms(opts.programs, paths)) return false;
+    std::vector<ProgramRun> progs(paths.size());
+    std::vector<std::string> names;
+    bool allListed = true;
+    for (size_t i = 0; i < progs.size(); ++i) {
+      ProgramRun& p = progs[i];
+      p.path = paths[i];
+      p.label = p.path.compare(0, 2, "./") == 0 ? p.path.substr(2) : p.path;
+      listTests(p, opts.programArgs);
+      if (!p.listed) {
+        cerr << "Couldn't list the tests in " << p.path << endl;
+        allListed = false;
+        p.finished = true;
+      }
+      for (size_t t = 0; t < p.tests.size(); ++t)
+        names.push_back(p.label + ":" + p.tests[t]);
+    }
+    if (opts.list) {
+      for (size_t i = 0; i < names.size(); ++i) cout << names[i] << '\n';
+      cout << std::flush;
+      return allListed;
+    }
+
+    JobServer& jobs = JobServer::get();
+    jobs.create(std::min(opts.jobs, progs.size()));
+    std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    ReportPipeline report(opts);
+    report.runStarted(names);
+    RunSummary summary;
+    size_t next = 0, nextOut = 0, running = 0, index = 0;
+    bool ourSlotFree = true;
+    for (;;) {
+      // start as many programs as there are slots for
+      for (; next < progs.size(); ++next) {
+        ProgramRun& p = progs[next];
+        if (p.finished) continue;
+        if (running >= opts.jobs) break;
+        if (ourSlotFree) ourSlotFree = false;
+        else if (jobs.tryAcquire(p.token)) p.usesSlot = true;
+        else break;
+        p.pid = startProgram(p.path, opts.programArgs, true, p.fd);
+        ++running;
+      }
+      // report the programs that have finished, in order
+      for (; nextOut < progs.size() && progs[nextOut].finished; ++nextOut)
+        reportProgram(progs[nextOut], index, summary, report);
+      if (nextOut == progs.size()) break;
+
+      // wait for the running programs, or for a slot to start another
+      std::vector<pollfd> fds;
+      std::vector<size_t> polled;
+      for (size_t i = nextOut; i < next; ++i) {
+        if (progs[i].finished) continue;
+        pollfd pfd = {progs[i].fd, POLLIN, 0};
+        fds.push_back(pfd);
+        polled.push_back(i);
+      }
+      if (next < progs.size() && running < opts.jobs && jobs.active()) {
+        pollfd pfd = {jobs.pollFd(), POLLIN, 0};
+        fds.push_back(pfd);
+      }
+      if (::poll(&fds[0], fds.size(), -1) < 0 && errno != EINTR) {
+        perror("TinyTest: poll");
+        std::exit(EXIT_FAILURE);
+      }
+      for (size_t k = 0; k < polled.size(); ++k) {
+        if (fds[k].revents == 0) continue;
+        ProgramRun& p = progs[polled[k]];
+        char buf[65536];
+        ssize_t n = ::read(p.fd, buf, sizeof(buf));
+        if (n > 0) p.output.append(buf, n);
+        if (n > 0 || (n < 0 && errno == EINTR)) continue;
+        // its report is complete once the pipe closes
+        ::close(p.fd);
+        p.status = waitFor(p.pid);
+        p.finished = true;
+        --running;
+        if (p.usesSlot) jobs.release(p.token);
+        else ourSlotFree = true;
+      }
+    }
+
+    summary.wallMs = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+    report.runFinished(summary);
+    report.finish();
+    if (!opts.goldenFile.empty()) return report.outputMatched() && allListed;
+    return summary.failures == 0;
+  }
+}
+
+/******************************************************************************
+ **                             COMMAND LINE                                 **
+ ******************************************************************************/
+
+/**
+ * \brief print a short description of the command line options to stderr.
+ */
+static void
+usage(const char* prog) {
+  cerr << "Usage: " << prog << " [options]" << endl
+       << "Options:" << endl
+       << "  --list              print the names of the tests that would be "
+       << "run (after --filter and sharding) and exit" << endl
+       << "  --programs LIST     run the TinyTest programs in the ':'-"
+       << "separated LIST (directories stand for those in them), -j at once, "
+       << "instead of our own tests and report them together" << endl
+       << "  -- ARGS             with --programs, give the remaining "
+       << "arguments to each program; with --fuzz, to libFuzzer" << endl
+       << "  -j N                run tests on N threads (0 means one per "
+       << "core; default one, or as many as make's jobserver has free slots "
+       << "for); results are still reported in the serial order" << endl
+       << "  --isolate           run each test in a pool of forked worker "
+       << "processes (-j of them) so a crashing test is reported as a "
+       << "failure" << endl
+       << "  --repeat N          run the tests N times, spread over -j "
+       << "threads (default: one per core), and report how often each failed"
+       << endl
+       << "  --until-fail        repeat the tests (at most --repeat times, if "
+       << "given) until one fails" << endl
+       << "  --shuffle           run the tests in a random order, printing "
+       << "the seed to stderr" << endl
+       << "  --seed S            shuffle with seed S; with --repeat, the n'th "
+       << "iteration (from 0) uses S + n" << endl
+       << "  --resource NAME=N   there are N of the resource NAME for tests "
+       << "declared with TEST_RESOURCES to share (default 1; memory defaults "
+       << "to the machine's MB)" << endl
+       << "  --timing            add the time and resources used to each "
+       << "result and list the slowest tests at the end" << endl
+       << "  --counters          add cycles, instructions, IPC, cache and "
+       << "branch misses and page faults to each result (Linux)" << endl
+       << "  --slowest N         list N tests in the --timing summary "
+       << "(default 10)" << endl
+       << "  --filter PATTERNS   only run tests whose names match one of "
+       << "the ':'-separated globs; globs starting with '-' exclude" << endl
+       << "  --shard-index I     run only shard I (counting from 0) of ..."
+       << endl
+       << "  --shard-count N     ... N shards" << endl
+       << "  --shard-timings F   balance the shards using durations saved "
+       << "by --save-timings" << endl
+       << "  --save-timings F    write each test's duration to F" << endl
+       << "  --golden F          compare the output with F instead of "
+       << "printing it; the run passes if they match" << endl
+       << "  --update-golden     rewrite F and the files checked by "
+       << "EXPECT_FILE_EQUAL and EXPECT_OUTPUT_MATCHES_FILE instead" << endl
+       << "  --cache F           remember which tests failed and how long "
+       << "each took in F" << endl
+       << "  --failed-first      run the tests that failed last time first "
+       << "(needs --cache)" << endl
+       << "  --only-failed       run only the tests that failed last time, "
+       << "or all of them if none did (needs --cache)" << endl
+       << "  --longest-first     run the tests that took longest last time "
+       << "first (needs --cache)" << endl
+       << "  --timeout MS        fail tests that take longer than MS "
+       << "milliseconds; without --isolate, the run stops there" << endl
+       << "  --corpus DIR        replay the inputs in DIR/NAME for each "
+       << "FUZZ_TEST NAME (default: corpus)" << endl
+       << "  --fuzz NAME         fuzz the FUZZ_TEST NAME with libFuzzer, "
+       << "adding what it finds to its corpus (needs -fsanitize=fuzzer "
+       << "-DTINYTEST_FUZZER)" << endl
+       << "  --leak-check        fail tests that don't free everything they "
+       << "allocate (needs -DTINYTEST_ALLOC_HOOKS)" << endl
+       << "  --reporter R[:F]    report results with R (console, tap, junit "
+       << "or json) to F, or stdout; may be repeated (default: console)"
+       << endl
+       << "  --simd LEVEL        compare containers using scalar, sse2, avx2 "
+       << "or avx512 code (default: avx2 or the best below it)" << endl
+       << "  --benchmarks        also run the benchmarks (after the tests)"
+       << endl
+       << "  --benchmark-time S  spend about S seconds timing each "
+       << "benchmark (default 0.5)" << endl
+       << "  --baseline F        fail benchmarks that are significantly "
+       << "slower than the timings in F (implies --benchmarks)" << endl
+       << "  --update-baseline F record the benchmarks' timings in F "
+       << "(implies --benchmarks)" << endl
+       << "  --min-effect X      only fail benchmarks at least X slower than "
+       << "the baseline, as a fraction of its median (default 0.1)" << endl
+       << "  --alpha P           significance level for comparisons with the "
+       << "baseline (default 0.01)" << endl
+       << "  -h                  print this message and exit" << endl;
+}
+
+/**
+ * \brief parse a non-negative integer option value; returns false if the
+ *        value is missing, malformed or too large to represent.
+ */
+static bool
+parseCount(const char* s, size_t& out) {
+  if (s == NULL || *s == '\0') return false;
+  char* end = NULL;
+  errno = 0;
+  unsigned long v = std::strtoul(s, &end, 10);
+  if (*end != '\0' || s[0] == '-' || errno == ERANGE) return false;
+  out = v;
+  return true;
+}
+
+/** the most threads (or worker processes) -j may ask for; more is
+ *  certainly a mistake, and could exhaust the process's resources */
+static const size_t MAX_JOBS = 1024;
+
+/**
+ * \brief fill in opts from the command line; returns false (after printing
+ *        usage) if the command line couldn't be understood.
+ */
+static bool
+parseArgs(int argc, const char* argv[], TinyTest::RunOptions& opts) {
+  bool jobsGiven = false, repeatGiven = false, seedGiven = false;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg(argv[i]);
+    if (arg == "--list") {
+      opts.list = true;
+    } else if (arg == "--programs") {
+      if (i + 1 >= argc) {
+        cerr << "Missing value for --programs" << endl;
+        usage(argv[0]);
+        return false;
+      }
+      std::stringstream programs(argv[++i]);
+      std::string prog;
+      while (std::getline(programs, prog, ':'))
+        if (!prog.empty()) opts.programs.push_back(prog);
+    } else if (arg == "--") {
+      opts.programArgs.assign(argv + i + 1, argv + argc);
+      break;
+    } else if (arg.compare(0, 2, "-j") == 0) {
+      const char* val = arg.size() > 2 ? argv[i] + 2 :
+                        (i + 1 < argc ? argv[++i] : NULL);
+      if (!parseCount(val, opts.jobs)) {
+        cerr << "Invalid value for -j" << endl;
+        usage(argv[0]);
+        return false;
+      }
+      if (opts.jobs == 0) {
+        opts.jobs = std::thread::hardware_concurrency();
+        if (opts.jobs == 0) opts.jobs = 1;
+      }
+      opts.jobs = std::min(opts.jobs, MAX_JOBS);
+      jobsGiven = true;
+    } else if (arg == "--repeat") {
+      if (!parseCount(i + 1 < argc ? argv[++i] : NULL, opts.repeat) ||
+          opts.repeat == 0) {
+        cerr << "Invalid value for --repeat" << endl;
+        usage(argv[0]);
+        return false;
+      }
+      repeatGiven = true;
+    } else if (arg == "--until-fail") {
+      opts.untilFail = true;
+    } else if (arg == "--shuffle") {
+      opts.shuffle = true;
+    } else if (arg == "--seed") {
+      const char* val = i + 1 < argc ? argv[++i] : NULL;
+      char* end = NULL;
+      if (val != NULL) opts.seed = std::strtoull(val, &end, 10);
+      if (val == NULL || *val == '\0' || *val == '-' || *end != '\0') {
+        cerr << "Invalid value for --seed" << endl;
+        usage(argv[0]);
+        return false;
+      }
+      opts.shuffle = seedGiven = true;
+    } else if (arg == "--isolate") {
+      opts.isolate = true;
+    } else if (arg == "--resource") {
+      const char* val = i + 1 < argc ? argv[++i] : NULL;
+      const char* eq = val != NULL ? std::strchr(val, '=') : NULL;
+      char* end = NULL;
+      double x = eq != NULL ? std::strtod(eq + 1, &end) : -1;
+      if (eq == NULL || eq == val || *end != '\0' || !(x > 0)) {
+        cerr << "Invalid value for --resource" << endl;
+        usage(argv[0]);
+        return false;
+      }
+      opts.resources[std::string(val, eq)] = x;
+    } else if (arg == "--timing") {
+      opts.timing = true;
+    } else if (arg == "--counters") {
+      opts.counters = true;
+    } else if (arg == "--slowest") {
+      if (!parseCount(i + 1 < argc ? argv[++i] : NULL, opts.slowest)) {
+        cerr << "Invalid value for --slowest" << endl;
+        usage(argv[0]);
+        return false;
+      }
+    } else if (arg == "--filter") {
+      if (i + 1 >= argc) {
+        cerr << "Missing value for --filter" << endl;
+        usage(argv[0]);
+        return false;
+      }
+      std::stringstream patterns(argv[++i]);
+      std::string pat;
+      while (std::getline(patterns, pat, ':'))
+        if (!pat.empty()) opts.filters.push_back(pat);
+    } else if (arg == "--shard-index" || arg == "--shard-count") {
+      size_t& val = arg == "--shard-index" ? opts.shardIndex : opts.shardCount;
+      if (!parseCount(i + 1 < argc ? argv[++i] : NULL, val)) {
+        cerr << "Invalid value for " << arg << endl;
+        usage(argv[0]);
+        return false;
+      }
+    } else if (arg == "--shard-timings" || arg == "--save-timings") {
+      if (i + 1 >= argc) {
+        cerr << "Missing value for " << arg << endl;
+        usage(argv[0]);
+        return false;
+      }
+      (arg == "--shard-timings" ? opts.shardTimingsFile
+                                : opts.saveTimingsFile) = argv[++i];
+    } else if (arg == "--cache") {
+      if (i + 1 >= argc) {
+        cerr << "Missing value for --cache" << endl;
+        usage(argv[0]);
+        return false;
+      }
+      opts.cacheFile = argv[++i];
+    } else if (arg == "--golden") {
+      if (i + 1 >= argc) {
+        cerr << "Missing value for --golden" << endl;
+        usage(argv[0]);
+        return false;
+      }
+      opts.goldenFile = argv[++i];
+    } else if (arg == "--update-golden") {
+      opts.updateGolden = true;
+    } else if (arg == "--failed-first") {
+      opts.failedFirst = true;
+    } else if (arg == "--only-failed") {
+      opts.onlyFailed = true;
+    } else if (arg == "--longest-first") {
+      opts.longestFirst = true;
+    } else if (arg == "--reporter") {
+      if (i + 1 >= argc ||
+          !TinyTest::knownReporter(TinyTest::reporterName(argv[i + 1]))) {
+        cerr << "Invalid value for --reporter" << endl;
+        usage(argv[0]);
+        return false;
+      }
+      opts.reporters.push_back(argv[++i]);
+    } else if (arg == "--corpus" || arg == "--fuzz") {
+      if (i + 1 >= argc) {
+        cerr << "Missing value for " << arg << endl;
+        usage(argv[0]);
+        return false;
+      }
+      (arg == "--corpus" ? opts.corpusDir : opts.fuzzTarget) = argv[++i];
+      if (arg == "--corpus") opts.corpusDirGiven = true;
+    } else if (arg == "--leak-check") {
+      if (!TinyTest::countingAllocs()) {
+        cerr << "--leak-check needs allocations to be counted; compile "
+             << "TinyTest.cpp with -DTINYTEST_ALLOC_HOOKS (or "
+             << "-DTINYTEST_HOOK_MALLOC)" << endl;
+        return false;
+      }
+      opts.leakCheck = true;
+    } else if (arg == "--simd") {
+      if (i + 1 >= argc || !TinyTest::setSimdLevel(argv[++i])) {
+        cerr << "Invalid or unsupported value for --simd" << endl;
+        usage(argv[0]);
+        return false;
+      }
+    } else if (arg == "--timeout") {
+      const char* val = i + 1 < argc ? argv[++i] : NULL;
+      char* end = NULL;
+      if (val != NULL) opts.timeoutMs = std::strtod(val, &end);
+      if (val == NULL || *end != '\0' || !(opts.timeoutMs >= 0)) {
+        cerr << "Invalid value for --timeout" << endl;
+        usage(argv[0]);
+        return false;
+      }
+    } else if (arg == "--benchmarks") {
+      opts.benchmarks = true;
+    } else if (arg == "--baseline" || arg == "--update-baseline") {
+      if (i + 1 >= argc) {
+        cerr << "Missing value for " << arg << endl;
+        usage(argv[0]);
+        return false;
+      }
+      std::string& file = arg == "--baseline" ? opts.baselineFile
+                                              : opts.updateBaselineFile;
+      file = argv[++i];
+      if (arg == "--baseline" && !std::ifstream(file.c_str())) {
+        cerr << "Couldn't read the baseline " << file << endl;
+        return false;
+      }
+      opts.benchmarks = true;
+    } else if (arg == "--min-effect" || arg == "--alpha") {
+      const char* val = i + 1 < argc ? argv[++i] : NULL;
+      char* end = NULL;
+      double x = val != NULL ? std::strtod(val, &end) : -1;
+      if (val == NULL || *end != '\0' || !(x >= 0) ||
+          (arg == "--alpha" && !(x > 0 && x < 1))) {
+        cerr << "Invalid value for " << arg << endl;
+        usage(argv[0]);
+        return false;
+      }
+      (arg == "--alpha" ? opts.alpha : opts.minEffect) = x;
+    } else if (arg == "--benchmark-time") {
+      const char* val = i + 1 < argc ? argv[++i] : NULL;
+      char* end = NULL;
+      if (val != NULL) opts.benchmarkTime = std::strtod(val, &end);
+      if (val == NULL || *end != '\0' || !(opts.benchmarkTime > 0)) {
+        cerr << "Invalid value for --benchmark-time" << endl;
+        usage(argv[0]);
+        return false;
+      }
+    } else {
+      if (arg != "-h" && arg != "--help")
+        cerr << "Unrecognised option: " << arg << endl;
+      usage(argv[0]);
+      return false;
+    }
+  }
+  if (opts.shardCount == 0 || opts.shardIndex >= opts.shardCount) {
+    cerr << "--shard-index must be less than --shard-count" << endl;
+    usage(argv[0]);
+    return false;
+  }
+  if ((opts.failedFirst || opts.onlyFailed || opts.longestFirst) &&
+      opts.cacheFile.empty()) {
+    cerr << "--failed-first, --only-failed and --longest-first need --cache"
+         << endl;
+    usage(argv[0]);
+    return false;
+  }
+  if (opts.untilFail && !repeatGiven) opts.repeat = 0;
+  // under make -j, the jobserver's free slots are the limit rather than -j
+  if ((opts.repeat != 1 || opts.untilFail ||
+       TinyTest::JobServer::get().active()) && !jobsGiven) {
+    opts.jobs = std::thread::hardware_concurrency();
+    if (opts.jobs == 0) opts.jobs = 1;
+  }
+  if (opts.shuffle && !seedGiven) {
+    std::random_device entropy;
+    opts.seed = uint64_t(entropy()) << 32 | entropy();
+  }
+  return true;
+}
+
+/**
+ * \brief run the tests (or the programs) as opts say, returning the exit
+ *        status for the run.
+ */
+static int
+runTests(const TinyTest::RunOptions& opts) {
+  if (!opts.programs.empty())
+    return TinyTest::runPrograms(opts) ? EXIT_SUCCESS : EXIT_FAILURE;
+  if (!TestSet::getTestSet().run(opts)) return EXIT_FAILURE;
+  return EXIT_SUCCESS;
+}
+
+#ifdef TINYTEST_FUZZER
+/**
+ * \brief libFuzzer's main function calls this before it reads its own
+ *        options. Unless we've been asked to fuzz, it runs the tests as
+ *        main would and exits. Otherwise, it chooses the target and replaces
+ *        the command line with the one for libFuzzer: the arguments after
+ *        --, and the target's corpus directory if none was given.
+ */
+extern "C" int
+LLVMFuzzerInitialize(int* argc, char*** argv) {
+  const char* inherited = getenv("TINYTEST_FUZZ_TARGET");
+  if (inherited != NULL) {
+    if (!TinyTest::startFuzzing(inherited)) std::exit(EXIT_FAILURE);
+    return 0;
+  }
+  TinyTest::RunOptions opts;
+  if (!parseArgs(*argc, const_cast<const char**>(*argv), opts))
+    std::exit(EXIT_FAILURE);
+  if (opts.fuzzTarget.empty()) std::exit(runTests(opts));
+  TinyTest::setCorpusDir(opts.corpusDir, opts.corpusDirGiven);
+  if (!TinyTest::startFuzzing(opts.fuzzTarget)) std::exit(EXIT_FAILURE);
+
+  static std::vector<std::string> args;
+  static std::vector<char*> ptrs;
+  args.assign(1, (*argv)[0]);
+  args.insert(args.end(), opts.programArgs.begin(), opts.programArgs.end());
+  bool corpusGiven = false;
+  for (size_t i = 1; i < args.size(); ++i)
+    corpusGiven = corpusGiven || args[i][0] != '-';
+  if (!corpusGiven) {
+    // libFuzzer adds what it finds to the corpus, so it has to exist
+    const std::string dir = TinyTest::corpusFor(opts.fuzzTarget);
+    mkdir(opts.corpusDir.c_str(), 0777);
+    mkdir(dir.c_str(), 0777);
+    args.push_back(dir);
+  }
+  for (size_t i = 0; i < args.size(); ++i) ptrs.push_back(&args[i][0]);
+  ptrs.push_back(NULL);
+  *argc = args.size();
+  *argv = &ptrs[0];
+  return 0;
+}
+#else
 /**
  * \brief A main function that will run all of the tests that TinyTest has
  *        discovered in any object files that are linked with this.
- * \param argc Number of command line arguments. This is ignored.
- * \param argv Command line arguments as c-strings. This is ignored.
+ * \param argc Number of command line arguments.
+ * \param argv Command line arguments as c-strings; see usage().
  */
 int 
 main(int argc, const char* argv[]) {
-	cout << "RUNNING UNIT TESTS" << endl;
-  if (!TestSet::getTestSet().run()) return EXIT_FAILURE;
-  return EXIT_SUCCESS;
+  TinyTest::RunOptions opts;
+  if (!parseArgs(argc, argv, opts)) return EXIT_FAILURE;
+  if (!opts.fuzzTarget.empty()) {
+    cerr << "--fuzz needs TinyTest built for libFuzzer: compile with clang "
+         << "using -fsanitize=fuzzer -DTINYTEST_FUZZER" << endl;
+    return EXIT_FAILURE;
+  }
+  return runTests(opts);
 }
-
+#endif
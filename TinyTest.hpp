@@ -37,6 +37,27 @@
 #include <sstream>
 #include <cassert>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <iterator>
+#include <limits>
+#include <type_traits>
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+
+// TEST_ASYNC needs C++20 coroutines; without them, it isn't defined
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define TINYTEST_HAS_COROUTINES 1
+#endif
+#endif
 
 /******************************************************************************
  **                               CONSTANTS                                  **
@@ -45,6 +66,276 @@
    static const double DEF_TOLERANCE = 1e-20;
  }
 
+/**
+ * \brief Mark the functions that build failure messages as rarely called
+ *        and never inlined, so that each check compiles to the comparison
+ *        and a call on an unlikely branch, and the formatting code is kept
+ *        out of the tests' hot code (and only compiled once per type).
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define TINYTEST_COLD __attribute__((noinline, cold))
+#define TINYTEST_UNLIKELY(X) __builtin_expect(!!(X), 0)
+#else
+#define TINYTEST_COLD
+#define TINYTEST_UNLIKELY(X) (X)
+#endif
+
+namespace TinyTest {
+  /**
+   * \brief Options that control how a TestSet is run. The driver in
+   *        TinyTest.cpp fills these in from the command line; the defaults
+   *        reproduce a plain serial run.
+   */
+  struct RunOptions {
+    /** \brief construct the default options (run serially) */
+    RunOptions() : list(false), leakCheck(false), jobs(1), isolate(false),
+                   benchmarks(false), benchmarkTime(0.5), timing(false),
+                   slowest(10), shardIndex(0), shardCount(1), minEffect(0.1),
+                   alpha(0.01), timeoutMs(0), failedFirst(false),
+                   onlyFailed(false), longestFirst(false),
+                   updateGolden(false), repeat(1), untilFail(false),
+                   shuffle(false), seed(0), counters(false),
+                   corpusDir("corpus"), corpusDirGiven(false) {;}
+
+    /** print the names of the selected tests instead of running them */
+    bool list;
+
+    /** fail any test that passes but doesn't free everything it allocated
+     *  (on the thread that ran it) */
+    bool leakCheck;
+
+    /** number of worker threads to run tests on; 1 means run serially */
+    size_t jobs;
+
+    /** run each test in one of a pool of forked worker processes (jobs of
+     *  them) so that a crashing test can't take down the whole run */
+    bool isolate;
+
+    /** run the benchmarks (after the tests); they're skipped otherwise */
+    bool benchmarks;
+
+    /** roughly how long to spend measuring each benchmark, in seconds */
+    double benchmarkTime;
+
+    /** measure the time and resources used by each test, add them to the
+     *  result lines and finish with a summary of the slowest tests */
+    bool timing;
+
+    /** how many tests to list in the summary of slowest tests */
+    size_t slowest;
+
+    /** glob patterns (* and ?) selecting the tests to run by name; a test is
+     *  run if it matches any pattern not starting with '-' (or there are no
+     *  such patterns) and doesn't match any pattern that does */
+    std::vector<std::string> filters;
+
+    /** run only the tests in shard shardIndex of shardCount */
+    size_t shardIndex, shardCount;
+
+    /** durations from a previous run (see saveTimingsFile) used to balance
+     *  the shards; if empty, tests are dealt out round-robin */
+    std::string shardTimingsFile;
+
+    /** if not empty, write the wall time of each test here after the run */
+    std::string saveTimingsFile;
+
+    /** the reporters to send results to, each "NAME" or "NAME:FILE" where
+     *  NAME is console, tap, junit or json; they write to stdout unless a
+     *  FILE is given. If empty, just the console reporter is used. */
+    std::vector<std::string> reporters;
+
+    /** if not empty, compare the benchmarks with the timings recorded here,
+     *  failing any that are significantly slower */
+    std::string baselineFile;
+
+    /** if not empty, record the benchmarks' timings here after the run */
+    std::string updateBaselineFile;
+
+    /** the smallest slowdown, as a fraction of the baseline median, that
+     *  fails a benchmark; smaller ones are put down to noise */
+    double minEffect;
+
+    /** the significance level of the comparison with the baseline */
+    double alpha;
+
+    /** the time limit for tests that don't set their own, in ms; 0 means
+     *  no limit. A test that runs out of time in a worker process is
+     *  killed; one running in this process can't be, so the run is cut
+     *  short after reporting the results so far. */
+    double timeoutMs;
+
+    /** if not empty, the file that remembers whether each test passed and
+     *  how long it took; it's read before the run and updated after it */
+    std::string cacheFile;
+
+    /** run the tests that failed last time (according to cacheFile) first */
+    bool failedFirst;
+
+    /** run only the tests that failed last time, or all of them if none
+     *  did */
+    bool onlyFailed;
+
+    /** run the tests that took longest last time first, so that a slow one
+     *  doesn't hold up the end of a parallel run */
+    bool longestFirst;
+
+    /** if not empty, compare what the reporters write to stdout with this
+     *  file instead of printing it; the run then passes if it matches */
+    std::string goldenFile;
+
+    /** rewrite golden files (goldenFile and those checked by
+     *  EXPECT_FILE_EQUAL and EXPECT_OUTPUT_MATCHES_FILE) instead of
+     *  comparing with them */
+    bool updateGolden;
+
+    /** if not empty, run these TinyTest programs (up to jobs of them at
+     *  once) instead of our own tests, and report all of their results
+     *  together; a directory stands for the TinyTest programs in it */
+    std::vector<std::string> programs;
+
+    /** the arguments to give each of the programs, or libFuzzer (see
+     *  fuzzTarget) */
+    std::vector<std::string> programArgs;
+
+    /** how much there is of each resource that tests can ask for with
+     *  TEST_RESOURCES; there's 1 of any resource not listed, except memory,
+     *  of which there's as many MB as the machine has */
+    std::map<std::string, double> resources;
+
+    /** how many times to run the tests, spreading the runs across the jobs
+     *  workers; each test is then reported once, failing if any of its runs
+     *  did. 0 means no limit (only allowed with untilFail). */
+    size_t repeat;
+
+    /** stop repeating the tests once any of them has failed */
+    bool untilFail;
+
+    /** run the tests in a random order determined by seed; when repeating
+     *  them, the n'th time through (counting from 0) uses seed + n */
+    bool shuffle;
+
+    /** the seed for shuffle */
+    uint64_t seed;
+
+    /** count the cycles, instructions, cache misses, branch misses and page
+     *  faults of each test and benchmark with the CPU's performance
+     *  counters (on Linux), and add them to the results */
+    bool counters;
+
+    /** the directory holding the corpora of the fuzz tests (see FUZZ_TEST);
+     *  each test's inputs are the files in the subdirectory named after it */
+    std::string corpusDir;
+
+    /** true if corpusDir was given (with --corpus) rather than left as the
+     *  default; if so, it's an error for it not to exist */
+    bool corpusDirGiven;
+
+    /** if not empty, hand the fuzz test of this name to libFuzzer instead of
+     *  running the tests; this needs TinyTest built for libFuzzer */
+    std::string fuzzTarget;
+  };
+
+  /** \brief The events counted with RunOptions::counters */
+  enum Counter {
+    CYCLES, INSTRUCTIONS, CACHE_MISSES, BRANCH_MISSES, PAGE_FAULTS,
+    N_COUNTERS
+  };
+
+  /**
+   * \brief The time and resources used while running a single test; only
+   *        collected when RunOptions::timing (or counters) is set. CPU time,
+   *        context switches and counters are for the thread that ran the
+   *        test where the platform supports that; the resident set size is
+   *        always for the process.
+   */
+  struct ResourceUsage {
+    ResourceUsage() : wallMs(0), userMs(0), sysMs(0), maxRssKb(0),
+                      rssGrowthKb(0), voluntarySwitches(0),
+                      involuntarySwitches(0), counted(false) {
+      for (size_t k = 0; k < N_COUNTERS; ++k) counters[k] = -1;
+    }
+    /** elapsed wall-clock time, in milliseconds */
+    double wallMs;
+    /** user and system CPU time, in milliseconds */
+    double userMs, sysMs;
+    /** peak resident set size once the test finished, and how much the
+     *  peak grew while it ran, in kilobytes */
+    long maxRssKb, rssGrowthKb;
+    /** context switches made while running the test */
+    long voluntarySwitches, involuntarySwitches;
+    /** true if the performance counters were read (RunOptions::counters) */
+    bool counted;
+    /** what each Counter counted while the test ran; -1 for those that
+     *  couldn't be counted */
+    int64_t counters[N_COUNTERS];
+  };
+
+  /** \brief What a Reporter is told about a single test or benchmark */
+  struct TestEvent {
+    TestEvent() : index(0), benchmark(false), passed(false),
+                  measured(false) {;}
+    /** the name of the test */
+    std::string name;
+    /** its position in the run, counting from 0; tests come before
+     *  benchmarks and are otherwise in registration order */
+    size_t index;
+    /** true if this is a benchmark rather than a test */
+    bool benchmark;
+    /** did the test pass? Only meaningful once it has finished */
+    bool passed;
+    /** the reason the test failed; empty if it passed */
+    std::string reason;
+    /** true if usage was collected for this test */
+    bool measured;
+    /** what the test used; only meaningful if measured is true */
+    ResourceUsage usage;
+    /** the timings for a benchmark that ran successfully */
+    std::string benchmarkStats;
+  };
+
+  /** \brief What a Reporter is told at the end of a run */
+  struct RunSummary {
+    RunSummary() : tests(0), failures(0), notRun(0), wallMs(0) {;}
+    /** how many tests and benchmarks were run, and how many failed */
+    size_t tests, failures;
+    /** how many weren't run because the run was abandoned part-way
+     *  through (when a test ran out of time) */
+    size_t notRun;
+    /** how long the whole run took, in milliseconds */
+    double wallMs;
+  };
+
+  /**
+   * \brief The interface for the formatters of test results. Each method
+   *        appends whatever the reporter wants to write to out; a background
+   *        thread does the actual writing, so reporters never do I/O
+   *        themselves and are only ever called from that one thread. For
+   *        each test, testStarted is called, then assertionFailed if it
+   *        failed, then testFinished; with -j or --isolate a test is only
+   *        reported once it (and every test before it) has finished.
+   */
+  class Reporter {
+  public:
+    virtual ~Reporter() {;}
+    /** \brief the run is starting; names are the tests to be run, in order */
+    virtual void runStarted(const std::vector<std::string>& names,
+                            std::string& out) {;}
+    /** \brief a test is starting */
+    virtual void testStarted(const TestEvent& test, std::string& out) {;}
+    /** \brief a test failed, for the given reason */
+    virtual void assertionFailed(const TestEvent& test,
+                                 const std::string& message,
+                                 std::string& out) {;}
+    /** \brief a test has finished */
+    virtual void testFinished(const TestEvent& test, std::string& out) {;}
+    /** \brief every test has finished */
+    virtual void runFinished(const RunSummary& summary, std::string& out) {;}
+  };
+
+  class ReportPipeline;
+  struct TestSample;
+}
+
 /******************************************************************************
  **                            HELPER FUNCTIONS                              **
  ******************************************************************************/
@@ -54,14 +345,41 @@ namespace TinyTest {
    *        of type T.
    */
   template<typename T>
-  std::string vecToString(T t) {
+  std::string vecToString(const T& t) {
     std::stringstream ss;
-    for (size_t i = 0; i < t.size(); ++i) {
+    const size_t n = t.size();
+    for (size_t i = 0; i < n; ++i) {
       if (i != 0) ss << ", ";
       ss << t[i];
     }
     return ss.str();
   }
+
+  /** number of elements either side of a mismatch shown in failure messages
+   *  for container comparisons */
+  static const size_t CONTEXT_WINDOW = 3;
+
+  /**
+   * \brief create a string representation of the elements of random access
+   *        container t that are within CONTEXT_WINDOW of index i, marking any
+   *        elements left out with "...", each formatted by match.
+   */
+  template<typename T, typename Match>
+  std::string windowToString(const T& t, size_t n, size_t i,
+                             const Match& match) {
+    size_t from = i > CONTEXT_WINDOW ? i - CONTEXT_WINDOW : 0;
+    size_t to = std::min(n, i + CONTEXT_WINDOW + 1);
+    std::stringstream ss;
+    ss << "[";
+    if (from > 0) ss << "..., ";
+    for (size_t j = from; j < to; ++j) {
+      if (j != from) ss << ", ";
+      ss << match.show(t[j]);
+    }
+    if (to < n) ss << (to > from ? ", ..." : "...");
+    ss << "]";
+    return ss.str();
+  }
 }
 
 /******************************************************************************
@@ -89,6 +407,644 @@ private:
   std::string msg;
 };
 
+namespace TinyTest {
+  /**
+   * \brief The checks behind the EXPECT_* macros. Each operand is evaluated
+   *        exactly once, by the macro, and bound here by reference, so
+   *        neither expensive expressions nor large containers are evaluated
+   *        or copied again to build the failure message.
+   */
+
+  /** \brief x, formatted for a failure message with operator<< */
+  template<typename T>
+  TINYTEST_COLD std::string describeValue(const T& x) {
+    std::stringstream ss;
+    ss << x;
+    return ss.str();
+  }
+
+  /** \brief throw the TinyTestException for a failed comparison of a and b
+   *         (already formatted) on line of file; detail is added after the
+   *         operands. Defined in TinyTest.cpp. */
+  [[noreturn]] TINYTEST_COLD
+  void failComparison(const char* macro, const std::string& a,
+                      const std::string& b, const std::string& detail,
+                      int line, const char* file);
+
+  /** \brief throw the TinyTestException for a failed comparison of a and b */
+  template<typename A, typename B>
+  [[noreturn]] TINYTEST_COLD
+  void failCompare(const char* macro, const A& a, const B& b, int line,
+                   const char* file) {
+    failComparison(macro, describeValue(a), describeValue(b), "", line, file);
+  }
+
+  /** \brief throw the TinyTestException for a failed comparison of a and b
+   *         with tolerance tol */
+  template<typename A, typename B, typename T>
+  [[noreturn]] TINYTEST_COLD
+  void failNear(const char* macro, const A& a, const B& b, const T& tol,
+                int line, const char* file) {
+    failComparison(macro, describeValue(a), describeValue(b),
+                   " with tolerance of " + describeValue(tol), line, file);
+  }
+
+  /** \brief throw a TinyTestException unless a == b (using !=) */
+  template<typename A, typename B>
+  inline void expectEqual(const A& a, const B& b, int line,
+                          const char* file) {
+    if (TINYTEST_UNLIKELY(a != b))
+      failCompare("EXPECT_EQUAL", a, b, line, file);
+  }
+
+  /** \brief throw a TinyTestException if a == b */
+  template<typename A, typename B>
+  inline void expectNotEqual(const A& a, const B& b, int line,
+                             const char* file) {
+    if (TINYTEST_UNLIKELY(a == b))
+      failCompare("EXPECT_NOT_EQUAL", a, b, line, file);
+  }
+
+  /** \brief throw a TinyTestException if a and b differ by more than tol;
+   *         macro is the name of the macro to report */
+  template<typename A, typename B, typename T>
+  inline void expectNear(const char* macro, const A& a, const B& b,
+                         const T& tol, int line, const char* file) {
+    if (TINYTEST_UNLIKELY(std::fabs(a - b) > tol))
+      failNear(macro, a, b, tol, line, file);
+  }
+
+  /** \brief throw the TinyTestException for an EXPECT_THROWS whose code,
+   *         func, didn't throw exception. Defined in TinyTest.cpp. */
+  [[noreturn]] TINYTEST_COLD
+  void failThrows(const char* exception, const char* func, int line,
+                  const char* file);
+
+  /**
+   * \brief A read-only view of n contiguous elements, so that raw arrays can
+   *        be passed to the container comparison macros:
+   *
+   *            EXPECT_EQUAL_STL_CONTAINER(TinyTest::span(p, n), expected);
+   */
+  template<typename T>
+  class Span {
+  public:
+    /** \brief view the n elements starting at data */
+    Span(const T* data, size_t n) : ptr(data), n(n) {;}
+    /** \brief number of elements in the view */
+    size_t size() const { return n; }
+    /** \brief the element at index i */
+    const T& operator[](size_t i) const { return ptr[i]; }
+    /** \brief pointer to the first element */
+    const T* data() const { return ptr; }
+  private:
+    const T* ptr;
+    size_t n;
+  };
+
+  /** \brief make a Span of the n elements starting at data */
+  template<typename T>
+  Span<T> span(const T* data, size_t n) { return Span<T>(data, n); }
+
+  /** \brief how floating point elements are compared by the containers
+   *         comparison macros */
+  enum Comparison {
+    /** elements must not differ according to != (so NaN never matches) */
+    COMPARE_EXACT,
+    /** |a - b| must not exceed the tolerance */
+    COMPARE_ABSOLUTE,
+    /** |a - b| must not exceed the tolerance times |a| or |b| */
+    COMPARE_RELATIVE,
+    /** a and b must be no more than the tolerance representable values
+     *  apart (units in the last place); NaN never matches */
+    COMPARE_ULPS
+  };
+
+  /** \brief map a double onto an integer scale on which adjacent doubles
+   *         are adjacent integers (and -0 and +0 are the same) */
+  inline int64_t orderedBits(double x) {
+    int64_t b;
+    std::memcpy(&b, &x, sizeof(b));
+    return b < 0 ? -(b & INT64_MAX) : b;
+  }
+
+  /** \brief map a float onto an integer scale on which adjacent floats
+   *         are adjacent integers (and -0 and +0 are the same) */
+  inline int32_t orderedBits(float x) {
+    int32_t b;
+    std::memcpy(&b, &x, sizeof(b));
+    return b < 0 ? -(b & INT32_MAX) : b;
+  }
+
+  /** \brief how many representable values apart a and b are */
+  template<typename T>
+  uint64_t ulpDistance(T a, T b) {
+    int64_t x = orderedBits(a), y = orderedBits(b);
+    return x > y ? uint64_t(x) - uint64_t(y) : uint64_t(y) - uint64_t(x);
+  }
+
+  /**
+   * \brief Find the first index i < n at which a[i] and b[i] don't match
+   *        under the given comparison (tol is the tolerance, or the number
+   *        of ULPs); returns n if they all match. These use SSE2, AVX2 or
+   *        AVX-512 when the CPU has them, and are what the container
+   *        macros use for vectors, arrays and spans of float and double.
+   *        Defined in TinyTest.cpp.
+   */
+  size_t firstMismatch(const double* a, const double* b, size_t n,
+                       Comparison c, double tol);
+  size_t firstMismatch(const float* a, const float* b, size_t n,
+                       Comparison c, double tol);
+
+  /** \brief find the first of n elements of the given size that differ
+   *         bytewise between a and b; returns n if there are none.
+   *         Defined in TinyTest.cpp. */
+  size_t firstMismatchBytes(const void* a, const void* b, size_t n,
+                            size_t size);
+
+  /** \brief how the element comparisons format elements for failure
+   *         messages, unless they say otherwise: as operator<< does */
+  struct ElementsShownPlainly {
+    template<typename X>
+    std::string show(const X& x) const { return describeValue(x); }
+  };
+
+  /** \brief element comparison for EXPECT_EQUAL_STL_CONTAINER */
+  struct ElementsEqual : ElementsShownPlainly {
+    static const Comparison comparison = COMPARE_EXACT;
+    double tolerance() const { return 0; }
+    std::string describe() const { return ""; }
+    template<typename X, typename Y>
+    bool operator()(const X& x, const Y& y) const { return !(x != y); }
+  };
+
+  /** \brief element comparison for EXPECT_NEAR_STL_CONTAINER */
+  struct ElementsNear : ElementsShownPlainly {
+    explicit ElementsNear(double tol) : tol(tol) {;}
+    static const Comparison comparison = COMPARE_ABSOLUTE;
+    double tolerance() const { return tol; }
+    std::string describe() const {
+      std::stringstream ss;
+      ss << " with tolerance of " << tol;
+      return ss.str();
+    }
+    template<typename X, typename Y>
+    bool operator()(const X& x, const Y& y) const {
+      return !(std::fabs(x - y) > tol);
+    }
+    double tol;
+  };
+
+  /** \brief element comparison for EXPECT_NEAR_RELATIVE_STL_CONTAINER; the
+   *         arithmetic is done in the elements' own type */
+  struct ElementsNearRelative : ElementsShownPlainly {
+    explicit ElementsNearRelative(double tol) : tol(tol) {;}
+    static const Comparison comparison = COMPARE_RELATIVE;
+    double tolerance() const { return tol; }
+    std::string describe() const {
+      std::stringstream ss;
+      ss << " with relative tolerance of " << tol;
+      return ss.str();
+    }
+    template<typename X, typename Y>
+    bool operator()(const X& x, const Y& y) const {
+      typedef typename std::common_type<X, Y>::type T;
+      T d = std::fabs(T(x) - T(y)), t = T(tol);
+      return !(d > t * std::fabs(T(x)) && d > t * std::fabs(T(y)));
+    }
+    double tol;
+  };
+
+  /** \brief element comparison for EXPECT_NEAR_ULPS_STL_CONTAINER */
+  struct ElementsWithinUlps {
+    explicit ElementsWithinUlps(uint64_t ulps) : ulps(ulps) {;}
+    static const Comparison comparison = COMPARE_ULPS;
+    double tolerance() const { return double(ulps); }
+    std::string describe() const {
+      std::stringstream ss;
+      ss << " within " << ulps << " ULPs";
+      return ss.str();
+    }
+    /** \brief values a few ULPs apart usually look the same at the default
+     *         precision, so they're shown with enough digits to tell them
+     *         apart */
+    template<typename X>
+    std::string show(const X& x) const {
+      std::stringstream ss;
+      ss.precision(std::numeric_limits<X>::max_digits10);
+      ss << x;
+      return ss.str();
+    }
+    template<typename X, typename Y>
+    bool operator()(const X& x, const Y& y) const {
+      typedef typename std::common_type<X, Y>::type T;
+      T tx(x), ty(y);
+      return !(tx != tx || ty != ty || ulpDistance(tx, ty) > ulps);
+    }
+    uint64_t ulps;
+  };
+
+  /** \brief the element type of containers known to store their elements
+   *         contiguously; void for everything else */
+  template<typename C> struct ContiguousElements { typedef void type; };
+  template<typename T, typename Alloc>
+  struct ContiguousElements<std::vector<T, Alloc> > { typedef T type; };
+  template<typename T, size_t N>
+  struct ContiguousElements<std::array<T, N> > { typedef T type; };
+  template<typename T>
+  struct ContiguousElements<Span<T> > { typedef T type; };
+
+  /** \brief can the kernels compare elements of type T this way? */
+  template<typename T, Comparison C>
+  struct KernelCompares : std::integral_constant<bool,
+    std::is_same<T, double>::value || std::is_same<T, float>::value ||
+    (C == COMPARE_EXACT && std::is_integral<T>::value &&
+     !std::is_same<T, bool>::value)> {};
+
+  /** \brief pass contiguous floating point data on to the kernels */
+  inline size_t kernelFirstMismatch(const double* a, const double* b,
+                                    size_t n, Comparison c, double tol) {
+    return firstMismatch(a, b, n, c, tol);
+  }
+  inline size_t kernelFirstMismatch(const float* a, const float* b,
+                                    size_t n, Comparison c, double tol) {
+    return firstMismatch(a, b, n, c, tol);
+  }
+
+  /** \brief integers are equal exactly when their bytes are */
+  template<typename T>
+  size_t kernelFirstMismatch(const T* a, const T* b, size_t n,
+                             Comparison, double) {
+    return firstMismatchBytes(a, b, n, sizeof(T));
+  }
+
+  /** \brief find the first mismatch by comparing elements one at a time */
+  template<typename A, typename B, typename Match>
+  size_t firstMismatchIn(const A& a, const B& b, size_t n,
+                         const Match& match, std::false_type) {
+    size_t i = 0;
+    while (i < n && match(a[i], b[i])) ++i;
+    return i;
+  }
+
+  /** \brief find the first mismatch using the vectorised kernels */
+  template<typename A, typename B, typename Match>
+  size_t firstMismatchIn(const A& a, const B& b, size_t n,
+                         const Match& match, std::true_type) {
+    return kernelFirstMismatch(a.data(), b.data(), n, Match::comparison,
+                               match.tolerance());
+  }
+
+  /** \brief find the first index at which a and b don't match, using the
+   *         kernels when both are contiguous containers of the same
+   *         element type the kernels can handle */
+  template<typename A, typename B, typename Match>
+  size_t firstMismatchIn(const A& a, const B& b, size_t n,
+                         const Match& match) {
+    typedef typename std::remove_cv<
+      typename ContiguousElements<A>::type>::type TA;
+    typedef typename std::remove_cv<
+      typename ContiguousElements<B>::type>::type TB;
+    return firstMismatchIn(a, b, n, match, std::integral_constant<bool,
+      std::is_same<TA, TB>::value &&
+      KernelCompares<TA, Match::comparison>::value>());
+  }
+
+  /**
+   * \brief throw the TinyTestException for a failed container comparison,
+   *        whose first mismatch is at index first (or which differ in size
+   *        if that's the end of the shorter one)
+   */
+  template<typename A, typename B, typename Match>
+  [[noreturn]] TINYTEST_COLD
+  void failContainer(const char* macro, const A& a, const B& b,
+                     const Match& match, size_t first, int line,
+                     const char* file) {
+    const size_t na = a.size(), nb = b.size(), n = std::min(na, nb);
+    size_t mismatches = 0;
+    for (size_t i = first; i < n; ++i)
+      if (!match(a[i], b[i])) ++mismatches;
+    std::stringstream ss;
+    ss << macro << " failed on ";
+    if (first < n) {
+      ss << "comparison of " << match.show(a[first]) << " and "
+         << match.show(b[first])
+         << match.describe() << " at index " << first << " on line " << line
+         << " of " << file << "; " << mismatches << " of " << n
+         << " elements differ";
+      if (na != nb) ss << " and containers have unequal sizes (" << na
+                       << " and " << nb << ")";
+    } else {
+      ss << "comparison of containers on line " << line << " of " << file
+         << "; Containers have unequal sizes (" << na << " and " << nb
+         << ")";
+    }
+    ss << ". Contents near index " << first << ": "
+       << windowToString(a, na, first, match) << " and "
+       << windowToString(b, nb, first, match);
+    throw TinyTestException(ss.str());
+  }
+
+  /**
+   * \brief throw a TinyTestException unless random access containers a and
+   *        b have the same size and match(a[i], b[i]) for every i. The
+   *        failure message shows the first mismatch, a few elements either
+   *        side of it from each container and how many elements mismatch in
+   *        total; macro is the name of the macro to report.
+   */
+  template<typename A, typename B, typename Match>
+  inline void expectContainer(const char* macro, const A& a, const B& b,
+                              const Match& match, int line,
+                              const char* file) {
+    const size_t na = a.size(), nb = b.size(), n = std::min(na, nb);
+    size_t first = firstMismatchIn(a, b, n, match);
+    if (TINYTEST_UNLIKELY(first != n || na != nb))
+      failContainer(macro, a, b, match, first, line, file);
+  }
+
+  /**
+   * \brief The elements from begin up to end, so that iterator pairs can be
+   *        passed to the range comparison macros:
+   *
+   *            EXPECT_EQUAL_RANGE(TinyTest::range(first, last), expected);
+   */
+  template<typename It, typename End = It>
+  class IteratorRange {
+  public:
+    /** \brief view the elements from begin up to end */
+    IteratorRange(It begin, End end) : from(begin), to(end) {;}
+    /** \brief iterator to the first element */
+    It begin() const { return from; }
+    /** \brief iterator (or sentinel) past the last element */
+    End end() const { return to; }
+  private:
+    It from;
+    End to;
+  };
+
+  /** \brief make an IteratorRange of the elements from begin up to end */
+  template<typename It, typename End>
+  IteratorRange<It, End> range(It begin, End end) {
+    return IteratorRange<It, End>(begin, end);
+  }
+
+  /**
+   * \brief The last CONTEXT_WINDOW elements a range comparison has got past,
+   *        so a failure can show what came before the mismatch. Elements
+   *        of multi-pass ranges are read again through an iterator kept
+   *        that far behind; this is the version for those.
+   */
+  template<typename It, bool MultiPass = std::is_base_of<
+    std::forward_iterator_tag,
+    typename std::iterator_traits<It>::iterator_category>::value>
+  class RecentElements {
+  public:
+    explicit RecentElements(const It& begin) : start(begin), kept(0) {;}
+    /** \brief the comparison got past the element at it */
+    void passed(const It&) {
+      if (kept == CONTEXT_WINDOW) ++start;
+      else ++kept;
+    }
+    /** \brief the kept elements, formatted for a failure message by match */
+    template<typename Match>
+    std::vector<std::string> describe(const Match& match) const {
+      std::vector<std::string> res;
+      It it = start;
+      for (size_t i = 0; i < kept; ++i, ++it) res.push_back(match.show(*it));
+      return res;
+    }
+  private:
+    It start;
+    size_t kept;
+  };
+
+  /** \brief single-pass ranges can't be read again, so copies of their
+   *         recent elements are kept instead */
+  template<typename It>
+  class RecentElements<It, false> {
+  public:
+    explicit RecentElements(const It&) {;}
+    void passed(const It& it) {
+      if (kept.size() == CONTEXT_WINDOW) kept.pop_front();
+      kept.push_back(*it);
+    }
+    template<typename Match>
+    std::vector<std::string> describe(const Match& match) const {
+      std::vector<std::string> res;
+      for (size_t i = 0; i < kept.size(); ++i)
+        res.push_back(match.show(kept[i]));
+      return res;
+    }
+  private:
+    std::deque<typename std::iterator_traits<It>::value_type> kept;
+  };
+
+  /** \brief the elements of a range near a mismatch, in the same form as
+   *         windowToString: elements before and after are marked "..." */
+  TINYTEST_COLD inline
+  std::string windowToString(const std::vector<std::string>& elements,
+                             bool before, bool after) {
+    std::stringstream ss;
+    ss << "[";
+    if (before) ss << "..., ";
+    for (size_t j = 0; j < elements.size(); ++j) {
+      if (j != 0) ss << ", ";
+      ss << elements[j];
+    }
+    if (after) ss << (elements.empty() ? "..." : ", ...");
+    ss << "]";
+    return ss.str();
+  }
+
+  /**
+   * \brief throw the TinyTestException for a failed range comparison whose
+   *        first mismatch is at index first, where ia and ib are (or which
+   *        differ in length if one of them has ended there). The rest of
+   *        both ranges is read to count the mismatches and find their
+   *        lengths, keeping only CONTEXT_WINDOW elements past first.
+   */
+  template<typename IA, typename EA, typename IB, typename EB,
+           typename HA, typename HB, typename Match>
+  [[noreturn]] TINYTEST_COLD
+  void failRange(const char* macro, IA ia, const EA& ea, IB ib,
+                 const EB& eb, const HA& recentA, const HB& recentB,
+                 const Match& match, size_t first, int line,
+                 const char* file) {
+    std::vector<std::string> nearA = recentA.describe(match);
+    std::vector<std::string> nearB = recentB.describe(match);
+    const bool before = first > CONTEXT_WINDOW;
+    bool afterA = false, afterB = false;
+    std::string firstA, firstB;
+    size_t na = first, nb = first, mismatches = 0;
+    for (size_t i = first; !(ia == ea) || !(ib == eb); ++i) {
+      const bool hasA = !(ia == ea), hasB = !(ib == eb);
+      if (hasA && hasB && !match(*ia, *ib)) ++mismatches;
+      if (i == first && hasA && hasB) {
+        firstA = match.show(*ia);
+        firstB = match.show(*ib);
+      }
+      const bool shown = i <= first + CONTEXT_WINDOW;
+      if (hasA) {
+        if (shown) nearA.push_back(match.show(*ia));
+        else afterA = true;
+        ++ia;
+        ++na;
+      }
+      if (hasB) {
+        if (shown) nearB.push_back(match.show(*ib));
+        else afterB = true;
+        ++ib;
+        ++nb;
+      }
+    }
+    const size_t n = std::min(na, nb);
+    std::stringstream ss;
+    ss << macro << " failed on ";
+    if (first < n) {
+      ss << "comparison of " << firstA << " and " << firstB
+         << match.describe() << " at index " << first << " on line " << line
+         << " of " << file << "; " << mismatches << " of " << n
+         << " elements differ";
+      if (na != nb) ss << " and ranges have unequal lengths (" << na
+                       << " and " << nb << ")";
+    } else {
+      ss << "comparison of ranges on line " << line << " of " << file
+         << "; Ranges have unequal lengths (" << na << " and " << nb << ")";
+    }
+    ss << ". Contents near index " << first << ": "
+       << windowToString(nearA, before, afterA) << " and "
+       << windowToString(nearB, before, afterB);
+    throw TinyTestException(ss.str());
+  }
+
+  /**
+   * \brief throw a TinyTestException unless ranges a and b have the same
+   *        length and match their elements pairwise. Both are read once,
+   *        together, through their iterators, so they needn't have size() or
+   *        [] and can be single-pass (streams, generators); a difference in
+   *        length is found when the shorter one ends. Only CONTEXT_WINDOW
+   *        elements of each are kept for the failure message, which has the
+   *        same form as for expectContainer; macro is the name of the macro
+   *        to report.
+   */
+  template<typename A, typename B, typename Match>
+  inline void expectRange(const char* macro, A&& a, B&& b,
+                          const Match& match, int line, const char* file) {
+    using std::begin;
+    using std::end;
+    auto ia = begin(a);
+    auto ib = begin(b);
+    const auto ea = end(a);
+    const auto eb = end(b);
+    RecentElements<decltype(ia)> recentA(ia);
+    RecentElements<decltype(ib)> recentB(ib);
+    size_t i = 0;
+    for (; !(ia == ea) && !(ib == eb); ++ia, ++ib, ++i) {
+      if (TINYTEST_UNLIKELY(!match(*ia, *ib))) break;
+      recentA.passed(ia);
+      recentB.passed(ib);
+    }
+    if (TINYTEST_UNLIKELY(!(ia == ea) || !(ib == eb)))
+      failRange(macro, ia, ea, ib, eb, recentA, recentB, match, i, line,
+                file);
+  }
+
+  /**
+   * \brief Counts of the heap allocations made by one thread. If it's
+   *        compiled with TINYTEST_ALLOC_HOOKS, TinyTest.cpp replaces the
+   *        global operator new and delete to keep these; if it's compiled
+   *        with TINYTEST_HOOK_MALLOC, it hooks malloc and the rest of the C
+   *        allocation functions instead, which also catches C code (glibc
+   *        only). Otherwise nothing is counted.
+   */
+  struct AllocCounts {
+    AllocCounts() : allocs(0), bytes(0), frees(0) {;}
+    /** number of allocations, and the bytes they asked for */
+    uint64_t allocs, bytes;
+    /** number of deallocations */
+    uint64_t frees;
+  };
+
+  /** \brief are allocations being counted? Defined in TinyTest.cpp */
+  bool countingAllocs();
+
+  /** \brief the allocations made by the calling thread so far, excluding any
+   *         made while an UncountedAllocs was alive. Defined in TinyTest.cpp */
+  AllocCounts threadAllocCounts();
+
+  /**
+   * \brief While one of these is alive, allocations made by the thread that
+   *        created it aren't counted; e.g. TinyTest builds shared fixtures
+   *        inside one, so whichever test happens to build it isn't charged.
+   */
+  class UncountedAllocs {
+  public:
+    UncountedAllocs();
+    ~UncountedAllocs();
+  };
+
+  /** \brief throw the TinyTestException for an allocation check on expr
+   *         that made more than most allocations (or, if made is NULL,
+   *         couldn't be done). Defined in TinyTest.cpp. */
+  [[noreturn]] TINYTEST_COLD
+  void failAllocs(const char* macro, const char* expr, const AllocCounts* made,
+                  uint64_t most, int line, const char* file);
+
+  /**
+   * \brief throw a TinyTestException if calling f makes more than most heap
+   *        allocations on the calling thread; macro is the name of the macro
+   *        to report and expr the expression f evaluates.
+   */
+  template<typename F>
+  inline void expectMaxAllocs(const char* macro, uint64_t most,
+                              const char* expr, const F& f, int line,
+                              const char* file) {
+    if (TINYTEST_UNLIKELY(!countingAllocs()))
+      failAllocs(macro, expr, NULL, most, line, file);
+    AllocCounts before = threadAllocCounts();
+    f();
+    AllocCounts after = threadAllocCounts();
+    if (TINYTEST_UNLIKELY(after.allocs - before.allocs > most)) {
+      AllocCounts made;
+      made.allocs = after.allocs - before.allocs;
+      made.bytes = after.bytes - before.bytes;
+      failAllocs(macro, expr, &made, most, line, file);
+    }
+  }
+
+  /**
+   * \brief throw a TinyTestException, describing the first difference, unless
+   *        the file actual has the same contents as the file golden. The
+   *        files are compared a chunk at a time through memory mappings, and
+   *        compared chunks are released, so neither is ever held in memory
+   *        whole. When updating golden files, actual is copied over golden
+   *        instead. Defined in TinyTest.cpp.
+   */
+  void expectFileEqual(const std::string& actual, const std::string& golden,
+                       int line, const char* file);
+
+  /**
+   * \brief throw a TinyTestException, describing the first difference, unless
+   *        what write writes to the stream it's given matches the file
+   *        golden; expr is the expression write evaluates. The output is
+   *        compared as it is written, a buffer at a time, so it's never held
+   *        in memory whole. When updating golden files, the output replaces
+   *        golden instead. Defined in TinyTest.cpp.
+   */
+  void expectOutputMatchesFile(const std::function<void(std::ostream&)>& write,
+                               const char* expr, const std::string& golden,
+                               int line, const char* file);
+
+  /** \brief have expectFileEqual and expectOutputMatchesFile rewrite their
+   *         golden files rather than check them (see --update-golden) */
+  void setUpdateGolden(bool update);
+
+  /** \brief are golden files being rewritten rather than checked? Tests
+   *         that are meant to fail a golden file comparison should check
+   *         this and skip the comparison, or they'd overwrite the file */
+  bool updatingGolden();
+}
+
 /**
  * \brief Test whether two variables A and B are exactly equal. Throw a
  *        TinyTestException if they aren't.
@@ -97,13 +1053,7 @@ private:
  *        type.
  */
 #define EXPECT_EQUAL(A,B)                                             \
-  if (A != B) {                                                       \
-    std::stringstream ss;                                             \
-    ss << "EXPECT_EQUAL failed on comparison of "                     \
-       << A << " and " << B << " on line " << __LINE__ << " of "      \
-       << __FILE__;                                                   \
-    throw TinyTestException(ss.str());                                \
-  }
+  { TinyTest::expectEqual((A), (B), __LINE__, __FILE__); }
 
 /**
  * \brief Test whether two random-access containers A and B are equal. Throw a
@@ -118,27 +1068,9 @@ private:
  *        pairwise element comparison with != evaluates to false.
  */
 #define EXPECT_EQUAL_STL_CONTAINER(A,B)                               \
-  if (A.size() != B.size()) {                                         \
-    std::stringstream ss;                                             \
-    ss << "EXPECT_EQUAL_STL_CONTAINER failed on"                      \
-       << "comparison of " << TinyTest::vecToString(A)                \
-       << " and " << TinyTest::vecToString(B) << " on line "          \
-       << __LINE__ << " of " << __FILE__ << "; "                      \
-       << "Containers have unequal sizes";                            \
-    throw TinyTestException(ss.str());                                \
-  }                                                                   \
-  for (size_t i = 0; i < A.size(); ++i) {                             \
-    if (A[i] != B[i]) {                                               \
-      std::stringstream ss;                                           \
-      ss << "EXPECT_EQUAL_STL_CONTAINER failed on "                   \
-         << "comparison of " << A[i]                                  \
-         << " and " << B[i] << " on line " << __LINE__ << " of "      \
-         << __FILE__ << ". Full container "                           \
-         << "contents: " << TinyTest::vecToString(A)                  \
-         << " and " << TinyTest::vecToString(B);                      \
-      throw TinyTestException(ss.str());                              \
-    }                                                                 \
-  }
+  { TinyTest::expectContainer("EXPECT_EQUAL_STL_CONTAINER", (A), (B), \
+                              TinyTest::ElementsEqual(),              \
+                              __LINE__, __FILE__); }
 
 /**
  * \brief Test whether two random-access containers A and B contain elements
@@ -156,28 +1088,80 @@ private:
  *        is within the specified tolerance.
  */
 #define EXPECT_NEAR_STL_CONTAINER(A,B,TOL)                            \
-  if (A.size() != B.size()) {                                         \
-    std::stringstream ss;                                             \
-    ss << "EXPECT_NEAR_STL_CONTAINER failed on "                      \
-       << "comparison of " << TinyTest::vecToString(A)                \
-       << " and " <<  TinyTest::vecToString(B) << " on line "         \
-       << __LINE__ << " of " << __FILE__ "; "                         \
-       << "Containers have unequal sizes.";                           \
-    throw TinyTestException(ss.str());                                \
-  }                                                                   \
-  for (size_t i = 0; i < A.size(); ++i) {                             \
-    if (std::fabs(A[i] - B[i]) > TOL) {                               \
-      std::stringstream ss;                                           \
-      ss << "EXPECT_NEAR_STL_CONTAINER failed on "                    \
-         << "comparison of " << A[i]                                  \
-         << " and " << B[i] << " with tolerance of "                  \
-         << TOL << " on line " << __LINE__ << " of "                  \
-         << __FILE__ << ". Full container "                           \
-         << "contents: " << TinyTest::vecToString(A)                  \
-         << " and " << TinyTest::vecToString(B);                      \
-      throw TinyTestException(ss.str());                              \
-    }                                                                 \
-  }
+  { TinyTest::expectContainer("EXPECT_NEAR_STL_CONTAINER", (A), (B),  \
+                              TinyTest::ElementsNear(TOL),            \
+                              __LINE__, __FILE__); }
+
+/**
+ * \brief Test whether two random-access containers A and B contain elements
+ *        that are equal to within a relative tolerance: |a - b| must not
+ *        exceed TOL times |a| or TOL times |b|. Requirements on A and B are
+ *        the same as for EXPECT_NEAR_STL_CONTAINER.
+ */
+#define EXPECT_NEAR_RELATIVE_STL_CONTAINER(A,B,TOL)                   \
+  { TinyTest::expectContainer("EXPECT_NEAR_RELATIVE_STL_CONTAINER",   \
+                              (A), (B),                               \
+                              TinyTest::ElementsNearRelative(TOL),    \
+                              __LINE__, __FILE__); }
+
+/**
+ * \brief Test whether two random-access containers A and B of floats or
+ *        doubles contain elements that are no more than ULPS representable
+ *        values apart (units in the last place). NaN never matches anything.
+ */
+#define EXPECT_NEAR_ULPS_STL_CONTAINER(A,B,ULPS)                      \
+  { TinyTest::expectContainer("EXPECT_NEAR_ULPS_STL_CONTAINER",       \
+                              (A), (B),                               \
+                              TinyTest::ElementsWithinUlps(ULPS),     \
+                              __LINE__, __FILE__); }
+
+/**
+ * \brief Test whether ranges A and B are equal. Throw a TinyTestException if
+ *        they aren't.
+ *
+ *        A and B can be anything std::begin and std::end work on, including
+ *        lists, maps, C++20 views and iterator pairs wrapped by
+ *        TinyTest::range; they're read in one pass, so single-pass ranges
+ *        like std::istream_iterator work too, and memory use doesn't grow
+ *        with their length. The elements must support != and <<.
+ *
+ *        A and B are equal if they have the same number of elements and each
+ *        pairwise element comparison with != evaluates to false.
+ */
+#define EXPECT_EQUAL_RANGE(A,B)                                       \
+  { TinyTest::expectRange("EXPECT_EQUAL_RANGE", (A), (B),             \
+                          TinyTest::ElementsEqual(),                  \
+                          __LINE__, __FILE__); }
+
+/**
+ * \brief Test whether ranges A and B contain elements that are within TOL of
+ *        each other. Ranges are handled as for EXPECT_EQUAL_RANGE, and
+ *        elements as for EXPECT_NEAR_STL_CONTAINER.
+ */
+#define EXPECT_NEAR_RANGE(A,B,TOL)                                    \
+  { TinyTest::expectRange("EXPECT_NEAR_RANGE", (A), (B),              \
+                          TinyTest::ElementsNear(TOL),                \
+                          __LINE__, __FILE__); }
+
+/**
+ * \brief Test whether ranges A and B contain elements that are equal to
+ *        within a relative tolerance, as for
+ *        EXPECT_NEAR_RELATIVE_STL_CONTAINER.
+ */
+#define EXPECT_NEAR_RELATIVE_RANGE(A,B,TOL)                           \
+  { TinyTest::expectRange("EXPECT_NEAR_RELATIVE_RANGE", (A), (B),     \
+                          TinyTest::ElementsNearRelative(TOL),        \
+                          __LINE__, __FILE__); }
+
+/**
+ * \brief Test whether ranges A and B of floats or doubles contain elements
+ *        that are no more than ULPS representable values apart, as for
+ *        EXPECT_NEAR_ULPS_STL_CONTAINER.
+ */
+#define EXPECT_NEAR_ULPS_RANGE(A,B,ULPS)                              \
+  { TinyTest::expectRange("EXPECT_NEAR_ULPS_RANGE", (A), (B),         \
+                          TinyTest::ElementsWithinUlps(ULPS),         \
+                          __LINE__, __FILE__); }
 
 /**
  * \brief This macros tests whether A and B are _NOT_ equal. The equality
@@ -185,13 +1169,7 @@ private:
  *        same type.
  */
 #define EXPECT_NOT_EQUAL(A,B)                                         \
-  if (A == B) {                                                       \
-    std::stringstream ss;                                             \
-    ss << "EXPECT_NOT_EQUAL failed on comparison of "                 \
-       << A << " and " << B << " on line " << __LINE__ << " of "      \
-       << __FILE__;                                                   \
-    throw TinyTestException(ss.str());                                \
-  }
+  { TinyTest::expectNotEqual((A), (B), __LINE__, __FILE__); }
 
 /**
  * \brief This macro tests whether A and B are _almost_ equal. The
@@ -199,14 +1177,8 @@ private:
  *        by the caller. Basically, this is for floating point numbers.
  */
 #define EXPECT_NEAR(A,B,TOL)                                          \
-  if (std::fabs(A - B) > TOL) {                                       \
-    std::stringstream ss;                                             \
-    ss << "EXPECT_NEAR failed on comparison of "                      \
-       << A << " and " << B                                           \
-       << " with tolerance of " << TOL                                \
-       << " on line " << __LINE__ << " of " << __FILE__;              \
-    throw TinyTestException(ss.str());                                \
-  }
+  { TinyTest::expectNear("EXPECT_NEAR", (A), (B), (TOL),              \
+                         __LINE__, __FILE__); }
 
 /**
  * \brief This macro tests whether A and B are _almost_ equal. The
@@ -214,15 +1186,8 @@ private:
  *        1e-20 is allowed. Basically, this is for floating point numbers.
  */
 #define EXPECT_NEAR_DEF(A,B)                                          \
-  if (std::fabs(A - B) > TinyTest::DEF_TOLERANCE) {                   \
-    std::stringstream ss;                                             \
-    ss << "EXPECT_NEAR_DEF failed on comparison of "                  \
-       << A << " and " << B                                           \
-       << " with tolerance of " << TinyTest::DEF_TOLERANCE            \
-       << " on line " << __LINE__ << " of "                           \
-       << __FILE__;                                                   \
-    throw TinyTestException(ss.str());                                \
-  }
+  { TinyTest::expectNear("EXPECT_NEAR_DEF", (A), (B),                 \
+                         TinyTest::DEF_TOLERANCE, __LINE__, __FILE__); }
 
 /**
  * \brief This macros tests whether the exception type EXCEPTION is thrown
@@ -230,51 +1195,1191 @@ private:
  *        ARGS can be more than one argument.
  */
 #define EXPECT_THROWS(EXCEPTION, FUNC)                                \
-  bool thrown = false;                                                \
-  try {                                                               \
-    FUNC;                                                             \
-  } catch (EXCEPTION &e) {                                            \
-    thrown= true;                                                     \
-  }                                                                   \
-  if (!thrown) {                                                      \
-    std::stringstream ss;                                             \
-    ss << "EXPECT_THROWS failed when running " << #FUNC               \
-       << " on line " << __LINE__ << " of " << __FILE__<< "; "        \
-       << #EXCEPTION << " was not thrown";                            \
-    throw TinyTestException(ss.str());                                \
+  {                                                                   \
+    bool thrown = false;                                              \
+    try {                                                             \
+      FUNC;                                                           \
+    } catch (EXCEPTION &e) {                                          \
+      thrown = true;                                                  \
+    }                                                                 \
+    if (TINYTEST_UNLIKELY(!thrown))                                   \
+      TinyTest::failThrows(#EXCEPTION, #FUNC, __LINE__, __FILE__);    \
   }
 
+/**
+ * \brief This macro tests that evaluating EXPR doesn't allocate anything on
+ *        the heap (on the calling thread). EXPR can be any expression,
+ *        including a call to a void function.
+ */
+#define EXPECT_NO_ALLOC(EXPR)                                         \
+  { TinyTest::expectMaxAllocs("EXPECT_NO_ALLOC", 0, #EXPR,            \
+                              [&]() { (void) (EXPR); },               \
+                              __LINE__, __FILE__); }
 
-/******************************************************************************
- **       Classes for definition, and automagic detection of test cases      **
- ******************************************************************************/
+/**
+ * \brief This macro tests that the file ACTUAL has exactly the same contents
+ *        as the golden file GOLDEN; on failure, it reports the first line
+ *        that differs. Run with --update-golden to copy ACTUAL over GOLDEN.
+ */
+#define EXPECT_FILE_EQUAL(ACTUAL, GOLDEN)                             \
+  { TinyTest::expectFileEqual((ACTUAL), (GOLDEN), __LINE__, __FILE__); }
 
 /**
- * \brief This class is the base test case class. User defined test cases
- *        will extend this class (though they won't know it necessarily,
- *        since it's done automatically for them using a macro).
+ * \brief This macro tests that what EXPR writes to the std::ostream called
+ *        out exactly matches the golden file GOLDEN; on failure, it reports
+ *        the first line that differs. Run with --update-golden to replace
+ *        GOLDEN with the output.
  */
-class TestCase {
-	public:
-    /** \brief Construct a new test case with the given name
-     *  \param testName name of the test case
-     */
-  	TestCase (const std::string& testName) : testName(testName) {;}
+#define EXPECT_OUTPUT_MATCHES_FILE(EXPR, GOLDEN)                      \
+  { TinyTest::expectOutputMatchesFile(                                \
+      [&](std::ostream& out) { (void) (EXPR); }, #EXPR, (GOLDEN),     \
+      __LINE__, __FILE__); }
 
-  	/** \brief Test case destructor */
-  	virtual ~TestCase() {};
+/**
+ * \brief This macro tests that evaluating EXPR makes at most N heap
+ *        allocations (on the calling thread).
+ */
+#define EXPECT_MAX_ALLOCS(N, EXPR)                                    \
+  { TinyTest::expectMaxAllocs("EXPECT_MAX_ALLOCS", (N), #EXPR,        \
+                              [&]() { (void) (EXPR); },               \
+                              __LINE__, __FILE__); }
 
-  	/** \brief Get the name of this test case */
-    virtual std::string getTestName() const {return testName;}
+/******************************************************************************
+ **       Classes for definition, and automagic detection of test cases      **
+ ******************************************************************************/
 
-    /** \brief Run the code for this test. If this method completes without
+namespace TinyTest {
+  /**
+   * \brief The index of the worker running the calling thread's test: 0 to
+   *        jobs-1 with -j, always 0 otherwise. Defined in TinyTest.cpp.
+   */
+  size_t currentWorker();
+
+  /**
+   * \brief The part of a shared fixture that the TestSet sees. Before a run,
+   *        the TestSet counts the selected tests using each fixture with
+   *        expectTest(); each of those tests calls testFinished() once it's
+   *        done, and the last one to finish tears the fixture down.
+   */
+  class SharedFixture {
+  public:
+    SharedFixture() : pending(0) {;}
+    virtual ~SharedFixture() {;}
+
+    /** \brief note that one more test using this fixture will be run */
+    void expectTest() {
+      std::lock_guard<std::mutex> guard(lock);
+      ++pending;
+    }
+
+    /** \brief note that a test using this fixture has finished; after the
+     *         last expected one, destroy the fixture */
+    void testFinished() {
+      std::lock_guard<std::mutex> guard(lock);
+      if (pending > 0 && --pending == 0) destroy();
+    }
+
+    /** \brief note that the worker threads have all exited (as they do
+     *         between the batches of a repeated run), so the instances
+     *         belonging to particular workers can go */
+    void workersFinished() {
+      std::lock_guard<std::mutex> guard(lock);
+      destroyPerWorker();
+    }
+
+  protected:
+    /** \brief destroy every instance of the fixture; called with lock held */
+    virtual void destroy() = 0;
+
+    /** \brief destroy the instances that belong to particular workers, if
+     *         there are any; called with lock held */
+    virtual void destroyPerWorker() {;}
+
+    /** guards pending and the instances kept by sub-classes */
+    std::mutex lock;
+
+  private:
+    /** how many of the tests using this fixture are still to finish */
+    size_t pending;
+  };
+
+  /**
+   * \brief Derive a fixture from this to give each worker thread its own
+   *        instance, rather than sharing one between all of them. Use it
+   *        for fixtures that aren't safe to read concurrently or that would
+   *        be a bottleneck if shared.
+   */
+  struct PerWorkerFixture {};
+
+  /**
+   * \brief What a test says about how it's to be run, besides its body:
+   *        given to the _WITH forms of the test macros, so any kind of test
+   *        can have any of them. They're built up by chaining, e.g.
+   *
+   *            TEST_ASYNC_WITH(testServer, TinyTest::withTimeout(500)
+   *                                          .withResources("port8080"))
+   */
+  struct TestAttributes {
+    TestAttributes() : timeoutMs(0), resources(NULL) {;}
+    /** \brief a time limit of ms milliseconds, overriding --timeout */
+    TestAttributes& withTimeout(double ms) {
+      timeoutMs = ms;
+      return *this;
+    }
+    /** \brief the resources the test needs while it runs, as for
+     *         TEST_RESOURCES; the string must outlive the test */
+    TestAttributes& withResources(const char* list) {
+      resources = list;
+      return *this;
+    }
+    /** the time limit in ms; 0 means use the run's */
+    double timeoutMs;
+    /** the resources needed; NULL if none */
+    const char* resources;
+  };
+
+  /** \brief attributes giving a test a time limit of ms milliseconds */
+  inline TestAttributes withTimeout(double ms) {
+    return TestAttributes().withTimeout(ms);
+  }
+
+  /** \brief attributes saying which resources a test needs */
+  inline TestAttributes withResources(const char* list) {
+    return TestAttributes().withResources(list);
+  }
+
+  /** \brief the first item of a list of resources, as for TEST_RESOURCES,
+   *         that has no name or whose amount isn't a non-negative number;
+   *         empty if the list is well formed. A test whose list isn't is
+   *         reported, and the run fails, before any test runs. Defined in
+   *         TinyTest.cpp */
+  std::string malformedResource(const char* list);
+}
+
+class ParamTestCaseBase;
+class FuzzTestCase;
+
+/**
+ * \brief This class is the base test case class. User defined test cases
+ *        will extend this class (though they won't know it necessarily,
+ *        since it's done automatically for them using a macro).
+ */
+class TestCase {
+	public:
+    /** \brief Construct a new test case with the given name
+     *  \param testName name of the test case; it isn't copied, so it must
+     *                  outlive the test case (a string literal, normally)
+     */
+  	TestCase (const char* testName) : testName(testName), nextTest(NULL) {;}
+
+    /** \brief Construct a new test case with the given name, which is
+     *         copied; for test cases made at run time, whose names aren't
+     *         string literals
+     */
+  	TestCase (const std::string& testName) :
+      testName(NULL), ownedName(testName), nextTest(NULL) {;}
+
+  	/** \brief Test case destructor */
+  	virtual ~TestCase() {};
+
+  	/** \brief Get the name of this test case */
+    virtual std::string getTestName() const {
+      return testName != NULL ? testName : ownedName;
+    }
+
+    /** \brief Run the code for this test. If this method completes without
      *         throwing any exceptions the test is considered to have passed.
      */
     virtual void runTest() const = 0;
 
+    /** \brief Is this test case really a benchmark? Benchmarks are only run
+     *         when asked for, and are timed rather than just passed/failed.
+     */
+    virtual bool isBenchmark() const { return false; }
+
+    /** \brief Is this test a coroutine (see TEST_ASYNC)? Async tests are run
+     *         together on an event loop, after the other tests. */
+    virtual bool isAsync() const { return false; }
+
+    /** \brief The time limit for this test in ms, overriding the run's
+     *         --timeout; 0 means use the run's */
+    virtual double getTimeoutMs() const { return attributes.timeoutMs; }
+
+    /** \brief The resources this test needs while it runs (see
+     *         TEST_RESOURCES); NULL if it doesn't need any */
+    virtual const char* getResources() const { return attributes.resources; }
+
+    /** \brief The shared fixture this test uses, if any */
+    virtual TinyTest::SharedFixture* sharedFixture() const { return NULL; }
+
+    /** \brief This test, if it's parameterised (see TEST_P) */
+    virtual const ParamTestCaseBase* paramTest() const { return NULL; }
+
+    /** \brief This test, if it's a fuzz test (see FUZZ_TEST) */
+    virtual const FuzzTestCase* fuzzTest() const { return NULL; }
+
+  protected:
+    /** \brief Set how this test is to be run (see TEST_WITH) */
+    void setAttributes(const TinyTest::TestAttributes& a) { attributes = a; }
+
   private:
     /** The name of the this test case. Used for reporting pass/fail **/
-    std::string testName;
+    const char* testName;
+
+    /** The name, if it was given as a std::string; testName is then NULL **/
+    std::string ownedName;
+
+    /** How this test is to be run, besides its body **/
+    TinyTest::TestAttributes attributes;
+
+    /** The test case registered after this one; TestSet keeps the registered
+     *  test cases in an intrusive list so that registering them during
+     *  static initialisation needs no allocation **/
+    TestCase* nextTest;
+
+    friend class TestSet;
+};
+
+namespace TinyTest {
+  /**
+   * \brief Stop the compiler from optimising away the computation of value.
+   *        Use this on the result of the work being measured in a benchmark.
+   */
+  template<typename T>
+  inline void doNotOptimize(const T& value) {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    const volatile char* p = reinterpret_cast<const volatile char*>(&value);
+    (void) *p;
+#endif
+  }
+
+  /**
+   * \brief Force the compiler to assume that all memory may have been read
+   *        and written, so stores made by the measured work aren't elided.
+   */
+  inline void clobberMemory() {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : : "memory");
+#endif
+  }
+
+  /**
+   * \brief The handle a benchmark body uses to run its timed loop. The body
+   *        does any setup it needs and then loops on keepRunning(); only the
+   *        loop is timed:
+   *
+   *            while (bench.keepRunning()) { doNotOptimize(work()); }
+   */
+  class BenchmarkState {
+  public:
+    /** \brief a state that will let the loop run for the given iterations */
+    explicit BenchmarkState(size_t iterations) :
+      remaining(iterations), started(false), elapsedNs(0) {;}
+
+    /** \brief true while there are iterations left to run; the clock starts
+     *         on the first call and stops on the last. */
+    bool keepRunning() {
+      if (started && remaining != 0) {
+        --remaining;
+        return true;
+      }
+      return startOrStop();
+    }
+
+    /** \brief wall time taken by the loop, in nanoseconds */
+    double elapsed() const { return elapsedNs; }
+
+    /** \brief true if the body ran its loop to completion */
+    bool finished() const { return started && remaining == 0; }
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    /** \brief the out-of-the-loop part of keepRunning() */
+    bool startOrStop() {
+      if (!started) {
+        started = true;
+        startTime = Clock::now();
+        return keepRunning();
+      }
+      elapsedNs = std::chrono::duration<double, std::nano>(
+                    Clock::now() - startTime).count();
+      return false;
+    }
+
+    size_t remaining;
+    bool started;
+    Clock::time_point startTime;
+    double elapsedNs;
+  };
+}
+
+/**
+ * \brief Base class for benchmarks. The BENCHMARK macro defines sub-classes
+ *        of this, in the same way TEST defines sub-classes of TestCase, and
+ *        they are registered with the same TestSet. Running a benchmark as a
+ *        test just runs one iteration of its loop.
+ */
+class BenchmarkCase : public TestCase {
+public:
+  /** \brief Construct a new benchmark with the given name */
+  BenchmarkCase(const char* testName) : TestCase(testName) {;}
+
+  /** \brief Construct a new benchmark with a copy of the given name */
+  BenchmarkCase(const std::string& testName) : TestCase(testName) {;}
+
+  /** \brief Run the body of the benchmark with the given state */
+  virtual void runBenchmark(TinyTest::BenchmarkState& bench) const = 0;
+
+  /** \brief Run a single iteration of the benchmark */
+  virtual void runTest() const {
+    TinyTest::BenchmarkState bench(1);
+    runBenchmark(bench);
+  }
+
+  /** \brief This is a benchmark */
+  virtual bool isBenchmark() const { return true; }
+};
+
+namespace TinyTest {
+  /** \brief summary of the per-iteration times measured for a benchmark */
+  struct BenchmarkStats {
+    BenchmarkStats() : mean(0), median(0), stddev(0), min(0),
+                       iterations(0), samples(0), counted(false) {;}
+    /** mean, median, standard deviation and minimum, in ns per iteration */
+    double mean, median, stddev, min;
+    /** iterations of the loop per sample */
+    size_t iterations;
+    /** number of samples the statistics were computed from */
+    size_t samples;
+    /** the time per iteration in each sample, in ns, sorted */
+    std::vector<double> perOp;
+    /** true if the performance counters were read while sampling */
+    bool counted;
+    /** what each Counter counted per iteration over all of the samples;
+     *  negative for those that couldn't be counted */
+    double counters[N_COUNTERS];
+
+    /** \brief format the statistics for a result line. Defined in
+     *         TinyTest.cpp */
+    std::string toString() const;
+  };
+
+  /** \brief the statistics of samples whose times per iteration (in ns)
+   *         are perOp, each of the given iterations. Defined in
+   *         TinyTest.cpp */
+  BenchmarkStats summariseBenchmark(std::vector<double> perOp,
+                                    size_t iterations);
+
+  /**
+   * \brief calibrate the number of iterations of b's loop so that each of
+   *        its samples takes about totalSeconds / 10, then take the samples,
+   *        reading the performance counters around them if counters is set.
+   *        This is how --benchmarks times b. Defined in TinyTest.cpp.
+   */
+  BenchmarkStats measureBenchmark(const BenchmarkCase& b, double totalSeconds,
+                                  bool counters);
+
+  /** \brief the per-iteration times (ns) of each sample of each benchmark,
+   *         as kept by --baseline and --update-baseline */
+  typedef std::map<std::string, std::vector<double> > Baseline;
+
+  /** \brief add the benchmarks in a file written by saveBaseline to base;
+   *         returns false if the file couldn't be read. Defined in
+   *         TinyTest.cpp */
+  bool loadBaseline(const std::string& filename, Baseline& base);
+
+  /** \brief write base to a file, one benchmark per line; returns false if
+   *         the file couldn't be written. Defined in TinyTest.cpp */
+  bool saveBaseline(const std::string& filename, const Baseline& base);
+
+  /** \brief replace the benchmarks in the file that were measured, keeping
+   *         the baselines of the others; returns false if the file couldn't
+   *         be written. Defined in TinyTest.cpp */
+  bool updateBaseline(const std::string& filename, const Baseline& measured);
+
+  /**
+   * \brief compare the times measured for a benchmark with its baseline.
+   *        Returns true if they are significantly slower (at level
+   *        opts.alpha) by at least opts.minEffect, relative to the baseline
+   *        median. Either way, comparison describes the difference. Defined
+   *        in TinyTest.cpp.
+   */
+  bool slowerThanBaseline(const std::vector<double>& now,
+                          const std::vector<double>& base,
+                          const RunOptions& opts, std::string& comparison);
+}
+
+namespace TinyTest {
+  /**
+   * \brief The outcome and duration of each test in earlier runs, as kept
+   *        by --cache in a small file that is memory-mapped and searched in
+   *        place, so reading it costs no more than the lookups. The file is
+   *        a header, an array of fixed-size records sorted by test name, and
+   *        the names themselves. Runs sharing the file (shards, say) take
+   *        turns through flock(): readers hold a shared lock while it's
+   *        mapped, and update() holds an exclusive one while it writes a new
+   *        file and renames it over the old one. Defined in TinyTest.cpp.
+   */
+  class ResultCache {
+  public:
+    /** \brief what is known about a test; wallMs < 0 if it's not known */
+    struct Entry {
+      Entry() : failed(false), wallMs(-1) {;}
+      bool failed;
+      double wallMs;
+    };
+
+    /** \brief map the cache in fn; it's empty if fn doesn't exist or isn't
+     *         a valid cache (a truncated one, say) */
+    explicit ResultCache(const std::string& fn);
+    ~ResultCache();
+
+    /** \brief look up the named test; false if it isn't in the cache */
+    bool find(const std::string& name, Entry& e) const;
+
+    /** \brief the mean duration of the tests whose duration is known */
+    double meanWallMs() const;
+
+    /**
+     * \brief rewrite the cache in fn to hold the fresh results, plus
+     *        whatever it already knew about the other tests for which
+     *        registered is true; the rest are dropped. A fresh entry
+     *        with an unknown duration keeps the old duration. An invalid
+     *        cache is replaced. Returns false if the file couldn't be
+     *        written.
+     */
+    static bool update(const std::string& fn,
+                       const std::function<bool(const std::string&)>&
+                         registered,
+                       const std::map<std::string, Entry>& fresh);
+
+  private:
+    struct Header;
+    struct Record;
+
+    /** \brief identifies the file (and the version of its layout) */
+    static const char MAGIC[8];
+
+    ResultCache(const ResultCache&) = delete;
+    ResultCache& operator=(const ResultCache&) = delete;
+
+    /** \brief map the already-locked file open on fd, which we don't own */
+    explicit ResultCache(int lockedFd);
+
+    /** \brief map the file (fd by default), leaving base NULL unless it is
+     *         a valid cache */
+    void map(int from = -1);
+
+    /** \brief is the mapping a complete cache with this layout? The file
+     *         may have been cut short, or be something else entirely. */
+    bool valid() const;
+
+    /** \brief the number of records in the mapping */
+    size_t count() const;
+
+    /** \brief the i'th record of the cache at b */
+    static const Record& record(const char* b, size_t i);
+
+    /** \brief the name in record i of the cache at b, which has n records */
+    static std::pair<const char*, size_t> name(const char* b, size_t n,
+                                               size_t i);
+
+    /** \brief binary search the n records of the cache at b for the name */
+    static bool findIn(const char* b, size_t n, const std::string& s,
+                       Entry& e);
+
+    int fd;
+    const char* base;
+    size_t len;
+  };
+
+  /**
+   * \brief the order to run tests in, given what the cache knows about each
+   *        of them: as indices into known, those that failed first if
+   *        failedFirst, then the longest first if longestFirst, taking
+   *        those whose duration isn't known to take meanWallMs. Otherwise
+   *        the tests keep their order. Defined in TinyTest.cpp.
+   */
+  std::vector<size_t> cacheOrder(const std::vector<ResultCache::Entry>& known,
+                                 double meanWallMs, bool failedFirst,
+                                 bool longestFirst);
+}
+
+#ifdef TINYTEST_HAS_COROUTINES
+namespace TinyTest {
+  /**
+   * \brief What a coroutine returns if it's the body of a TEST_ASYNC, or a
+   *        helper one of them co_awaits. It doesn't start until it's
+   *        awaited (or, for a test body, started by the event loop), and
+   *        awaiting it rethrows anything it threw, so a failed assertion
+   *        anywhere down the chain fails the test that's awaiting it.
+   */
+  class AsyncTask {
+  public:
+    struct promise_type {
+      /** the coroutine to resume once this one has finished, if any */
+      std::coroutine_handle<> continuation;
+      /** what the coroutine threw, if anything */
+      std::exception_ptr error;
+
+      /** \brief hands control back to whoever awaited the coroutine */
+      struct FinalAwaiter {
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<>
+        await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+          if (h.promise().continuation) return h.promise().continuation;
+          return std::noop_coroutine();
+        }
+        void await_resume() const noexcept {;}
+      };
+
+      AsyncTask get_return_object() {
+        return AsyncTask(
+          std::coroutine_handle<promise_type>::from_promise(*this));
+      }
+      std::suspend_always initial_suspend() const noexcept { return {}; }
+      FinalAwaiter final_suspend() const noexcept { return {}; }
+      void return_void() const {;}
+      void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    AsyncTask(AsyncTask&& other) noexcept : h(other.h) { other.h = nullptr; }
+    AsyncTask(const AsyncTask&) = delete;
+    AsyncTask& operator=(const AsyncTask&) = delete;
+    /** \brief destroy the coroutine, and with it any it's waiting on */
+    ~AsyncTask() { if (h) h.destroy(); }
+
+    /** \brief run the coroutine until it finishes, then carry on with the
+     *         one awaiting it */
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<> waiting) noexcept {
+      h.promise().continuation = waiting;
+      return h;
+    }
+    void await_resume() const {
+      if (h.promise().error) std::rethrow_exception(h.promise().error);
+    }
+
+    /** \brief the coroutine, for the event loop */
+    Handle handle() const { return h; }
+
+  private:
+    explicit AsyncTask(Handle h) : h(h) {;}
+    Handle h;
+  };
+
+  /**
+   * \brief Suspend the calling coroutine until fd is ready for reading (or
+   *        writing, if forWriting is set) on the event loop running the
+   *        async tests. Throws if there isn't one. Defined in TinyTest.cpp.
+   */
+  void waitForFd(int fd, bool forWriting, std::coroutine_handle<> h);
+
+  /**
+   * \brief Suspend the calling coroutine for ms milliseconds on the event
+   *        loop running the async tests. Throws if there isn't one. Defined
+   *        in TinyTest.cpp.
+   */
+  void waitForTime(double ms, std::coroutine_handle<> h);
+
+  /**
+   * \brief Run task to completion on an event loop of its own, rethrowing
+   *        anything it throws. This is how an async test is run on its own
+   *        (in a forked worker, say). Defined in TinyTest.cpp.
+   */
+  void runToCompletion(AsyncTask task);
+
+  /** \brief What co_await readable(fd) and writable(fd) wait on */
+  struct FdReady {
+    FdReady(int fd, bool forWriting) : fd(fd), forWriting(forWriting) {;}
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) const {
+      waitForFd(fd, forWriting, h);
+    }
+    void await_resume() const noexcept {;}
+    int fd;
+    bool forWriting;
+  };
+
+  /** \brief co_await this in an async test to wait until fd can be read
+   *         without blocking (or has hung up) */
+  inline FdReady readable(int fd) { return FdReady(fd, false); }
+
+  /** \brief co_await this in an async test to wait until fd can be written
+   *         without blocking */
+  inline FdReady writable(int fd) { return FdReady(fd, true); }
+
+  /** \brief What co_await sleepFor(duration) waits on */
+  struct Sleep {
+    explicit Sleep(double ms) : ms(ms) {;}
+    bool await_ready() const noexcept { return ms <= 0; }
+    void await_suspend(std::coroutine_handle<> h) const {
+      waitForTime(ms, h);
+    }
+    void await_resume() const noexcept {;}
+    double ms;
+  };
+
+  /** \brief co_await this in an async test to let the other tests run for
+   *         the given time */
+  template<typename Rep, typename Period>
+  Sleep sleepFor(std::chrono::duration<Rep, Period> d) {
+    return Sleep(std::chrono::duration<double, std::milli>(d).count());
+  }
+}
+
+/**
+ * \brief Base class for tests whose body is a coroutine; the TEST_ASYNC macro
+ *        defines sub-classes of this. When the tests are run in this
+ *        process, all of the selected async tests are started together on a
+ *        single-threaded event loop, after the other tests, so that tests
+ *        waiting on I/O or timers overlap rather than queue up.
+ */
+class AsyncTestCase : public TestCase {
+public:
+  /** \brief Construct a new async test with the given name */
+  AsyncTestCase(const char* testName) : TestCase(testName) {;}
+
+  /** \brief Start the body of the test */
+  virtual TinyTest::AsyncTask runAsync() const = 0;
+
+  /** \brief Run the body of the test to completion on a loop of its own */
+  virtual void runTest() const { TinyTest::runToCompletion(runAsync()); }
+
+  /** \brief This is an async test */
+  virtual bool isAsync() const { return true; }
+};
+#endif
+
+namespace TinyTest {
+  /**
+   * \brief Keeps the instances of fixture type F. One instance is shared by
+   *        every worker unless F derives from PerWorkerFixture, in which case
+   *        each worker gets its own. Instances are default-constructed the
+   *        first time a test needs them.
+   */
+  template<typename F>
+  class FixtureStore : public SharedFixture {
+  public:
+    /** \brief the instance for the calling worker, constructing it if need
+     *         be; if construction throws, the next test tries again */
+    const F& get() {
+      const bool perWorker = std::is_base_of<PerWorkerFixture, F>::value;
+      const size_t key = perWorker ? currentWorker() : 0;
+      std::unique_lock<std::mutex> guard(lock);
+      typename Instances::iterator it = instances.find(key);
+      if (it != instances.end()) return *it->second;
+      // a shared fixture is built with the lock held, so anyone else who
+      // needs it waits rather than building another; a per-worker one is
+      // built without it, so workers don't wait for each other
+      if (perWorker) guard.unlock();
+      UncountedAllocs uncounted;
+      std::unique_ptr<F> made(new F());
+      if (perWorker) guard.lock();
+      return *(instances[key] = std::move(made));
+    }
+
+  protected:
+    virtual void destroy() { instances.clear(); }
+
+    virtual void destroyPerWorker() {
+      if (std::is_base_of<PerWorkerFixture, F>::value) instances.clear();
+    }
+
+  private:
+    typedef std::map<size_t, std::unique_ptr<F> > Instances;
+    /** the instances constructed so far, by worker (always 0 if shared) */
+    Instances instances;
+  };
+}
+
+/**
+ * \brief Base class for tests that use a fixture of type F. The TEST_F macro
+ *        defines sub-classes of this. All of the tests using the same F get
+ *        the same (const) instance, so expensive setup happens once per run
+ *        rather than once per test.
+ */
+template<typename F>
+class FixtureTestCase : public TestCase {
+public:
+  /** \brief Construct a new fixture test with the given name */
+  FixtureTestCase(const char* testName) : TestCase(testName) {;}
+
+  /** \brief Run the body of the test with the given fixture */
+  virtual void runFixtureTest(const F& fixture) const = 0;
+
+  /** \brief Get the fixture (constructing it if need be) and run the body */
+  virtual void runTest() const { runFixtureTest(store().get()); }
+
+  /** \brief The store holding this test's fixture */
+  virtual TinyTest::SharedFixture* sharedFixture() const { return &store(); }
+
+private:
+  /** \brief the single store for fixture type F */
+  static TinyTest::FixtureStore<F>& store() {
+    static TinyTest::FixtureStore<F> s;
+    return s;
+  }
+};
+
+namespace TinyTest {
+  /**
+   * \brief A whole file mapped read-only into memory, so that tests can
+   *        stream through large data files without reading them into
+   *        buffers. Defined in TinyTest.cpp.
+   */
+  class MappedFile {
+  public:
+    MappedFile() : base(NULL), len(0) {;}
+    ~MappedFile();
+
+    /** \brief map the file fn; false (with the reason in error) if it
+     *         couldn't be. An empty file maps to no data. */
+    bool open(const std::string& fn, std::string& error);
+
+    const char* data() const { return base; }
+    size_t size() const { return len; }
+
+    /** \brief let the kernel reclaim the pages wholly inside the n bytes at
+     *         offset; they're read in again if they're touched */
+    void release(size_t offset, size_t n);
+
+  private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+    const char* base;
+    size_t len;
+  };
+
+  /**
+   * \brief One field of a CSV row; it points into the mapped file, so it's
+   *        only valid while the row is being tested.
+   */
+  class CsvField {
+  public:
+    CsvField(const char* p, size_t n) : p(p), n(n) {;}
+
+    const char* data() const { return p; }
+    size_t size() const { return n; }
+
+    /** \brief a copy of the field as a string */
+    std::string str() const { return std::string(p, n); }
+
+    /** \brief the field as a number; throws a TinyTestException if it
+     *         isn't one. Neither allocates. */
+    double toDouble() const;
+    long long toLong() const;
+
+    /** \brief compare the field with a string */
+    bool operator==(const std::string& s) const {
+      return s.size() == n && memcmp(s.data(), p, n) == 0;
+    }
+    bool operator!=(const std::string& s) const { return !(*this == s); }
+
+  private:
+    const char* p;
+    size_t n;
+  };
+
+  inline std::ostream& operator<<(std::ostream& os, const CsvField& f) {
+    return os.write(f.data(), f.size());
+  }
+
+  /**
+   * \brief One line of a CSV file, split on commas as fields are asked for;
+   *        quoting isn't supported.
+   */
+  class CsvRow {
+  public:
+    CsvRow(const char* p, size_t n) : p(p), n(n) {;}
+
+    /** \brief the number of fields in the row */
+    size_t size() const {
+      return 1 + std::count(p, p + n, ',');
+    }
+
+    /** \brief field i (counting from 0); throws a TinyTestException if the
+     *         row doesn't have that many fields */
+    CsvField operator[](size_t i) const {
+      const char* start = p;
+      const char* end = p + n;
+      for (; i > 0; --i) {
+        start = static_cast<const char*>(memchr(start, ',', end - start));
+        if (start == NULL) {
+          std::stringstream ss;
+          ss << "CSV row \"" << line() << "\" has only " << size()
+             << " fields";
+          throw TinyTestException(ss.str());
+        }
+        ++start;
+      }
+      const char* stop = static_cast<const char*>(
+        memchr(start, ',', end - start));
+      return CsvField(start, (stop == NULL ? end : stop) - start);
+    }
+
+    /** \brief the whole line, without its line ending */
+    CsvField line() const { return CsvField(p, n); }
+
+  private:
+    const char* p;
+    size_t n;
+  };
+
+  /**
+   * \brief The rows of a CSV file, for TEST_P; blank lines are skipped, as
+   *        is the first line if the file has a header. The file is mapped
+   *        and indexed the first time the test is selected; the index only
+   *        records where every CHECKPOINT'th row starts, so it stays small
+   *        however long the file is.
+   */
+  class CsvRows {
+  public:
+    typedef CsvRow Row;
+
+    CsvRows(const char* path, bool header) :
+      path(path), header(header), rows(0) {;}
+
+    /** \brief map and index the file; false (and why) if it can't be */
+    bool open(std::string& error);
+
+    /** \brief the number of rows */
+    size_t size() const { return rows; }
+
+    /** \brief call f(row, index) for each of rows first to last - 1 */
+    template<typename F>
+    void forEach(size_t first, size_t last, F f) const {
+      if (first >= last) return;
+      const char* end = file->data() + file->size();
+      const char* p = file->data() + checkpoints[first / CHECKPOINT];
+      for (size_t i = first - first % CHECKPOINT; i < last; ++i) {
+        size_t n = 0;
+        p = nextRow(p, end, n);
+        if (i >= first) f(Row(p, n), i);
+        p += n;
+      }
+    }
+
+  private:
+    static const size_t CHECKPOINT = 1024;
+
+    /** \brief find the row starting at or after p (skipping blank lines and
+     *         line endings) and set n to its length */
+    static const char* nextRow(const char* p, const char* end, size_t& n) {
+      n = 0;
+      while (p < end && (*p == '\n' || *p == '\r')) ++p;
+      if (p == end) return p;
+      const char* eol = static_cast<const char*>(memchr(p, '\n', end - p));
+      if (eol == NULL) eol = end;
+      n = eol - p;
+      if (n > 0 && p[n - 1] == '\r') --n;
+      return p;
+    }
+
+    const char* path;
+    bool header;
+    std::shared_ptr<MappedFile> file;
+    size_t rows;
+    /** the offset of every CHECKPOINT'th row in the file */
+    std::vector<size_t> checkpoints;
+  };
+
+  /**
+   * \brief The rows of a binary file holding an array of T, for TEST_P. T
+   *        must be trivially copyable, and the file must be written with
+   *        the layout T has on this platform.
+   */
+  template<typename T>
+  class BinaryRows {
+  public:
+    typedef T Row;
+
+    explicit BinaryRows(const char* path) : path(path) {;}
+
+    /** \brief map the file; false (and why) if it can't be */
+    bool open(std::string& error) {
+      file.reset(new MappedFile());
+      if (!file->open(path, error)) return false;
+      if (file->size() % sizeof(T) == 0) return true;
+      std::stringstream ss;
+      ss << path << " isn't a whole number of " << sizeof(T)
+         << "-byte rows";
+      error = ss.str();
+      return false;
+    }
+
+    /** \brief the number of rows */
+    size_t size() const { return file ? file->size() / sizeof(T) : 0; }
+
+    /** \brief call f(row, index) for each of rows first to last - 1 */
+    template<typename F>
+    void forEach(size_t first, size_t last, F f) const {
+      // the mapping is page-aligned, so every row is suitably aligned
+      const T* rows = reinterpret_cast<const T*>(file->data());
+      for (size_t i = first; i < last; ++i) f(rows[i], i);
+    }
+
+  private:
+#if !defined(__GNUC__) || __GNUC__ >= 5
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "binaryRows needs a trivially copyable row type");
+#endif
+    const char* path;
+    std::shared_ptr<MappedFile> file;
+  };
+
+  /** \brief The rows of an array defined in the test source, for TEST_P */
+  template<typename T>
+  class TableRows {
+  public:
+    typedef T Row;
+
+    TableRows(const T* rows, size_t n) : rows(rows), n(n) {;}
+
+    bool open(std::string&) { return true; }
+    size_t size() const { return n; }
+
+    /** \brief call f(row, index) for each of rows first to last - 1 */
+    template<typename F>
+    void forEach(size_t first, size_t last, F f) const {
+      for (size_t i = first; i < last; ++i) f(rows[i], i);
+    }
+
+  private:
+    const T* rows;
+    size_t n;
+  };
+
+  /** \brief the rows of the CSV file at path, skipping the first line if
+   *         the file has a header */
+  inline CsvRows csvRows(const char* path, bool header = false) {
+    return CsvRows(path, header);
+  }
+
+  /** \brief the rows of the binary file at path, an array of T */
+  template<typename T>
+  BinaryRows<T> binaryRows(const char* path) { return BinaryRows<T>(path); }
+
+  /** \brief the rows of an array */
+  template<typename T, size_t N>
+  TableRows<T> tableRows(const T (&rows)[N]) { return TableRows<T>(rows, N); }
+
+  /** \brief One input from the corpus of a fuzz test; it points into the
+   *         mapped file, so it's only valid while the input is being
+   *         tested */
+  struct FuzzInput {
+    const uint8_t* data;
+    size_t size;
+    /** the file the input came from; empty for the empty input */
+    const char* path;
+  };
+
+  /**
+   * \brief The corpus of a fuzz test, for FUZZ_TEST: the files in the
+   *        directory named after the test in the corpus directory (see
+   *        setCorpusDir), in name order. If there aren't any, the corpus is
+   *        just the empty input, as it is for libFuzzer; but if the corpus
+   *        directory was given and doesn't exist, it can't be opened. Each
+   *        file is
+   *        mapped while it's being tested, rather than read into a buffer.
+   */
+  class CorpusFiles {
+  public:
+    typedef FuzzInput Row;
+
+    explicit CorpusFiles(const char* target) : target(target) {;}
+
+    /** \brief list the files; false (and why) if they can't be */
+    bool open(std::string& error);
+
+    /** \brief the number of inputs */
+    size_t size() const { return files.size(); }
+
+    /** \brief call f(input, index) for each of inputs first to last - 1 */
+    template<typename F>
+    void forEach(size_t first, size_t last, F f) const {
+      // libFuzzer never passes NULL, even for the empty input
+      static const uint8_t none = 0;
+      for (size_t i = first; i < last; ++i) {
+        MappedFile file;
+        std::string error;
+        if (!files[i].empty() && !file.open(files[i], error))
+          throw TinyTestException(error);
+        FuzzInput in;
+        in.data = file.size() > 0 ?
+          reinterpret_cast<const uint8_t*>(file.data()) : &none;
+        in.size = file.size();
+        in.path = files[i].c_str();
+        f(in, i);
+      }
+    }
+
+  private:
+    const char* target;
+    std::vector<std::string> files;
+  };
+
+  /** \brief set the directory holding the fuzz tests' corpora (see
+   *         --corpus); it's "corpus" unless this is called. If mustExist
+   *         is set, a fuzz test fails if dir doesn't exist, rather than
+   *         getting just the empty input as it does when its own corpus
+   *         is missing. Defined in TinyTest.cpp */
+  void setCorpusDir(const std::string& dir, bool mustExist = true);
+
+  /** \brief throw the TinyTestException for a fuzz test that failed on the
+   *         input from path (empty for the empty input), with the exception
+   *         being handled as the reason. Defined in TinyTest.cpp. */
+  [[noreturn]] TINYTEST_COLD
+  void failFuzzInput(const char* path);
+
+  /**
+   * \brief The failures among the rows of a parameterised test that have
+   *        been run; the first few are kept in full. Defined in
+   *        TinyTest.cpp.
+   */
+  class RowFailures {
+  public:
+    RowFailures() : failed(0) {;}
+
+    /** \brief record that row index failed with the exception being
+     *         handled */
+    void add(size_t index);
+
+    /** \brief throw a TinyTestException summarising the failures among the
+     *         n rows run, if there were any; a lone row is rethrown as it
+     *         was */
+    void check(size_t n) const;
+
+  private:
+    static const size_t KEPT = 5;
+    size_t failed;
+    std::exception_ptr first;
+    std::vector<std::string> kept;
+  };
+}
+
+/**
+ * \brief Base class for parameterised tests, which run the same body on
+ *        every row of a table. The runner splits the rows into cases that
+ *        are reported (and run, with -j) separately: one per row for small
+ *        tables, or contiguous groups of rows for large ones. A failing row
+ *        doesn't stop the rest of its case from running.
+ */
+class ParamTestCaseBase : public TestCase {
+public:
+  /** \brief Construct a new parameterised test with the given name */
+  ParamTestCaseBase(const char* testName) : TestCase(testName) {;}
+
+  /** \brief The number of rows; 0 if the rows couldn't be opened */
+  size_t rowCount() const {
+    std::call_once(opened, [this]() {
+      const_cast<ParamTestCaseBase*>(this)->openRows(openError);
+    });
+    return openError.empty() ? rows() : 0;
+  }
+
+  /** \brief Run rows first to last - 1, throwing a summary of any that
+   *         failed. Defined in TinyTest.cpp. */
+  void runRows(size_t first, size_t last) const;
+
+  /** \brief Run every row, or report why they couldn't be opened */
+  virtual void runTest() const {
+    size_t n = rowCount();
+    if (!openError.empty()) throw TinyTestException(openError);
+    runRows(0, n);
+  }
+
+  virtual const ParamTestCaseBase* paramTest() const { return this; }
+
+protected:
+  /** \brief open the rows, setting error if that fails */
+  virtual void openRows(std::string& error) = 0;
+
+  /** \brief the number of rows, once opened */
+  virtual size_t rows() const = 0;
+
+  /** \brief run rows first to last - 1, recording the failures */
+  virtual void runRowRange(size_t first, size_t last,
+                           TinyTest::RowFailures& failures) const = 0;
+
+private:
+  mutable std::once_flag opened;
+  mutable std::string openError;
+};
+
+/**
+ * \brief Base class for tests over the rows of a Source (see
+ *        TinyTest::csvRows, binaryRows and tableRows). The TEST_P macro
+ *        defines sub-classes of this. Rows are handed to the body straight
+ *        from the source, so running them doesn't allocate.
+ */
+template<typename Source>
+class ParamTestCase : public ParamTestCaseBase {
+public:
+  typedef typename Source::Row Row;
+
+  /** \brief Construct a new parameterised test over the given rows */
+  ParamTestCase(const char* testName, const Source& source) :
+    ParamTestCaseBase(testName), source(source) {;}
+
+  /** \brief Run the body of the test on one row */
+  virtual void runRow(const Row& row, size_t rowIndex) const = 0;
+
+protected:
+  virtual void openRows(std::string& error) { source.open(error); }
+  virtual size_t rows() const { return source.size(); }
+
+  virtual void runRowRange(size_t first, size_t last,
+                           TinyTest::RowFailures& failures) const {
+    source.forEach(first, last, [&](const Row& row, size_t i) {
+      try {
+        runRow(row, i);
+      } catch (...) {
+        failures.add(i);
+      }
+    });
+  }
+
+private:
+  Source source;
+};
+
+/**
+ * \brief Base class for fuzz tests, which run a target on arbitrary bytes;
+ *        the FUZZ_TEST macro defines sub-classes of this. In a normal run
+ *        the target is run on each input in its corpus (see
+ *        TinyTest::CorpusFiles), which are split into cases like the rows
+ *        of a parameterised test. A program built for libFuzzer can hand the
+ *        target to it instead (see --fuzz).
+ */
+class FuzzTestCase : public ParamTestCase<TinyTest::CorpusFiles> {
+public:
+  /** \brief Construct a new fuzz test with the given name */
+  FuzzTestCase(const char* testName) :
+    ParamTestCase<TinyTest::CorpusFiles>(testName,
+                                         TinyTest::CorpusFiles(testName)) {;}
+
+  /** \brief Run the target on the size bytes at data; it fails by throwing
+   *         (or crashing) */
+  virtual void fuzz(const uint8_t* data, size_t size) const = 0;
+
+  /** \brief Run the target on one input of the corpus, naming the input's
+   *         file if it fails */
+  virtual void runRow(const Row& row, size_t) const {
+    try {
+      fuzz(row.data, row.size);
+    } catch (...) {
+      TinyTest::failFuzzInput(row.path);
+    }
+  }
+
+  virtual const FuzzTestCase* fuzzTest() const { return this; }
 };
 
 /**
@@ -290,86 +2395,204 @@ public:
    *        call just returns a reference to the same set.
    */
   static TestSet& getTestSet() {
-    static TestSet* tset = new TestSet();
-    return *tset;
+    static TestSet tset;
+    return tset;
   }
 
   /**
-   * \brief add a test case to this test set.
+   * \brief add a test case to the end of this test set. This neither
+   *        allocates nor does any I/O, as it's called for every test during
+   *        static initialisation. A test case can only belong to one set.
    */
-  void addTest(const TestCase* b) {
-    tests.push_back(b);
-    std::cout << "Discovered test: " << b->getTestName() << std::endl;
+  void addTest(TestCase* b) {
+    b->nextTest = NULL;
+    if (lastTest == NULL) firstTest = b;
+    else lastTest->nextTest = b;
+    lastTest = b;
   }
 
   /**
-   * \brief run all of the test cases in this test set and output their
-   *        name and success/failure to stderr.
+   * \brief run all of the test cases in this test set serially and output
+   *        their name and success/failure to stdout.
    */
-  bool run() {
-    bool okay = true;
-    size_t maxPad = this->maxNameLength();
-    for (size_t i = 0; i < tests.size(); ++i) {
-      assert(tests[i]->getTestName().size() <= maxPad);
-      size_t pad = maxPad - tests[i]->getTestName().size();
-      std::string padding (pad, ' ');
-      std::cout << tests[i]->getTestName() << " ... " << padding;
-      try {
-        tests[i]->runTest();
-        std::cout << "[PASSED]" << std::endl;
-      } catch (const TinyTestException &e) {
-        if (std::string(e.what()).empty())
-          std::cout << "[FAILED] [Reason: UNKNOWN]" << std::endl;
-        else
-          std::cout << "[FAILED] [Reason: " << e.what() << "]" << std::endl;
-        okay = false;
-      } catch (const std::exception& ex) {
-        if (std::string(ex.what()).empty())
-          std::cout << "[FAILED] [Reason: An unexpected exception was thrown "
-                    << "-- no further details]" << std::endl;
-        else
-          std::cout << "[FAILED] [Reason: An unexpected exception was thrown "
-                    << "details: " << ex.what() << "]" << std::endl;
-        okay = false;
-      } catch (...) {
-        std::cout << "[FAILED] [Reason: An unexpected exception was thrown "
-                  << "-- no further details]" << std::endl;
-        okay = false;
-      }
-    }
-    return okay;
-  }
+  bool run() { return run(TinyTest::RunOptions()); }
+
+  /**
+   * \brief run all of the test cases in this test set according to the given
+   *        options and output their name and success/failure to stdout.
+   *        Results are always written in the order the tests were selected
+   *        (registration order, unless the options reorder them using
+   *        earlier results, with async tests and then benchmarks last), so
+   *        the output is identical whether or not the tests were run in
+   *        parallel.
+   *        If opts.list is set, the names of the tests that would have been
+   *        run are printed instead. Defined in TinyTest.cpp.
+   */
+  bool run(const TinyTest::RunOptions& opts);
+
+  /** \brief the fuzz test called name; NULL if there isn't one */
+  const FuzzTestCase* fuzzTest(const std::string& name) const;
 
 private:
-  /** collection of test cases in this test set; store as pointers to allows
-   *  run-time polymorphism; user-defined test cases extend TestCase.
+  /** the test cases in this test set, in registration order, linked through
+   *  TestCase::nextTest; user-defined test cases extend TestCase.
    */
-  std::vector<const TestCase*> tests;
+  TestCase* firstTest;
+  TestCase* lastTest;
+
+  /** the cases the selected parameterised tests were split into */
+  std::vector<std::unique_ptr<TestCase> > rowCases;
 
   /** \brief make the constructor private; this is a factory class, so we
    *         disallow construction from outside.
    */
-  TestSet()  {;}
+  TestSet() : firstTest(NULL), lastTest(NULL) {;}
 
   /** \brief make the destructor private */
   ~TestSet()  {;}
 
-  /** \brief what is the length of the name of the test with the longest name */
-  size_t maxNameLength() const {
-    size_t m = 0;
-    for (size_t i = 0; i < tests.size(); ++i)
-      if (tests[i]->getTestName().size() > m)
-        m = tests[i]->getTestName().size();
-    return m;
+  /** \brief the outcome of running a single test case */
+  struct TestResult {
+    TestResult() : passed(false), measured(false), timedOut(false) {;}
+    /** true if the test completed without throwing anything */
+    bool passed;
+    /** the reason for failure, formatted ready for output; empty on pass */
+    std::string reason;
+    /** true if usage was collected for this test */
+    bool measured;
+    /** what the test used; only meaningful if measured is true */
+    TinyTest::ResourceUsage usage;
+    /** true if the test failed by running out of time */
+    bool timedOut;
+  };
+
+  /** \brief the results for a TestList, in the same order */
+  typedef std::vector<TestResult> ResultList;
+
+  /** \brief told the index and result of each test, in the order the tests
+   *         were selected, as the results become available */
+  typedef std::function<void(size_t, const TestResult&)> Finished;
+
+  /** \brief run a single test case, catching anything it throws; also
+   *         record the resources it used, and check it for leaks, if opts
+   *         call for that */
+  static void runTestCase(const TestCase* t, TestResult& res,
+                          const TinyTest::RunOptions& opts);
+
+  /** \brief sample what opts call for measuring, as a test starts */
+  static void startMeasuring(const TinyTest::RunOptions& opts,
+                             TinyTest::TestSample& sample);
+
+  /** \brief fill in what test t used since sample was taken, and check it
+   *         for leaks, as opts call for, once res says how it went; then
+   *         tell its shared fixture, if it has one, that it's done with */
+  static void finishMeasuring(const TestCase* t,
+                              const TinyTest::RunOptions& opts,
+                              const TinyTest::TestSample& sample,
+                              TestResult& res);
+
+  /** \brief run body, recording in res whether (and how) it failed */
+  static void runGuarded(const std::function<void()>& body, TestResult& res);
+
+  /** \brief the time limit for test t in ms; 0 if there isn't one. Limits
+   *         are cut to 1e9 ms (11 days), which is as good as forever and
+   *         keeps deadlines and poll timeouts from overflowing */
+  static double timeLimitMs(const TestCase* t,
+                            const TinyTest::RunOptions& opts) {
+    double ms = t->getTimeoutMs() > 0 ? t->getTimeoutMs() : opts.timeoutMs;
+    return std::min(ms, 1e9);
   }
+
+  /** \brief what the reporters are told about test t, the index'th test in
+   *         the run, once it has finished with result res */
+  static TinyTest::TestEvent makeEvent(const TestCase* t, size_t index,
+                                       const TestResult& res);
+
+  /** \brief a list of (pointers to) test cases selected to be run */
+  typedef std::vector<const TestCase*> TestList;
+
+  /** \brief run the tests one after the other on the calling thread */
+  void runSerial(const TestList& sel, const TinyTest::RunOptions& opts,
+                 ResultList& results, TinyTest::ReportPipeline& report);
+
+  /** \brief run the tests on a pool of opts.jobs worker threads, passing
+   *         each result to finished */
+  void runParallel(const TestList& sel, const TinyTest::RunOptions& opts,
+                   ResultList& results, TinyTest::ReportPipeline& report,
+                   const Finished& finished);
+
+  /** \brief run the tests in a pool of opts.jobs forked worker processes,
+   *         passing each result to finished; report is flushed before
+   *         each worker is forked */
+  void runIsolated(const TestList& sel, const TinyTest::RunOptions& opts,
+                   ResultList& results, TinyTest::ReportPipeline& report,
+                   const Finished& finished);
+
+  /** \brief run the async tests in sel, from first on, together on an
+   *         event loop on the calling thread, passing each result to
+   *         finished; a test that blocks the loop past its time limit is
+   *         reported, and the run given up, as with runSerial */
+  void runAsyncTests(const TestList& sel, size_t first,
+                     const TinyTest::RunOptions& opts, ResultList& results,
+                     TinyTest::ReportPipeline& report,
+                     const Finished& finished);
+
+  /** \brief run the tests opts.repeat times (or until one fails, with
+   *         opts.untilFail), a batch of iterations at a time, in parallel
+   *         or isolated as opts say; each test's result counts its failures
+   *         and gives the reason for the first */
+  void runRepeated(const TestList& sel, const TinyTest::RunOptions& opts,
+                   ResultList& results, TinyTest::ReportPipeline& report);
+
+  /** \brief the tests (and benchmarks, if they're wanted) that pass the
+   *         filters and belong to our shard, in registration order unless
+   *         opts ask for them to be reordered using opts.cacheFile or
+   *         shuffled */
+  TestList select(const TinyTest::RunOptions& opts);
+
+  /** \brief add the cases that test t is split into, and which pass the
+   *         filters, to sel */
+  void addRowCases(const ParamTestCaseBase* t,
+                   const TinyTest::RunOptions& opts, TestList& sel);
+
+  /** \brief apply --only-failed, --failed-first and --longest-first to the
+   *         tests in sel */
+  static void reorder(TestList& sel, const TinyTest::RunOptions& opts);
+
+  /** \brief record the results in opts.cacheFile, dropping any tests that
+   *         are no longer registered; returns false if it couldn't be
+   *         written */
+  bool updateCache(const TestList& sel, const ResultList& results,
+                   const TinyTest::RunOptions& opts) const;
+
+  /** \brief write the wall time of each measured test to opts.saveTimingsFile;
+   *         returns false if the file couldn't be written */
+  static bool saveTimings(const TestList& sel, const ResultList& results,
+                          const TinyTest::RunOptions& opts);
+
+  /** \brief give up the run after a test overran that can't be stopped:
+   *         record ran's results in opts.cacheFile and opts.saveTimingsFile
+   *         (those that finished, and the one that overran), tell report
+   *         the run was abandoned, and exit */
+  [[noreturn]] void giveUp(const TestList& ran, const ResultList& results,
+                           const TinyTest::RunOptions& opts,
+                           TinyTest::ReportPipeline& report) const;
+
+  /** \brief time the benchmarks, one after the other on the calling thread;
+   *         firstIndex is the index in the run of the first of them.
+   *         Returns the number that failed. */
+  size_t runBenchmarks(const TestList& sel, size_t firstIndex,
+                       const TinyTest::RunOptions& opts,
+                       TinyTest::ReportPipeline& report);
 };
 
 /**
  * \brief This is a helper class that facilitates automatic registration of
- *        tests. When one of these is constructed, it is given a TestSet
+ *        tests. When one of these is constructed, it is given a TestCase
  *        pointer (in reality, a pointer to an object that is a subclass of
- *        TestSet), which it registers with a static test set maintained by
- *        the TestSet class.
+ *        TestCase), which it registers with a static test set maintained by
+ *        the TestSet class. The test case must outlive the test set, so it
+ *        should have static storage duration.
  */
 class TestCaseAdder {
 public:
@@ -379,7 +2602,7 @@ public:
    *        test set, so these are always registered with the same test
    *        at the moment.
    */
-  TestCaseAdder(const TestCase* b) { TestSet::getTestSet().addTest(b); }
+  TestCaseAdder(TestCase* b) { TestSet::getTestSet().addTest(b); }
 
   /**
    * \brief destructor; nothing to do here really.
@@ -392,23 +2615,158 @@ public:
  ******************************************************************************/
 
 /**
- * \brief This is the macro that users will employ to define their tests. Each
- *        test they define is a sub-class of TestCase. We use a little trick
- *        here to do automatic test registration. The class has a static member
- *        of TestCaseAdder, which we initialise when the macro is expanded,
- *        passing to it an object constructed from the newly defined test case
- *        class. The TestCaseAdder then just registers this object with a
- *        static test set maintained by the TestSet class.
- */
-#define TEST(NAME)                                                      \
-  class NAME : public TestCase {                                        \
+ * \brief The class behind every test macro: a sub-class NAME of BASE (whose
+ *        constructor is given BASE_ARGS) with the given attributes and the
+ *        members in the remaining arguments. We use a little trick here to
+ *        do automatic test registration. The class has a static instance of
+ *        itself and a static member of TestCaseAdder, which we initialise
+ *        when the macro is expanded, passing to it the instance. The
+ *        TestCaseAdder then just links the instance into a static test set
+ *        maintained by the TestSet class. Nothing is allocated and nothing
+ *        is printed, so registration stays cheap however many tests there
+ *        are.
+ */
+#define TINYTEST_DEFINE_TEST(NAME, BASE, BASE_ARGS, ATTRIBUTES, ...)    \
+  class NAME : public BASE {                                            \
     public:                                                             \
-      NAME(const std::string& testName) : TestCase( testName ) { ; }    \
-      virtual void runTest() const;                                     \
+      NAME(const char* testName) : BASE BASE_ARGS {                     \
+        setAttributes(ATTRIBUTES);                                      \
+      }                                                                 \
+      __VA_ARGS__                                                       \
     private:                                                            \
+      static NAME instance;                                             \
       static TestCaseAdder adder;                                       \
   };                                                                    \
-  TestCaseAdder NAME::adder(new NAME(#NAME));                           \
+  NAME NAME::instance(#NAME);                                           \
+  TestCaseAdder NAME::adder(&NAME::instance);
+
+/**
+ * \brief This is the macro that users will employ to define their tests. Each
+ *        test they define is a sub-class of TestCase.
+ */
+#define TEST(NAME) TEST_WITH(NAME, TinyTest::TestAttributes())
+
+/**
+ * \brief Define a test like TEST, but with ATTRIBUTES, a
+ *        TinyTest::TestAttributes (e.g. TinyTest::withTimeout(MS)) saying
+ *        how it's to be run. Each of the other kinds of test has a _WITH
+ *        form too.
+ */
+#define TEST_WITH(NAME, ATTRIBUTES)                                     \
+  TINYTEST_DEFINE_TEST(NAME, TestCase, (testName), ATTRIBUTES,          \
+                       virtual void runTest() const;)                   \
   void NAME::runTest() const
 
+/**
+ * \brief Define a test with its own time limit of MS milliseconds, which
+ *        overrides the one given to the runner with --timeout; otherwise
+ *        this is just like TEST.
+ */
+#define TEST_TIMEOUT(NAME, MS) TEST_WITH(NAME, TinyTest::withTimeout(MS))
+
+/**
+ * \brief Define a test that needs RESOURCES while it runs, which is a string
+ *        listing them, separated by commas: "NAME" for all of a resource, or
+ *        "NAME=AMOUNT" for part of one, e.g. "port8080, memory=8192"; an
+ *        AMOUNT must be a non-negative number. Tests run in parallel are
+ *        never run at the same time if together they'd need more of any
+ *        resource than there is; otherwise this is just like TEST.
+ */
+#define TEST_RESOURCES(NAME, RESOURCES)                                 \
+  TEST_WITH(NAME, TinyTest::withResources(RESOURCES))
+
+#ifdef TINYTEST_HAS_COROUTINES
+/**
+ * \brief Define a test whose body is a coroutine (so needs C++20): it can
+ *        co_await TinyTest::readable(fd), TinyTest::writable(fd),
+ *        TinyTest::sleepFor(duration) and other coroutines returning
+ *        TinyTest::AsyncTask, and the assertions work as they do in TEST.
+ *        Async tests run together on one thread, each one carrying on while
+ *        the others wait; otherwise this is just like TEST.
+ */
+#define TEST_ASYNC(NAME) TEST_ASYNC_WITH(NAME, TinyTest::TestAttributes())
+
+/** \brief Define an async test with the given attributes (see TEST_WITH) */
+#define TEST_ASYNC_WITH(NAME, ATTRIBUTES)                               \
+  TINYTEST_DEFINE_TEST(NAME, AsyncTestCase, (testName), ATTRIBUTES,     \
+                       virtual TinyTest::AsyncTask runAsync() const;)   \
+  TinyTest::AsyncTask NAME::runAsync() const
+#endif
+
+/**
+ * \brief Define a test that uses a fixture; this works just like TEST, except
+ *        that the body gets a const reference called fixture to an instance
+ *        of FIXTURE, a default-constructible class that does the expensive
+ *        setup in its constructor and any teardown in its destructor. The
+ *        instance is built when the first test using it runs, shared by all
+ *        of them and destroyed after the last one has finished.
+ */
+#define TEST_F(FIXTURE, NAME)                                           \
+  TEST_F_WITH(FIXTURE, NAME, TinyTest::TestAttributes())
+
+/** \brief Define a fixture test with the given attributes (see TEST_WITH) */
+#define TEST_F_WITH(FIXTURE, NAME, ATTRIBUTES)                          \
+  TINYTEST_DEFINE_TEST(NAME, FixtureTestCase<FIXTURE>, (testName),      \
+    ATTRIBUTES,                                                         \
+    virtual void runFixtureTest(const FIXTURE& fixture) const;)         \
+  void NAME::runFixtureTest(const FIXTURE& fixture) const
+
+/**
+ * \brief Define a test that is run on every row of SOURCE, which is one of
+ *        TinyTest::csvRows(PATH), TinyTest::binaryRows<T>(PATH) or
+ *        TinyTest::tableRows(ARRAY). The body gets a const reference called
+ *        row to the row being tested (a TinyTest::CsvRow, a T or an element
+ *        of ARRAY respectively) and its index, rowIndex. Each row is
+ *        reported separately, or in groups for large tables.
+ */
+#define TEST_P(NAME, SOURCE)                                            \
+  TEST_P_WITH(NAME, SOURCE, TinyTest::TestAttributes())
+
+/** \brief Define a parameterised test with the given attributes (see
+ *         TEST_WITH), which apply to each of its rows or groups of rows */
+#define TEST_P_WITH(NAME, SOURCE, ATTRIBUTES)                           \
+  TINYTEST_DEFINE_TEST(NAME, ParamTestCase<decltype(SOURCE)>,           \
+    (testName, SOURCE), ATTRIBUTES,                                     \
+    virtual void runRow(const Row& row, size_t rowIndex) const;)        \
+  void NAME::runRow(const Row& row, size_t rowIndex) const
+
+/**
+ * \brief Define a fuzz test: a target that's given arbitrary bytes, as
+ *        FUZZ_TEST(NAME)(const uint8_t* data, size_t size) { ... }, and
+ *        should fail (by way of the assertions, or by crashing) only if
+ *        they expose a bug. Normally, the target is run on each file in
+ *        corpus/NAME (see --corpus), so inputs that once found bugs are
+ *        kept as regression tests; the files are split into cases that
+ *        are reported (and run, with -j) separately. If the program is
+ *        built with clang -fsanitize=fuzzer and -DTINYTEST_FUZZER,
+ *        --fuzz NAME hands the target to libFuzzer, which adds the inputs
+ *        it finds to the same corpus.
+ */
+#define FUZZ_TEST(NAME) FUZZ_TEST_WITH(NAME, TinyTest::TestAttributes())
+
+/** \brief Define a fuzz test with the given attributes (see TEST_WITH),
+ *         which apply to each of its cases */
+#define FUZZ_TEST_WITH(NAME, ATTRIBUTES)                                \
+  TINYTEST_DEFINE_TEST(NAME, FuzzTestCase, (testName), ATTRIBUTES,      \
+      virtual void fuzz(const uint8_t* data, size_t size) const {       \
+        fuzzInput(data, size);                                          \
+      }                                                                 \
+    private:                                                            \
+      static void fuzzInput(const uint8_t* data, size_t size);)         \
+  void NAME::fuzzInput
+
+/**
+ * \brief Define a benchmark; this works just like TEST, except that the body
+ *        gets a TinyTest::BenchmarkState called bench and should put the work
+ *        to be measured in a loop on bench.keepRunning(). Benchmarks are
+ *        skipped unless the runner is given --benchmarks, in which case the
+ *        number of iterations is calibrated automatically and the time per
+ *        iteration is reported.
+ */
+#define BENCHMARK(NAME)                                                 \
+  TINYTEST_DEFINE_TEST(NAME, BenchmarkCase, (testName),                 \
+    TinyTest::TestAttributes(),                                         \
+    virtual void runBenchmark(TinyTest::BenchmarkState& bench) const;)  \
+  void NAME::runBenchmark(TinyTest::BenchmarkState& bench) const
+
 #endif